@@ -0,0 +1,114 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "parallel.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering"). Each pass
+// is a sparse 5x5 B3 spline kernel whose taps are 2^pass pixels apart, and the
+// weight of a tap is cut down when it lands on another object, or on a pixel with
+// a different normal, albedo, depth or luminance. A few passes cover a large
+// footprint at the cost of 25 taps per pixel and per pass.
+//
+// As in SVGF (Schied et al. 2017), the luminance is compared relatively to its
+// standard error, filtered along with the colors: converged pixels keep their
+// value, and only the noisy ones are smoothed.
+//
+// The buffers hold one value per pixel, with pixel (i, j) at index i * h + j like
+// the matrices of the image.
+
+// Auxiliary buffers of the first hits of the camera rays, averaged over the
+// samples of each pixel
+struct AovBuffers {
+	static const int background = -1; // Object of the pixels that only see the background
+	static const int mixed = -2;      // Object of the pixels whose samples hit several objects
+
+	int width = 0;
+	int height = 0;
+	std::vector<Eigen::Vector3d> normal; // Zero for the background
+	std::vector<Eigen::Vector3d> albedo; // Diffuse color of the material, background color for the background
+	std::vector<double> depth;           // Distance to the camera of the samples that hit an object
+	std::vector<int> object;             // Index in scene.objects, or background, or mixed
+
+	AovBuffers() {}
+
+	AovBuffers(int w, int h)
+	    : width(w), height(h), normal(size_t(w) * h, Eigen::Vector3d::Zero()),
+	      albedo(size_t(w) * h, Eigen::Vector3d::Zero()), depth(size_t(w) * h, 0), object(size_t(w) * h, background) {}
+};
+
+// Widths of the edge-stopping functions
+struct DenoiseParams {
+	double sigma_luminance = 4; // Luminance difference, in standard errors
+	double sigma_normal = 0.15; // Norm of the difference of the normals
+	double sigma_albedo = 0.1;  // Norm of the difference of the albedos
+	double sigma_depth = 0.02;  // Relative depth difference, per pixel of the step
+};
+
+inline double luminance(const Eigen::Vector3d &c) {
+	return 0.2126 * c(0) + 0.7152 * c(1) + 0.0722 * c(2);
+}
+
+// Filter 'color' in place with 'passes' passes, on 'threads' threads. 'variance'
+// is the variance of the mean luminance of each pixel (clamped to [0, 1]).
+void denoise_atrous(std::vector<Eigen::Vector3d> &color, std::vector<double> variance, const AovBuffers &aov,
+                    int passes, int threads, const DenoiseParams &params = DenoiseParams()) {
+	const double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+	int w = aov.width;
+	int h = aov.height;
+	std::vector<Eigen::Vector3d> filtered(color.size());
+	std::vector<double> filtered_variance(variance.size());
+
+	for (int pass = 0, step = 1; pass < passes; ++pass, step *= 2) {
+		// One column of pixels per task, a task only writes its own column
+		parallel_for(w, threads, 1, [&](int i) {
+			for (int j = 0; j < h; ++j) {
+				size_t p = size_t(i) * h + j;
+				double lp = luminance(color[p].cwiseMax(0.0).cwiseMin(1.0));
+				double sigma_l = params.sigma_luminance * std::sqrt(variance[p]) + 1e-6;
+				Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+				double weight_sum = 0, variance_sum = 0;
+				for (int dx = -2; dx <= 2; ++dx) {
+					int x = i + dx * step;
+					if (x < 0 || x >= w) continue;
+					for (int dy = -2; dy <= 2; ++dy) {
+						int y = j + dy * step;
+						if (y < 0 || y >= h) continue;
+						size_t q = size_t(x) * h + y;
+						// Two pixels covered by a single object each are on either side of an edge
+						if (aov.object[q] != aov.object[p] && aov.object[q] != AovBuffers::mixed &&
+						    aov.object[p] != AovBuffers::mixed)
+							continue;
+
+						double dl = (luminance(color[q].cwiseMax(0.0).cwiseMin(1.0)) - lp) / sigma_l;
+						double e = dl * dl;
+						e += (aov.normal[q] - aov.normal[p]).squaredNorm() / (params.sigma_normal * params.sigma_normal);
+						e += (aov.albedo[q] - aov.albedo[p]).squaredNorm() / (params.sigma_albedo * params.sigma_albedo);
+						if (aov.object[p] != AovBuffers::background && aov.object[q] != AovBuffers::background) {
+							double dz = std::abs(aov.depth[q] - aov.depth[p]) /
+							            (params.sigma_depth * step * std::max(aov.depth[p], 1e-8));
+							e += dz * dz;
+						}
+						double weight = kernel[dx + 2] * kernel[dy + 2] * std::exp(-e);
+						sum += weight * color[q];
+						weight_sum += weight;
+						variance_sum += weight * weight * variance[q];
+					}
+				}
+				// The center tap always has a weight of (3/8)^2
+				filtered[p] = sum / weight_sum;
+				filtered_variance[p] = variance_sum / (weight_sum * weight_sum);
+			}
+		});
+		color.swap(filtered);
+		variance.swap(filtered_variance);
+	}
+}
+
+#endif
@@ -7,7 +7,15 @@
 #include <string>
 #include <vector>
 #include <gif.h>
-#include <random>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <map>
+#include <chrono>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 // Eigen for matrix operations
 #include <Eigen/Dense>
@@ -17,6 +25,11 @@
 
 #include "stb_image_write.h"
 #include "utils.h"
+#include "sampler.h"
+#include "parallel.h"
+#include "scene_cache.h"
+#include "render_config.h"
+#include "denoise.h"
 
 // JSON parser library (https://github.com/nlohmann/json)
 #include "json.hpp"
@@ -26,6 +39,16 @@ using json = nlohmann::json;
 // Shortcut to avoid Eigen:: everywhere, DO NOT USE IN .h
 using namespace Eigen;
 
+// Test the last occluder of a light first for the shadow rays, see OccluderCache
+bool use_occluder_cache = true;
+
+// Materials with at least this many spheres are packed in a SphereSet
+int sphere_set_min = 16;
+
+// Reuse the compiled scene of a previous run when the inputs did not change, see
+// load_scene_cache()
+bool use_scene_cache = true;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Define types & classes
 ////////////////////////////////////////////////////////////////////////////////
@@ -88,11 +111,51 @@ struct Sphere : public Object {
     virtual bool intersect(const Ray &ray, Intersection &hit) override;
 };
 
+// Plane spanned by origin + a * u + b * v, precomputed at scene load so that a
+// ray test is a handful of dot products instead of a 3x3 linear solve
+struct PlanarPatch {
+    Vector3d normal; // Unit normal, u.cross(v) normalized
+    double offset;   // normal.dot(x) == offset for the points of the plane
+    Vector3d u_dual; // Reciprocal basis: a = x.dot(u_dual) - u_offset
+    Vector3d v_dual; //                   b = x.dot(v_dual) - v_offset
+    double u_offset;
+    double v_offset;
+
+    PlanarPatch() {}
+
+    PlanarPatch(const Vector3d &origin, const Vector3d &u, const Vector3d &v);
+
+    // Compute the ray parameter 't' and the coordinates (a, b) of the point where
+    // the ray crosses the plane. Returns false if the ray is parallel to the plane.
+    bool intersect(const Ray &ray, double &t, double &a, double &b) const;
+};
+
+// Spheres sharing a material, packed as a structure of arrays in blocks of
+// 'width' lanes, so that a ray is tested against a whole block with SIMD
+// instructions (AVX-512 or AVX2 when the compiler targets them). Scenes with many
+// spheres use a single SphereSet per material instead of one Sphere per entry.
+struct SphereSet : public Object {
+    static const int width = 8;
+
+    // Centers and squared radii, padded to a multiple of 'width'. Padding lanes have
+    // a negative squared radius, and are never hit.
+    std::vector<double> cx, cy, cz, r2;
+    int count = 0;
+
+    virtual ~SphereSet() = default;
+
+    void add(const Vector3d &center, double radius);
+
+    virtual bool intersect(const Ray &ray, Intersection &hit) override;
+};
+
 struct Parallelogram : public Object {
     Vector3d origin;
     Vector3d u;
     Vector3d v;
 
+    PlanarPatch plane; // Set up by load_scene()
+
     virtual ~Parallelogram() = default;
 
     virtual bool intersect(const Ray &ray, Intersection &hit) override;
@@ -106,6 +169,8 @@ struct Scene {
     std::vector<Material> materials;
     std::vector<Light> lights;
     std::vector<ObjectPtr> objects;
+
+    RenderConfig render; // Defaults of the assignment and "Render" block of the scene file
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -130,16 +195,156 @@ bool Sphere::intersect(const Ray &ray, Intersection &hit) {
     } else return false;
 }
 
+PlanarPatch::PlanarPatch(const Vector3d &origin, const Vector3d &u, const Vector3d &v) {
+    Vector3d n = u.cross(v);
+    double n2 = n.squaredNorm();
+    normal = n.normalized();
+    offset = normal.dot(origin);
+    // Degenerate patches get a null basis, and are never hit
+    u_dual = n2 > 0 ? Vector3d(v.cross(n) / n2) : Vector3d(0, 0, 0);
+    v_dual = n2 > 0 ? Vector3d(n.cross(u) / n2) : Vector3d(0, 0, 0);
+    u_offset = origin.dot(u_dual);
+    v_offset = origin.dot(v_dual);
+}
+
+bool PlanarPatch::intersect(const Ray &ray, double &t, double &a, double &b) const {
+    double denom = normal.dot(ray.direction);
+    if (denom == 0) return false;
+    t = (offset - normal.dot(ray.origin)) / denom;
+    Vector3d p = ray.origin + t * ray.direction;
+    a = p.dot(u_dual) - u_offset;
+    b = p.dot(v_dual) - v_offset;
+    return true;
+}
+
+void SphereSet::add(const Vector3d &center, double radius) {
+    if (count % width == 0) {
+        cx.resize(count + width, 0);
+        cy.resize(count + width, 0);
+        cz.resize(count + width, 0);
+        r2.resize(count + width, -1);
+    }
+    cx[count] = center(0);
+    cy[count] = center(1);
+    cz[count] = center(2);
+    r2[count] = radius * radius;
+    count++;
+}
+
+bool SphereSet::intersect(const Ray &ray, Intersection &hit) {
+    // Same test as Sphere::intersect() on every lane, with the half-b form of the
+    // quadratic: t = (-b -+ sqrt(b^2 - a c)) / a. Each lane keeps the closest valid
+    // hit of its column, and the lanes are reduced at the end (horizontal min).
+    const double eps = pow(10, -5);
+    const double a = ray.direction.dot(ray.direction);
+    double best_t[width], best_i[width];
+    int n = cx.size();
+
+#if defined(__AVX512F__)
+    const __m512d ox = _mm512_set1_pd(ray.origin(0)), oy = _mm512_set1_pd(ray.origin(1)), oz = _mm512_set1_pd(ray.origin(2));
+    const __m512d dx = _mm512_set1_pd(ray.direction(0)), dy = _mm512_set1_pd(ray.direction(1)), dz = _mm512_set1_pd(ray.direction(2));
+    const __m512d va = _mm512_set1_pd(a), veps = _mm512_set1_pd(eps), zero = _mm512_setzero_pd();
+    const __m512d lanes = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    __m512d vbest_t = _mm512_set1_pd(INFINITY), vbest_i = _mm512_set1_pd(-1);
+    for (int i = 0; i < n; i += width) {
+        __m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(&cx[i]));
+        __m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(&cy[i]));
+        __m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(&cz[i]));
+        __m512d b = _mm512_fmadd_pd(dx, ocx, _mm512_fmadd_pd(dy, ocy, _mm512_mul_pd(dz, ocz)));
+        __m512d c = _mm512_sub_pd(_mm512_fmadd_pd(ocx, ocx, _mm512_fmadd_pd(ocy, ocy, _mm512_mul_pd(ocz, ocz))),
+                                  _mm512_loadu_pd(&r2[i]));
+        __m512d disc = _mm512_fmsub_pd(b, b, _mm512_mul_pd(va, c));
+        __mmask8 valid = _mm512_cmp_pd_mask(disc, zero, _CMP_GE_OQ);
+        if (!valid) continue;
+        __m512d sq = _mm512_sqrt_pd(_mm512_max_pd(disc, zero));
+        __m512d t0 = _mm512_div_pd(_mm512_sub_pd(_mm512_sub_pd(zero, b), sq), va);
+        __m512d t1 = _mm512_div_pd(_mm512_add_pd(_mm512_sub_pd(zero, b), sq), va);
+        __m512d t = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t0, zero, _CMP_LT_OQ), t0, t1);
+        valid &= _mm512_cmp_pd_mask(t, veps, _CMP_GT_OQ) & _mm512_cmp_pd_mask(t, vbest_t, _CMP_LT_OQ);
+        vbest_t = _mm512_mask_blend_pd(valid, vbest_t, t);
+        vbest_i = _mm512_mask_blend_pd(valid, vbest_i, _mm512_add_pd(lanes, _mm512_set1_pd(i)));
+    }
+    _mm512_storeu_pd(best_t, vbest_t);
+    _mm512_storeu_pd(best_i, vbest_i);
+#elif defined(__AVX2__)
+    // Two registers of 4 doubles per block
+    const __m256d ox = _mm256_set1_pd(ray.origin(0)), oy = _mm256_set1_pd(ray.origin(1)), oz = _mm256_set1_pd(ray.origin(2));
+    const __m256d dx = _mm256_set1_pd(ray.direction(0)), dy = _mm256_set1_pd(ray.direction(1)), dz = _mm256_set1_pd(ray.direction(2));
+    const __m256d va = _mm256_set1_pd(a), veps = _mm256_set1_pd(eps), zero = _mm256_setzero_pd();
+    __m256d vbest_t[2], vbest_i[2];
+    for (int h = 0; h < 2; h++) {
+        vbest_t[h] = _mm256_set1_pd(INFINITY);
+        vbest_i[h] = _mm256_set1_pd(-1);
+    }
+    for (int i = 0; i < n; i += width) {
+        for (int h = 0; h < 2; h++) {
+            int k = i + 4 * h;
+            __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(&cx[k]));
+            __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(&cy[k]));
+            __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(&cz[k]));
+            __m256d b = _mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_add_pd(_mm256_mul_pd(dy, ocy), _mm256_mul_pd(dz, ocz)));
+            __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_add_pd(_mm256_mul_pd(ocy, ocy), _mm256_mul_pd(ocz, ocz))),
+                                      _mm256_loadu_pd(&r2[k]));
+            __m256d disc = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(va, c));
+            __m256d valid = _mm256_cmp_pd(disc, zero, _CMP_GE_OQ);
+            if (_mm256_movemask_pd(valid) == 0) continue;
+            __m256d sq = _mm256_sqrt_pd(_mm256_max_pd(disc, zero));
+            __m256d t0 = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero, b), sq), va);
+            __m256d t1 = _mm256_div_pd(_mm256_add_pd(_mm256_sub_pd(zero, b), sq), va);
+            __m256d t = _mm256_blendv_pd(t0, t1, _mm256_cmp_pd(t0, zero, _CMP_LT_OQ));
+            valid = _mm256_and_pd(valid, _mm256_and_pd(_mm256_cmp_pd(t, veps, _CMP_GT_OQ),
+                                                       _mm256_cmp_pd(t, vbest_t[h], _CMP_LT_OQ)));
+            vbest_t[h] = _mm256_blendv_pd(vbest_t[h], t, valid);
+            vbest_i[h] = _mm256_blendv_pd(vbest_i[h], _mm256_add_pd(_mm256_set_pd(3, 2, 1, 0), _mm256_set1_pd(k)), valid);
+        }
+    }
+    for (int h = 0; h < 2; h++) {
+        _mm256_storeu_pd(best_t + 4 * h, vbest_t[h]);
+        _mm256_storeu_pd(best_i + 4 * h, vbest_i[h]);
+    }
+#else
+    for (int l = 0; l < width; l++) {
+        best_t[l] = INFINITY;
+        best_i[l] = -1;
+    }
+    for (int i = 0; i < n; i += width) {
+        for (int l = 0; l < width; l++) {
+            double ocx = ray.origin(0) - cx[i + l], ocy = ray.origin(1) - cy[i + l], ocz = ray.origin(2) - cz[i + l];
+            double b = ray.direction(0) * ocx + ray.direction(1) * ocy + ray.direction(2) * ocz;
+            double c = ocx * ocx + ocy * ocy + ocz * ocz - r2[i + l];
+            double disc = b * b - a * c;
+            if (disc < 0) continue;
+            double sq = sqrt(disc);
+            double t = (-b - sq) / a;
+            if (t < 0) t = (-b + sq) / a;
+            if (t > eps && t < best_t[l]) {
+                best_t[l] = t;
+                best_i[l] = i + l;
+            }
+        }
+    }
+#endif
+
+    // Horizontal min over the lanes
+    int lane = 0;
+    for (int l = 1; l < width; l++)
+        if (best_t[l] < best_t[lane]) lane = l;
+    if (best_i[lane] < 0) return false;
+
+    int i = best_i[lane];
+    hit.ray_param = best_t[lane];
+    hit.position = ray.origin + hit.ray_param * ray.direction;
+    hit.normal = (hit.position - Vector3d(cx[i], cy[i], cz[i])).normalized();
+    return true;
+}
+
 bool Parallelogram::intersect(const Ray &ray, Intersection &hit) {
     // TODO
-    Matrix3d A;
-    A << -u, -v, ray.direction;
-    Vector3d b(origin - ray.origin);
-    Vector3d x = A.colPivHouseholderQr().solve(b);
-    if (x(2) > 0 && (0 <= x(0) && x(0) <= 1) && (0 <= x(1) && x(1) <= 1)) {
-        hit.ray_param = x(2);
+    double t, a, b;
+    if (plane.intersect(ray, t, a, b) && t > 0 && (0 <= a && a <= 1) && (0 <= b && b <= 1)) {
+        hit.ray_param = t;
         hit.position = ray.origin + hit.ray_param * ray.direction;
-        hit.normal = u.cross(v).normalized();
+        hit.normal = plane.normal;
         return true;
     } else return false;
 }
@@ -155,7 +360,13 @@ Object *find_nearest_object(const Scene &scene, const Ray &ray, Intersection &cl
 
 bool is_light_visible(const Scene &scene, const Ray &ray, const Light &light);
 
-Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce);
+// First hit of a camera ray, for the auxiliary buffers (see AovBuffers)
+struct FirstHit {
+    const Object *object = nullptr; // Null for the background
+    Intersection hit;
+};
+
+Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce, FirstHit *first = nullptr);
 
 // -----------------------------------------------------------------------------
 
@@ -267,19 +478,88 @@ Object *find_nearest_object(const Scene &scene, const Ray &ray, Intersection &cl
     }
 }
 
+// Last object that blocked a shadow ray, for each light. Neighbouring pixels are
+// usually shadowed by the same object, so it is tested before the other ones.
+// There is one cache per worker of parallel_for(), see worker_occluder_cache().
+struct OccluderCache {
+    std::vector<Object *> last; // One entry per light
+
+    long shadow_rays = 0;  // Number of shadow rays traced
+    long hits = 0;         // Shadow rays blocked by the cached occluder
+    long object_tests = 0; // Ray/object intersection tests done for the shadow rays
+};
+
+std::mutex occluder_caches_mutex;
+std::vector<std::shared_ptr<OccluderCache>> occluder_caches; // Cache of each worker index
+
+// Cache of the worker index of the calling thread. It is kept from one call of
+// parallel_for() to the next (adaptive passes, bands, frames), and there are only
+// as many caches as threads.
+OccluderCache &worker_occluder_cache() {
+    thread_local OccluderCache *cache = nullptr;
+    thread_local int cache_worker = -1;
+    if (cache_worker != parallel_worker) {
+        std::lock_guard<std::mutex> lock(occluder_caches_mutex);
+        if (int(occluder_caches.size()) <= parallel_worker) occluder_caches.resize(parallel_worker + 1);
+        if (!occluder_caches[parallel_worker]) occluder_caches[parallel_worker] = std::make_shared<OccluderCache>();
+        cache = occluder_caches[parallel_worker].get();
+        cache_worker = parallel_worker;
+    }
+    return *cache;
+}
+
+void print_occluder_cache_stats() {
+    OccluderCache total;
+    std::lock_guard<std::mutex> lock(occluder_caches_mutex);
+    for (const auto &cache: occluder_caches) {
+        total.shadow_rays += cache->shadow_rays;
+        total.hits += cache->hits;
+        total.object_tests += cache->object_tests;
+    }
+    std::cout << "Shadow rays: " << total.shadow_rays << ", occluder cache hits: " << total.hits << " ("
+              << 100.0 * total.hits / std::max(total.shadow_rays, 1L) << "%), object tests per shadow ray: "
+              << double(total.object_tests) / std::max(total.shadow_rays, 1L) << std::endl;
+}
+
 bool is_light_visible(const Scene &scene, const Ray &ray, const Light &light) {
     // TODO: Determine if the light is visible here
-    for (auto &obj: scene.objects) {
+    double light_distance = (light.position - ray.origin).norm();
+    auto blocks = [&](Object &obj) {
         Intersection hit;
-        if (obj->intersect(ray, hit) && ((hit.position - ray.origin).norm() < (light.position - ray.origin).norm()))
+        return obj.intersect(ray, hit) && (hit.position - ray.origin).norm() < light_distance;
+    };
+
+    OccluderCache &cache = worker_occluder_cache();
+    cache.last.resize(scene.lights.size(), nullptr);
+    Object *&last = cache.last[&light - scene.lights.data()]; // 'light' is an element of scene.lights
+    cache.shadow_rays++;
+
+    if (use_occluder_cache && last != nullptr) {
+        cache.object_tests++;
+        if (blocks(*last)) {
+            cache.hits++;
             return false;
+        }
+    }
+    for (auto &obj: scene.objects) {
+        if (use_occluder_cache && obj.get() == last) continue; // Already tested
+        cache.object_tests++;
+        if (blocks(*obj)) {
+            last = obj.get();
+            return false;
+        }
     }
     return true;
 }
 
-Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce) {
+Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce, FirstHit *first) {
     Intersection hit;
-    if (Object *obj = find_nearest_object(scene, ray, hit)) {
+    Object *obj = find_nearest_object(scene, ray, hit);
+    if (first) {
+        first->object = obj;
+        first->hit = hit;
+    }
+    if (obj) {
         // 'obj' is not null and points to the object of the scene hit by the ray
         return ray_color(scene, ray, *obj, hit, max_bounce);
     } else {
@@ -290,14 +570,61 @@ Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void render_scene(const Scene &scene) {
+// Write the auxiliary buffers to <prefix>_normal.png, <prefix>_albedo.png,
+// <prefix>_depth.png (white is close) and <prefix>_object.png (one random color
+// per object, white for the pixels that see several objects)
+void write_aov_images(const AovBuffers &aov, const std::string &prefix) {
+    int w = aov.width;
+    int h = aov.height;
+    double max_depth = 0;
+    for (double d: aov.depth)
+        if (std::isfinite(d)) max_depth = std::max(max_depth, d);
+
+    MatrixXd A = MatrixXd::Ones(w, h);
+    MatrixXd R[4], G[4], B[4];
+    for (int b = 0; b < 4; ++b) {
+        R[b] = G[b] = B[b] = MatrixXd::Zero(w, h);
+    }
+    for (int i = 0; i < w; ++i) {
+        for (int j = 0; j < h; ++j) {
+            int p = i * h + j;
+            Vector3d n = 0.5 * (aov.normal[p] + Vector3d(1, 1, 1));
+            if (aov.object[p] == AovBuffers::background) n.setZero();
+            Vector3d colors[4] = {n, aov.albedo[p], Vector3d::Zero(), Vector3d::Zero()};
+            if (std::isfinite(aov.depth[p]) && max_depth > 0)
+                colors[2].setConstant(1 - aov.depth[p] / max_depth);
+            if (aov.object[p] >= 0) {
+                uint32_t x = hash_uint32(aov.object[p]);
+                colors[3] = Vector3d(x & 0xff, (x >> 8) & 0xff, (x >> 16) & 0xff) / 255.0;
+            } else if (aov.object[p] == AovBuffers::mixed) {
+                colors[3].setOnes();
+            }
+            for (int b = 0; b < 4; ++b) {
+                R[b](i, j) = colors[b](0);
+                G[b](i, j) = colors[b](1);
+                B[b](i, j) = colors[b](2);
+            }
+        }
+    }
+    const char *names[4] = {"_normal.png", "_albedo.png", "_depth.png", "_object.png"};
+    for (int b = 0; b < 4; ++b)
+        write_matrix_to_png(R[b], G[b], B[b], A, prefix + names[b]);
+}
+
+void render_scene(const Scene &scene, const RenderConfig &config) {
     std::cout << "Simple ray tracer." << std::endl;
 
-    int w = 640;
-    int h = 480;
+    int w = config.width;
+    int h = config.height;
+
+    // The auxiliary buffers are only needed by the denoiser, or to be saved
+    bool use_aov = config.denoise > 0 || config.aov;
+    std::map<const Object *, int> object_index;
+    for (size_t i = 0; i < scene.objects.size(); ++i)
+        object_index[scene.objects[i].get()] = int(i);
 
-    // Save to png
-    const char *fileName = "out.gif";
+    // Save to gif
+    const char *fileName = config.output.c_str();
     std::vector<uint8_t> image;
     int delay = 25; // Milliseconds to wait between frames
     GifWriter g;
@@ -325,39 +652,149 @@ void render_scene(const Scene &scene) {
         Vector3d x_displacement(2.0 / w * scale_x, 0, 0);
         Vector3d y_displacement(0, -2.0 / h * scale_y, 0);
 
-        std::random_device rd;  //Will be used to obtain a seed for the random number engine
-        std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-        std::uniform_real_distribution<> dis(-scene.camera.lens_radius,
-                                             scene.camera.lens_radius);//                    ray.origin = scene.camera.position + Vector3d(u(e), u(e), 0);
+        // Shoot sample 'l' through pixel (i, j), jittered on the pixel and on the lens.
+        // The jitter only depends on (pixel, sample, frame), see sampler.h
+        auto trace_sample = [&](unsigned i, unsigned j, int l, FirstHit *first) {
+            uint32_t pixel = j * w + i;
+            Vector2d jitter = sample_2d(pixel, l, k, 0);
+            Vector3d shift = grid_origin + (i + jitter(0)) * x_displacement + (j + jitter(1)) * y_displacement;
+
+            // Prepare the ray
+            Ray ray;
+
+            if (scene.camera.is_perspective) {
+                // Perspective camera, the origin is sampled on the lens for the depth of field
+                Vector2d lens = scene.camera.lens_radius * square_to_disk(sample_2d(pixel, l, k, 1));
+                ray.origin = scene.camera.position + Vector3d(lens(0), lens(1), 0);
+                ray.direction = Vector3d(shift[0], shift[1], 0) - ray.origin;
+            } else {
+                // Orthographic camera
+                ray.origin = scene.camera.position + Vector3d(shift[0], shift[1], 0);
+                ray.direction = Vector3d(0, 0, -1);
+            }
 
-        for (unsigned i = 0; i < w; ++i) {
-            for (unsigned j = 0; j < h; ++j) {
-                // TODO: Implement depth of field
-                Vector3d shift = grid_origin + (i + 0.5) * x_displacement + (j + 0.5) * y_displacement;
-
-                int ray_num = 3;
-                Vector3d C(0, 0, 0);
-                for (int l = 0; l < ray_num; l++) {
-                    // Prepare the ray
-                    Ray ray;
-
-                    if (scene.camera.is_perspective) {
-                        // Perspective camera
-                        // TODO
-//                    ray.origin = scene.camera.position + Vector3d(dis(gen), dis(gen), 0);
-                        ray.origin = scene.camera.position;
-                        ray.direction = Vector3d(shift[0], shift[1], 0) - ray.origin;
-                    } else {
-                        // Orthographic camera
-                        ray.origin = scene.camera.position + Vector3d(shift[0], shift[1], 0);
-                        ray.direction = Vector3d(0, 0, -1);
+            return shoot_ray(scene, ray, config.max_bounce, first);
+        };
+
+        // Adaptive sampling: every pixel gets 'min_samples' samples first, then the
+        // remaining budget is spent in batches on the pixels whose luminance has a
+        // standard error above 'tolerance', noisiest first.
+        const int min_samples = std::min(8, config.samples);
+        const int max_samples = 128;
+        const int batch_samples = 4;
+        const double tolerance = 0.002;
+        const long budget = long(config.samples) * w * h; // Global number of samples for the frame
+        const int threads = config.threads > 0 ? config.threads : default_thread_count();
+
+        std::vector<Vector3d> sum(w * h, Vector3d(0, 0, 0));
+        std::vector<double> lum_sum(w * h, 0), lum_sq_sum(w * h, 0);
+        std::vector<int> count(w * h, 0);
+        std::vector<int> todo(w * h, min_samples); // Samples to add to each pixel in the current pass
+        long used = 0;
+
+        // Sums of the auxiliary buffers over the samples (over the samples that hit an
+        // object for the depth)
+        AovBuffers aov = use_aov ? AovBuffers(w, h) : AovBuffers();
+        std::vector<int> aov_hits(use_aov ? w * h : 0, 0);
+
+        // Shoot the samples of 'todo' for all the pixels. A pixel is only touched by
+        // one thread, and its samples are numbered from its current count.
+        auto add_samples = [&]() {
+            parallel_for_tiles(w, h, config.tile_size, threads, [&](int i, int j) {
+                int p = i * h + j;
+                for (int l = count[p]; l < count[p] + todo[p]; l++) {
+                    FirstHit first;
+                    Vector3d C = trace_sample(i, j, l, use_aov ? &first : nullptr);
+                    if (use_aov) {
+                        int object = AovBuffers::background;
+                        if (first.object) {
+                            object = object_index.at(first.object);
+                            aov.normal[p] += first.hit.normal;
+                            aov.albedo[p] += first.object->material.diffuse_color;
+                            aov.depth[p] += (first.hit.position - scene.camera.position).norm();
+                            aov_hits[p]++;
+                        } else {
+                            aov.albedo[p] += scene.background_color;
+                        }
+                        if (l == 0) aov.object[p] = object;
+                        else if (aov.object[p] != object) aov.object[p] = AovBuffers::mixed;
                     }
-
-                    int max_bounce = 5;
-                    C += shoot_ray(scene, ray, max_bounce);
+                    // Only the displayed (clamped) range matters for the noise estimate
+                    Vector3d Cd = C.cwiseMax(0.0).cwiseMin(1.0);
+                    double lum = 0.2126 * Cd(0) + 0.7152 * Cd(1) + 0.0722 * Cd(2);
+                    sum[p] += C;
+                    lum_sum[p] += lum;
+                    lum_sq_sum[p] += lum * lum;
                 }
-                C /= ray_num;
+                count[p] += todo[p];
+            });
+            for (int p = 0; p < w * h; p++) {
+                used += todo[p];
+                todo[p] = 0;
+            }
+        };
+
+        // Standard error of the mean luminance of a pixel
+        auto pixel_error = [&](int p) {
+            double mean = lum_sum[p] / count[p];
+            double var = std::max(lum_sq_sum[p] / count[p] - mean * mean, 0.0) * count[p] / (count[p] - 1);
+            return sqrt(var / count[p]);
+        };
+
+        add_samples();
+
+        while (used < budget) {
+            std::vector<std::pair<double, int>> noisy;
+            for (int p = 0; p < w * h; p++) {
+                double err = pixel_error(p);
+                if (err > tolerance && count[p] < max_samples)
+                    noisy.push_back(std::make_pair(err, p));
+            }
+            if (noisy.empty()) break;
+            // The pass is planned sequentially so that it does not depend on the threads
+            std::sort(noisy.begin(), noisy.end(), std::greater<std::pair<double, int>>());
+            long planned = used;
+            for (const auto &e: noisy) {
+                if (planned >= budget) break;
+                todo[e.second] = std::min<long>(std::min(batch_samples, max_samples - count[e.second]), budget - planned);
+                planned += todo[e.second];
+            }
+            add_samples();
+        }
+
+        std::cout << "Frame " << k << ": " << used << " samples, " << double(used) / (w * h)
+                  << " per pixel on average (budget of " << budget << ", " << config.samples << " per pixel)"
+                  << std::endl;
+
+        std::vector<Vector3d> color(w * h);
+        for (int p = 0; p < w * h; p++)
+            color[p] = sum[p] / count[p];
 
+        if (use_aov) {
+            for (int p = 0; p < w * h; p++) {
+                aov.normal[p] /= count[p];
+                aov.albedo[p] /= count[p];
+                aov.depth[p] = aov_hits[p] > 0 ? aov.depth[p] / aov_hits[p] : std::numeric_limits<double>::infinity();
+            }
+            if (config.aov && k == 0) {
+                std::string prefix = config.output.substr(0, config.output.rfind('.'));
+                write_aov_images(aov, prefix);
+            }
+        }
+        if (config.denoise > 0) {
+            // With a single sample, the noise of a pixel is unknown and taken as the largest
+            std::vector<double> variance(w * h, 0.25);
+            for (int p = 0; p < w * h; p++)
+                if (count[p] > 1) variance[p] = pixel_error(p) * pixel_error(p);
+            auto start = std::chrono::steady_clock::now();
+            denoise_atrous(color, variance, aov, config.denoise, threads);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Frame " << k << ": denoised in " << ms << "ms" << std::endl;
+        }
+
+        for (unsigned i = 0; i < w; ++i) {
+            for (unsigned j = 0; j < h; ++j) {
+                const Vector3d &C = color[i * h + j];
                 R(i, j) = C(0);
                 G(i, j) = C(1);
                 B(i, j) = C(2);
@@ -370,10 +807,15 @@ void render_scene(const Scene &scene) {
         GifWriteFrame(&g, image.data(), R.rows(), R.cols(), delay);
 
         // move the position of objects for Animation
-        for (auto &obj: scene.objects)
-            std::dynamic_pointer_cast<Sphere>(obj)->position[2] -= 0.5 * k;
+        for (auto &obj: scene.objects) {
+            if (auto sphere = std::dynamic_pointer_cast<Sphere>(obj))
+                sphere->position[2] -= 0.5 * k;
+            else if (auto set = std::dynamic_pointer_cast<SphereSet>(obj))
+                for (double &z: set->cz) z -= 0.5 * k;
+        }
     }
     GifEnd(&g);
+    print_occluder_cache_stats();
 
 //    const std::string filename("raytrace.png");
 //    write_matrix_to_png(R, G, B, A, filename);
@@ -381,7 +823,11 @@ void render_scene(const Scene &scene) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-Scene load_scene(const std::string &filename) {
+// Settings of the "Render" block that belong to the other ray tracer
+const std::vector<std::string> unsupported_render_keys = {"Float", "EdgeSamples", "Bench", "Banded", "Wavefront"};
+
+// Parse the json file of a scene
+Scene parse_scene(const std::string &filename) {
     Scene scene;
 
     // Load json data from scene file
@@ -405,6 +851,12 @@ Scene load_scene(const std::string &filename) {
     scene.camera.focal_length = data["Camera"]["FocalLength"];
     scene.camera.lens_radius = data["Camera"]["LensRadius"];
 
+    // Read the render settings (optional), on top of the defaults of this assignment
+    scene.render.samples = 16;
+    scene.render.output = "out.gif";
+    if (data.count("Render") && !read_render_config(data["Render"], scene.render, unsupported_render_keys))
+        std::cerr << "Invalid render settings in " << filename << " are ignored" << std::endl;
+
     // Read materials
     for (const auto &entry: data["Materials"]) {
         Material mat;
@@ -426,10 +878,24 @@ Scene load_scene(const std::string &filename) {
         scene.lights.push_back(light);
     }
 
+    // Scenes with many spheres pack the spheres of each material in a SphereSet
+    std::map<int, int> spheres_per_material;
+    for (const auto &entry: data["Objects"])
+        if (entry["Type"] == "Sphere")
+            spheres_per_material[entry["Material"]]++;
+    std::map<int, std::shared_ptr<SphereSet>> sphere_sets;
+
     // Read objects
     for (const auto &entry: data["Objects"]) {
         ObjectPtr object;
-        if (entry["Type"] == "Sphere") {
+        if (entry["Type"] == "Sphere" && spheres_per_material[entry["Material"]] >= sphere_set_min) {
+            std::shared_ptr<SphereSet> &set = sphere_sets[entry["Material"]];
+            bool created = !set;
+            if (created) set = std::make_shared<SphereSet>();
+            set->add(read_vec3(entry["Position"]), entry["Radius"]);
+            if (!created) continue;
+            object = set;
+        } else if (entry["Type"] == "Sphere") {
             auto sphere = std::make_shared<Sphere>();
             sphere->position = read_vec3(entry["Position"]);
             sphere->radius = entry["Radius"];
@@ -440,6 +906,7 @@ Scene load_scene(const std::string &filename) {
             parallelogram->origin = read_vec3(entry["Origin"]);
             parallelogram->u = read_vec3(entry["U"]);
             parallelogram->v = read_vec3(entry["V"]);
+            parallelogram->plane = PlanarPatch(parallelogram->origin, parallelogram->u, parallelogram->v);
             object = parallelogram;
         }
         object->material = scene.materials[entry["Material"]];
@@ -449,14 +916,145 @@ Scene load_scene(const std::string &filename) {
     return scene;
 }
 
+// -----------------------------------------------------------------------------
+
+// The scene cache holds the parsed scene (materials, lights, and the objects as
+// they are after load_scene(), i.e. with the planes and the sphere sets) and the
+// hash of the files it was built from. Increment the version whenever the layout
+// of the file or of one of the structs written as raw bytes changes.
+const uint32_t scene_cache_magic = 0x33435452; // "RTC3"
+const uint32_t scene_cache_version = 6;
+
+enum ObjectTag : uint32_t { SPHERE, SPHERE_SET, PARALLELOGRAM };
+
+// The cache is written in the working directory, next to the output image
+std::string scene_cache_path(const std::string &filename) {
+    std::string name = filename.substr(filename.find_last_of('/') + 1);
+    return name.substr(0, name.find_last_of('.')) + ".cache";
+}
+
+bool save_scene_cache(const std::string &cache_file, const std::vector<std::string> &inputs, const Scene &scene) {
+    CacheWriter out;
+    out.write(scene_cache_magic);
+    out.write(scene_cache_version);
+    out.write(uint64_t(inputs.size()));
+    for (const auto &input: inputs) {
+        out.write_string(input);
+        out.write(hash_file(input));
+    }
+
+    out.write(scene.background_color);
+    out.write(scene.ambient_light);
+    out.write(scene.camera);
+    save_render_config(out, scene.render);
+    out.write_array(scene.materials.data(), scene.materials.size());
+    out.write_array(scene.lights.data(), scene.lights.size());
+
+    out.write(uint64_t(scene.objects.size()));
+    for (const auto &obj: scene.objects) {
+        if (auto sphere = std::dynamic_pointer_cast<Sphere>(obj)) {
+            out.write(SPHERE);
+            out.write(sphere->position);
+            out.write(sphere->radius);
+        } else if (auto set = std::dynamic_pointer_cast<SphereSet>(obj)) {
+            out.write(SPHERE_SET);
+            out.write(set->count);
+            out.write_array(set->cx.data(), set->cx.size());
+            out.write_array(set->cy.data(), set->cy.size());
+            out.write_array(set->cz.data(), set->cz.size());
+            out.write_array(set->r2.data(), set->r2.size());
+        } else if (auto parallelogram = std::dynamic_pointer_cast<Parallelogram>(obj)) {
+            out.write(PARALLELOGRAM);
+            out.write(parallelogram->origin);
+            out.write(parallelogram->u);
+            out.write(parallelogram->v);
+            out.write(parallelogram->plane);
+        } else {
+            return false;
+        }
+        out.write(obj->material);
+    }
+    return out.save(cache_file);
+}
+
+// Returns false if there is no cache, or if it is outdated
+bool load_scene_cache(const std::string &cache_file, Scene &scene) {
+    MappedFile file(cache_file);
+    if (!file.data) return false;
+    CacheReader in(file);
+
+    uint32_t magic, version;
+    if (!in.read(magic) || magic != scene_cache_magic) return false;
+    if (!in.read(version) || version != scene_cache_version) return false;
+    uint64_t n;
+    if (!in.read(n)) return false;
+    for (uint64_t i = 0; i < n; ++i) {
+        std::string input;
+        uint64_t hash;
+        if (!in.read_string(input) || !in.read(hash) || hash != hash_file(input)) return false;
+    }
+
+    bool ok = in.read(scene.background_color) && in.read(scene.ambient_light) && in.read(scene.camera) &&
+              load_render_config(in, scene.render) && in.read_vector(scene.materials) && in.read_vector(scene.lights) && in.read(n);
+    for (uint64_t i = 0; ok && i < n; ++i) {
+        ObjectTag tag;
+        ObjectPtr object;
+        if (!in.read(tag)) return false;
+        if (tag == SPHERE) {
+            auto sphere = std::make_shared<Sphere>();
+            ok = in.read(sphere->position) && in.read(sphere->radius);
+            object = sphere;
+        } else if (tag == SPHERE_SET) {
+            auto set = std::make_shared<SphereSet>();
+            ok = in.read(set->count) && in.read_vector(set->cx) && in.read_vector(set->cy) &&
+                 in.read_vector(set->cz) && in.read_vector(set->r2);
+            object = set;
+        } else if (tag == PARALLELOGRAM) {
+            auto parallelogram = std::make_shared<Parallelogram>();
+            ok = in.read(parallelogram->origin) && in.read(parallelogram->u) && in.read(parallelogram->v) &&
+                 in.read(parallelogram->plane);
+            object = parallelogram;
+        } else {
+            return false;
+        }
+        ok = ok && in.read(object->material);
+        scene.objects.push_back(object);
+    }
+    return ok;
+}
+
+Scene load_scene(const std::string &filename) {
+    std::string cache_file = scene_cache_path(filename);
+    if (use_scene_cache) {
+        Scene scene;
+        if (load_scene_cache(cache_file, scene)) {
+            std::cout << "Scene loaded from " << cache_file << std::endl;
+            return scene;
+        }
+    }
+
+    Scene scene = parse_scene(filename);
+    if (use_scene_cache && scene.render.scene_cache && !save_scene_cache(cache_file, {filename}, scene))
+        std::cerr << "Could not write the scene cache " << cache_file << std::endl;
+    return scene;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " scene.json" << std::endl;
+    json args;
+    if (argc < 2 || !parse_render_args(argc, argv, 2, args) || !check_render_keys(args, unsupported_render_keys)) {
+        std::cerr << "Usage: " << argv[0] << " scene.json " << render_flags_usage(unsupported_render_keys)
+                  << std::endl;
         return 1;
     }
+    if (args.count("SceneCache"))
+        use_scene_cache = args["SceneCache"];
     Scene scene = load_scene(argv[1]);
-    render_scene(scene);
+
+    // The command line flags override the settings of the scene file
+    RenderConfig config = scene.render;
+    if (!read_render_config(args, config, unsupported_render_keys)) return 1;
+    render_scene(scene, config);
     return 0;
 }
@@ -0,0 +1,76 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#undef near // Empty macros of windows.h, used as names in the ray tracers
+#undef far
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only mapping of a whole file (data is null if the file cannot be read)
+struct MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	MappedFile(const std::string &filename) {
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		                          FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER file_size;
+		if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping) {
+				void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				if (p) {
+					data = static_cast<const char *>(p);
+					size = size_t(file_size.QuadPart);
+				}
+				CloseHandle(mapping); // The view keeps the mapping alive
+			}
+		}
+		CloseHandle(file);
+	}
+
+	~MappedFile() {
+		if (data) UnmapViewOfFile(data);
+	}
+#else
+	MappedFile(const std::string &filename) {
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				data = static_cast<const char *>(p);
+				size = st.st_size;
+			}
+		}
+		close(fd);
+	}
+
+	~MappedFile() {
+		if (data) munmap(const_cast<char *>(data), size);
+	}
+#endif
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+};
+
+#endif
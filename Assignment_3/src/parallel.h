@@ -0,0 +1,69 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Number of threads used when none is requested explicitly
+int default_thread_count() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Index in [0, threads) of the calling thread among the workers of the innermost
+// parallel_for() running it, 0 for the thread that called parallel_for() and
+// outside of it. The threads are new at every call, so state that must outlive a
+// call (e.g. a cache) is kept per worker index rather than in a thread_local.
+thread_local int parallel_worker = 0;
+
+// Call f(i) for every i in [0, n), distributing the indices over 'threads'
+// threads in chunks of 'grain' consecutive indices
+template <typename F>
+void parallel_for(int n, int threads, int grain, const F &f) {
+	threads = std::max(1, std::min(threads, (n + grain - 1) / grain));
+	if (threads == 1) {
+		for (int i = 0; i < n; ++i) f(i);
+		return;
+	}
+
+	std::atomic<int> next(0);
+	auto worker = [&](int index) {
+		parallel_worker = index;
+		for (int begin = next.fetch_add(grain); begin < n; begin = next.fetch_add(grain))
+			for (int i = begin; i < std::min(begin + grain, n); ++i) f(i);
+	};
+	int outer = parallel_worker;
+	std::vector<std::thread> pool;
+	for (int t = 1; t < threads; ++t) pool.emplace_back(worker, t);
+	worker(0);
+	for (auto &t: pool) t.join();
+	parallel_worker = outer;
+}
+
+// Call f(i0, j0, i1, j1) for the tiles [i0, i1) x [j0, j1) of tile x tile pixels
+// of a w x h image, distributed over 'threads' threads
+template <typename F>
+void parallel_for_blocks(int w, int h, int tile, int threads, const F &f) {
+	tile = std::max(tile, 1);
+	int tiles_x = (w + tile - 1) / tile;
+	int tiles_y = (h + tile - 1) / tile;
+	parallel_for(tiles_x * tiles_y, threads, 1, [&](int t) {
+		int i0 = (t % tiles_x) * tile;
+		int j0 = (t / tiles_x) * tile;
+		f(i0, j0, std::min(i0 + tile, w), std::min(j0 + tile, h));
+	});
+}
+
+// Call f(i, j) for every pixel of a w x h image, distributing the tiles of
+// tile x tile pixels over 'threads' threads
+template <typename F>
+void parallel_for_tiles(int w, int h, int tile, int threads, const F &f) {
+	parallel_for_blocks(w, h, tile, threads, [&](int i0, int j0, int i1, int j1) {
+		for (int j = j0; j < j1; ++j)
+			for (int i = i0; i < i1; ++i)
+				f(i, j);
+	});
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <Eigen/Dense>
+#include <cmath>
+#include <cstdint>
+
+// Deterministic sampler: every random number is a pure function of
+// (pixel, sample, frame, dimension), so the image does not depend on the order
+// in which the pixels are traced, nor on the number of threads.
+
+// Counter-based random number generator (murmur3 finalizer on the key)
+uint32_t hash_uint32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x85ebca6bu;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35u;
+	x ^= x >> 16;
+	return x;
+}
+
+uint32_t hash_key(uint32_t pixel, uint32_t sample, uint32_t frame, uint32_t dimension) {
+	uint32_t h = hash_uint32(pixel ^ 0x9e3779b9u);
+	h = hash_uint32(h ^ (sample * 0x27d4eb2du));
+	h = hash_uint32(h ^ (frame * 0x165667b1u));
+	h = hash_uint32(h ^ (dimension * 0xd3a2646cu));
+	return h;
+}
+
+// Uniform number in [0, 1)
+double random_uniform(uint32_t pixel, uint32_t sample, uint32_t frame, uint32_t dimension) {
+	return hash_key(pixel, sample, frame, dimension) * (1.0 / 4294967296.0);
+}
+
+// -----------------------------------------------------------------------------
+
+uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of the bits of x (Laine-Karras hash, see Burley 2020,
+// "Practical Hash-based Owen Scrambling")
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+// Sobol matrix of dimension 1 (polynomial x + 1) applied byte by byte: table[b][v]
+// is the XOR of the direction numbers selected by the bits of v << (8 * b)
+struct SobolTable {
+	uint32_t table[4][256];
+
+	SobolTable() {
+		uint32_t directions[32];
+		directions[0] = 1u << 31;
+		for (int i = 1; i < 32; ++i)
+			directions[i] = directions[i - 1] ^ (directions[i - 1] >> 1);
+		for (int b = 0; b < 4; ++b) {
+			for (int v = 0; v < 256; ++v) {
+				table[b][v] = 0;
+				for (int i = 0; i < 8; ++i)
+					if (v & (1 << i))
+						table[b][v] ^= directions[8 * b + i];
+			}
+		}
+	}
+};
+
+// First two dimensions of the Sobol sequence, as 32 bit fixed point numbers
+void sobol_2d(uint32_t index, uint32_t &x, uint32_t &y) {
+	static const SobolTable sobol;
+	x = reverse_bits(index); // Dimension 0 is the van der Corput sequence
+	y = sobol.table[0][index & 0xff] ^ sobol.table[1][(index >> 8) & 0xff] ^
+	    sobol.table[2][(index >> 16) & 0xff] ^ sobol.table[3][index >> 24];
+}
+
+// 2D sample in [0, 1)^2 of an Owen-scrambled Sobol sequence. Each (pixel, frame,
+// dimension) gets its own independent scrambling and its own shuffling of the
+// sample index, so that two pairs of dimensions of a pixel are decorrelated.
+Eigen::Vector2d sample_2d(uint32_t pixel, uint32_t sample, uint32_t frame, uint32_t dimension) {
+	uint32_t seed = hash_key(pixel, 0, frame, dimension);
+	uint32_t index = nested_uniform_scramble(sample, seed);
+	uint32_t x, y;
+	sobol_2d(index, x, y);
+	x = nested_uniform_scramble(x, hash_uint32(seed ^ 0x68bc21ebu));
+	y = nested_uniform_scramble(y, hash_uint32(seed ^ 0x02e5be93u));
+	return Eigen::Vector2d(x * (1.0 / 4294967296.0), y * (1.0 / 4294967296.0));
+}
+
+// Concentric mapping of the unit square onto the unit disk (Shirley & Chiu)
+Eigen::Vector2d square_to_disk(const Eigen::Vector2d &u) {
+	double a = 2 * u(0) - 1;
+	double b = 2 * u(1) - 1;
+	if (a == 0 && b == 0) return Eigen::Vector2d(0, 0);
+	double r, phi;
+	if (a * a > b * b) {
+		r = a;
+		phi = (M_PI / 4) * (b / a);
+	} else {
+		r = b;
+		phi = (M_PI / 2) - (M_PI / 4) * (a / b);
+	}
+	return Eigen::Vector2d(r * cos(phi), r * sin(phi));
+}
+
+#endif
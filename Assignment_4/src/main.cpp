@@ -8,6 +8,21 @@
 #include <vector>
 #include <stack>
 #include <queue>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <functional>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <malloc.h>
+#endif
 
 // Eigen for matrix operations
 #include <Eigen/Dense>
@@ -18,6 +33,12 @@
 
 #include "stb_image_write.h"
 #include "utils.h"
+#include "sampler.h"
+#include "scene_cache.h"
+#include "stats.h"
+#include "parallel.h"
+#include "render_config.h"
+#include "mesh_io.h"
 
 // JSON parser library (https://github.com/nlohmann/json)
 #include "json.hpp"
@@ -28,30 +49,171 @@ using json = nlohmann::json;
 using namespace Eigen;
 
 double epsilon = pow(10, -5);
+
+// Minimum ray parameter of a hit, to avoid self-intersections. Rays in float need
+// a larger margin.
+template <typename Scalar>
+Scalar ray_epsilon() { return epsilon; }
+
+template <>
+float ray_epsilon<float>() { return 1e-4f; }
 int totalNum = 0;
 
+// Test the last occluder of a light first for the shadow rays, see OccluderCache
+bool use_occluder_cache = true;
+
+// Reuse the compiled scene of a previous run (including the BVH of the meshes)
+// when the inputs did not change, see load_scene_cache()
+bool use_scene_cache = true;
+
+// Keep the BVH of each mesh file in a file next to it (mesh.off.bvh), reused by
+// the scenes that load the same file, see Mesh::load_bvh_cache()
+bool use_bvh_cache = true;
+
+// Maximum number of triangles in a leaf of the BVH of a mesh (SAH builder)
+int bvh_max_leaf_size = 4;
+
+// Layout of the BVH of the meshes traversed by the rays
+enum class BvhLayout {
+    BINARY,     // AABBTreeT, one box per node
+    WIDE,       // WideBvh, 4 boxes per node in float
+    COMPRESSED, // CompressedBvh, 4 boxes per node quantized to 8 bits
+    AUTO        // COMPRESSED for the meshes of at least compressed_bvh_min_facets facets, WIDE otherwise
+};
+BvhLayout bvh_layout = BvhLayout::AUTO;
+
+// The decoding of the compressed nodes only pays off when the tree is much larger
+// than the caches (see REPORT.md)
+int compressed_bvh_min_facets = 1 << 20;
+
+// A refitted BVH is rebuilt once its SAH cost is this many times the cost of the
+// tree when it was built (see Mesh::set_vertices())
+double bvh_rebuild_threshold = 1.3;
+
+// Maximum depth of the BVH of a mesh (the root is at depth 0), which bounds the
+// stack of the traversal
+const int bvh_max_depth = 96;
+
+// Trace the camera rays by packets of packet_width x packet_width pixels of a
+// tile, see find_nearest_objects()
+bool use_ray_packets = true;
+const int packet_width = 8;
+
+// A packet that enters a node with at most this many rays leaves the SIMD tests
+// and traverses the subtree one ray at a time
+int packet_min_rays = 4;
+
+// Sort the queues of the wavefront renderer (--wavefront) by ray origin and
+// direction before tracing them, see render_wavefront()
+bool sort_wavefront_rays = true;
+
+// Maximum number of paths traced together by the wavefront renderer, which keeps
+// all their hits in memory
+int wavefront_batch = 1 << 16;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Define types & classes
 ////////////////////////////////////////////////////////////////////////////////
 
-struct Ray {
-    Vector3d origin;
-    Vector3d direction;
+// The geometric types are templated on the scalar type, so that the rays can be
+// traced in float (preview, --float) or in double (default). The shading is always
+// done in double.
+template <typename Scalar>
+struct RayT {
+    typedef Matrix<Scalar, 3, 1> Vector3;
+    Vector3 origin;
+    Vector3 direction;
+
+    RayT() {}
 
-    Ray() {}
+    RayT(Vector3 o, Vector3 d) : origin(o), direction(d) {}
 
-    Ray(Vector3d o, Vector3d d) : origin(o), direction(d) {}
+    template <typename Other>
+    RayT<Other> cast() const { return RayT<Other>(origin.template cast<Other>(), direction.template cast<Other>()); }
 };
 
+typedef RayT<double> Ray;
+
 struct Light {
     Vector3d position;
     Vector3d intensity;
 };
 
-struct Intersection {
-    Vector3d position;
-    Vector3d normal;
-    double ray_param;
+template <typename Scalar>
+struct IntersectionT {
+    Matrix<Scalar, 3, 1> position;
+    Matrix<Scalar, 3, 1> normal;
+    Scalar ray_param;
+    int primitive = -1; // Index of the facet hit for meshes (-1 for the other objects)
+};
+
+typedef IntersectionT<double> Intersection;
+
+struct Object;
+
+// Camera rays of a block of pixels, traced together through the trees (as in
+// Wald et al. 2007, "Ray Tracing Deformable Scenes using Dynamic Bounding Volume
+// Hierarchies"). The rays are stored as structures of arrays, so that a box or a
+// triangle is tested against several rays at once with SSE, and a subset of the
+// rays is a bit mask. A node is culled for all the rays at once by interval
+// arithmetic over their origins and directions (see misses()).
+template <typename Scalar>
+struct RayPacketT {
+    static const int max_size = packet_width * packet_width;
+    static_assert(max_size <= 64 && max_size % 4 == 0, "The rays of a packet are the bits of a uint64_t");
+
+    int size = 0;
+    Scalar origin[3][max_size];
+    Scalar direction[3][max_size];
+
+    // Origins and inverse directions in float for the box tests, with the zero
+    // components of the directions replaced as in Mesh::intersect_wide()
+    float box_origin[3][max_size];
+    float box_inverse[3][max_size];
+
+    // Bounds of box_origin and box_inverse over the rays set up by prepare(), for
+    // misses(). Only valid if 'coherent': the directions have the same signs.
+    uint64_t prepared = 0;
+    bool coherent = false;
+    float origin_min[3], origin_max[3];
+    float inverse_min[3], inverse_max[3];
+    float direction_sum[3]; // To visit the nearer child of a node first
+
+    // Closest hit of each ray so far
+    Scalar t[max_size];             // Ray parameter, +infinity without a hit
+    float t_max[max_size];          // Same in float for the box tests
+    float t_bound;                  // Largest t_max of the rays set up by prepare()
+    const Object *object[max_size]; // Null for the background
+    int facet[max_size];            // Facet hit on a MeshInstance, whose 'hit' is set by finish(), -1 otherwise
+    IntersectionT<Scalar> hit[max_size];
+
+    RayT<Scalar> ray(int k) const;
+    void set_ray(int k, const RayT<Scalar> &ray);
+
+    // Set up the box tests of the rays of 'rays'
+    void prepare(uint64_t rays);
+
+    // Recompute t_bound once the rays have new hits
+    void update_bound();
+
+    void set_hit(int k, Scalar param, const Object *obj, int f) {
+        t[k] = param;
+        t_max[k] = float(param);
+        object[k] = obj;
+        facet[k] = f;
+    }
+
+    // Slab test of the ray k, which enters 'box' at 't_entry' before its closest hit
+    bool intersect_box(int k, const AlignedBox3f &box, float &t_entry) const;
+
+    // Subset of 'rays' that enter 'box' before their closest hits
+    uint64_t intersect_box(const AlignedBox3f &box, uint64_t rays) const;
+
+    // True if none of the rays set up by prepare() can enter 'box' before its closest hit
+    bool misses(const AlignedBox3f &box) const;
+
+    // Compute the hits of the rays that hit the facet of a mesh
+    void finish();
 };
 
 struct Camera {
@@ -77,7 +239,17 @@ struct Object {
     Material material;
 
     virtual ~Object() = default; // Classes with virtual methods should have a virtual destructor!
-    virtual bool intersect(const Ray &ray, Intersection &hit) = 0;
+    virtual bool intersect(const Ray &ray, Intersection &hit) const = 0;
+    virtual bool intersect(const RayT<float> &ray, IntersectionT<float> &hit) const = 0;
+
+    // Bounding box, for the tree over the objects of the scene (Scene::object_bvh)
+    virtual AlignedBox3d bbox() const = 0;
+
+    // Update the closest hits of the subset 'rays' of a packet (see RayPacketT)
+    // with this object. The rays are tested one at a time unless the object
+    // traverses its own tree with the packet.
+    virtual void intersect_packet(RayPacketT<double> &packet, uint64_t rays) const;
+    virtual void intersect_packet(RayPacketT<float> &packet, uint64_t rays) const;
 };
 
 // We use smart pointers to hold objects as this is a virtual class
@@ -89,48 +261,514 @@ struct Sphere : public Object {
 
     virtual ~Sphere() = default;
 
-    virtual bool intersect(const Ray &ray, Intersection &hit) override;
+    virtual bool intersect(const Ray &ray, Intersection &hit) const override { return intersect_impl(ray, hit); }
+    virtual bool intersect(const RayT<float> &ray, IntersectionT<float> &hit) const override {
+        return intersect_impl(ray, hit);
+    }
+    virtual AlignedBox3d bbox() const override {
+        return AlignedBox3d(position - Vector3d::Constant(radius), position + Vector3d::Constant(radius));
+    }
+
+    template <typename Scalar>
+    bool intersect_impl(const RayT<Scalar> &ray, IntersectionT<Scalar> &hit) const;
+};
+
+// Plane spanned by origin + a * u + b * v, precomputed at scene load so that a
+// ray test is a handful of dot products instead of a 3x3 linear solve
+template <typename Scalar>
+struct PlanarPatchT {
+    typedef Matrix<Scalar, 3, 1> Vector3;
+    Vector3 normal; // Unit normal, u.cross(v) normalized
+    Scalar offset;  // normal.dot(x) == offset for the points of the plane
+    Vector3 u_dual; // Reciprocal basis: a = x.dot(u_dual) - u_offset
+    Vector3 v_dual; //                   b = x.dot(v_dual) - v_offset
+    Scalar u_offset;
+    Scalar v_offset;
+
+    PlanarPatchT() {}
+
+    PlanarPatchT(const Vector3 &origin, const Vector3 &u, const Vector3 &v);
+
+    // Compute the ray parameter 't' and the coordinates (a, b) of the point where
+    // the ray crosses the plane. Returns false if the ray is parallel to the plane.
+    bool intersect(const RayT<Scalar> &ray, Scalar &t, Scalar &a, Scalar &b) const;
+
+    template <typename Other>
+    PlanarPatchT<Other> cast() const;
 };
 
+typedef PlanarPatchT<double> PlanarPatch;
+
 struct Parallelogram : public Object {
     Vector3d origin;
     Vector3d u;
     Vector3d v;
 
+    PlanarPatch plane; // Set up by load_scene()
+
     virtual ~Parallelogram() = default;
 
-    virtual bool intersect(const Ray &ray, Intersection &hit) override;
+    virtual bool intersect(const Ray &ray, Intersection &hit) const override { return intersect_impl(ray, plane, hit); }
+    virtual bool intersect(const RayT<float> &ray, IntersectionT<float> &hit) const override {
+        return intersect_impl(ray, plane.cast<float>(), hit);
+    }
+    virtual AlignedBox3d bbox() const override {
+        AlignedBox3d box(origin);
+        return box.extend(origin + u).extend(origin + v).extend(origin + u + v);
+    }
+
+    template <typename Scalar>
+    bool intersect_impl(const RayT<Scalar> &ray, const PlanarPatchT<Scalar> &plane, IntersectionT<Scalar> &hit) const;
 };
 
-struct AABBTree {
+template <typename Scalar>
+struct AABBTreeT {
     struct Node {
-        AlignedBox3d bbox;
+        AlignedBox<Scalar, 3> bbox;
         int parent; // Index of the parent node (-1 for root)
         int left; // Index of the left child (-1 for a leaf)
         int right; // Index of the right child (-1 for a leaf)
-        int triangle; // Index of the node triangle (-1 for internal nodes)
+        int triangle; // Index of the first triangle of a leaf (-1 for internal nodes)
+        int count; // Number of triangles of a leaf, stored from 'triangle' in the facets (0 for internal nodes)
     };
 
     std::vector<Node> nodes;
     int root;
 
-    AABBTree() = default; // Default empty constructor
-    AABBTree(const MatrixXd &V, MatrixXi &F, int left, int right); // Build a BVH from an existing mesh
+    AABBTreeT() = default; // Default empty constructor
+    AABBTreeT(const MatrixXd &V, MatrixXi &F, int left, int right); // Build a BVH from an existing mesh (double only)
+
+    // Same tree with the boxes rounded outwards to another scalar type
+    template <typename Other>
+    AABBTreeT<Other> cast() const;
+
+    // Expected cost of a ray that hits the root box, see sah_node_cost
+    double sah_cost() const;
+
+    // Whether the tree over 'triangles' facets can be traversed: every node is
+    // reached once from the root, within bvh_max_depth, and the leaves cover ranges
+    // of the facets. Checks the trees read from the cache files.
+    bool valid(int triangles) const;
+
+    // Recompute the boxes for new positions 'V' of the vertices of the facets 'F',
+    // keeping the structure of the tree (double only)
+    void refit(const MatrixXd &V, const MatrixXi &F, int threads);
+};
+
+typedef AABBTreeT<double> AABBTree;
+
+template <>
+AABBTree::AABBTreeT(const MatrixXd &V, MatrixXi &F, int left, int right);
+
+template <>
+void AABBTree::refit(const MatrixXd &V, const MatrixXi &F, int threads);
+
+// Build a BVH with the binned surface area heuristic (see SahBuilder), with at
+// most 'max_leaf_size' triangles per leaf. The facets are reordered so that each
+// leaf owns a range of them.
+AABBTree build_sah_bvh(const MatrixXd &V, MatrixXi &F, int max_leaf_size, int threads);
+
+// Same builder over arbitrary boxes. The leaves own ranges of 'order', which is set
+// to the permutation of the boxes.
+AABBTree build_sah_bvh(const std::vector<AlignedBox3d> &boxes, int max_leaf_size, int threads, std::vector<int> &order);
+
+// Build a linear BVH from the Morton codes of the triangles (see LbvhBuilder), with
+// at most 'max_leaf_size' triangles per leaf. Much faster than build_sah_bvh(), for
+// a tree of lower quality. The facets are reordered as by build_sah_bvh().
+AABBTree build_lbvh(const MatrixXd &V, MatrixXi &F, int max_leaf_size, int threads);
+
+// 4-wide BVH collapsed from the binary tree in float (as in Wald et al. 2008,
+// "Getting Rid of Packets"). A node stores the boxes of its children as structures
+// of arrays, so that a ray is tested against the 4 boxes with one SSE slab test,
+// and a tree has about a third of the nodes of the binary one.
+struct WideBvh {
+    static const int width = 4;
+
+    struct Node {
+        float min_x[width], min_y[width], min_z[width]; // Boxes of the children (empty lanes
+        float max_x[width], max_y[width], max_z[width]; // are at +infinity and never hit)
+        int child[width]; // Index of an inner child, first triangle of a leaf child, -1 for an empty lane
+        int count[width]; // Number of triangles of a leaf child, 0 for an inner child or an empty lane
+    };
+
+    std::vector<Node> nodes; // nodes[0] is the root
+
+    WideBvh() = default;
+    WideBvh(const AABBTreeT<float> &tree);
+
+private:
+    // Append the node whose children are the (up to 'width') descendants of the
+    // binary node 'index' of largest area, and return its index
+    int collapse(const AABBTreeT<float> &tree, int index);
+};
+
+// Bit counts of the lane masks and of the Morton codes, with the intrinsics of
+// each compiler. The scans need a non-zero argument.
+inline int popcount64(uint64_t x) {
+#ifdef _MSC_VER
+    return int(__popcnt64(x));
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+inline int count_trailing_zeros64(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return int(index);
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+inline int count_leading_zeros64(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - int(index);
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+// Allocator of arrays aligned on 'alignment' bytes (std::allocator ignores the
+// alignment of over-aligned types before C++17)
+template <typename T, size_t alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, alignment> other;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, alignment> &) {}
+
+    T *allocate(size_t n) {
+#ifdef _WIN32
+        void *p = _aligned_malloc(n * sizeof(T), alignment);
+        if (!p) throw std::bad_alloc();
+#else
+        void *p = nullptr;
+        if (posix_memalign(&p, alignment, n * sizeof(T)) != 0) throw std::bad_alloc();
+#endif
+        return static_cast<T *>(p);
+    }
+#ifdef _WIN32
+    void deallocate(T *p, size_t) { _aligned_free(p); }
+#else
+    void deallocate(T *p, size_t) { free(p); }
+#endif
+
+    bool operator==(const AlignedAllocator &) const { return true; }
+    bool operator!=(const AlignedAllocator &) const { return false; }
+};
+
+// WideBvh with the boxes of the children quantized to 8 bits on a grid over the
+// box of their node (as in Ylitie et al. 2017, "Efficient Incoherent Ray Traversal
+// on GPUs Through Compressed Wide BVHs"). A node takes one cache line of 64 bytes,
+// 16 bytes per child instead of 32 in WideBvh and 44 in the binary tree in float.
+// The grid steps are powers of two, so that the decoding is exact, and the boxes
+// are rounded outwards: a decoded box always contains the box of the child.
+struct CompressedBvh {
+    static const int width = WideBvh::width;
+
+    struct alignas(64) Node {
+        float origin[3];            // Minimum corner of the box of the node
+        int8_t exponent[3];         // The grid step along axis a is 2^exponent[a]
+        uint8_t valid;              // Mask of the non-empty lanes
+        uint8_t q_min[3][width];    // Boxes of the children on the grid, as
+        uint8_t q_max[3][width];    // origin + q * step
+        int child[width];           // As in WideBvh::Node
+        uint16_t count[width];
+    };
+
+    std::vector<Node, AlignedAllocator<Node, 64>> nodes; // Same indices as in the WideBvh
+
+    CompressedBvh() = default;
+    CompressedBvh(const WideBvh &tree);
+};
+
+// Ray set up for the watertight triangle test of TriangleBlocksT (Woop et al. 2013,
+// "Watertight Ray/Triangle Intersection"). The axis of the largest component of
+// the direction is renamed z, and the space is sheared so that the ray goes along
+// z from the origin. A triangle is then hit if the origin is on the same side of
+// its 3 edges in the xy plane. An edge shared by two triangles gets the same value
+// with opposite signs in both, so that no ray passes between them.
+template <typename Scalar>
+struct ShearedRayT {
+    Scalar origin[3];
+    int kx, ky, kz;   // Axes of the sheared space
+    Scalar sx, sy, sz; // Shear of the axes kx and ky, and scale of kz
+
+    ShearedRayT() {}
+    ShearedRayT(const RayT<Scalar> &ray);
+};
+
+// Rays of a RayPacketT set up for the watertight test, with the origins and the
+// shears also stored as structures of arrays so that a triangle is tested against
+// 4 floats or 2 doubles of them at once. Only when the rays share the axes of their
+// sheared spaces, as in most coherent packets.
+template <typename Scalar>
+struct ShearedPacketT {
+    static const int max_size = RayPacketT<Scalar>::max_size;
+
+    ShearedRayT<Scalar> ray[max_size];
+    bool shared = true; // The rays set up have the same kx, ky and kz
+    Scalar origin[3][max_size]; // Components kx, ky and kz, if 'shared'
+    Scalar sx[max_size], sy[max_size], sz[max_size];
+
+    // Set up the rays of 'rays'
+    ShearedPacketT(const RayPacketT<Scalar> &packet, uint64_t rays);
+};
+
+// Triangles of a mesh in blocks of 4, stored as structures of arrays so that a ray
+// is tested against the 4 of a block at once with SSE. The triangles of a leaf of
+// the BVH are in consecutive lanes of a single block, the next leaf starting a new
+// block only if it does not fit in the lanes left (the larger leaves start a block
+// and fill ceil(count / 4) of them). A block holds the vertices only: the normal is
+// computed for the closest hit alone, by set_hit().
+template <typename Scalar>
+struct TriangleBlocksT {
+    static const int width = 4;
+
+    struct Block {
+        Scalar vertex[3][3][width]; // Coordinate a of vertex k of the triangle of lane l at [k][a][l]
+    };
+
+    std::vector<Block, AlignedAllocator<Block, 64>> blocks;
+    std::vector<int> slots; // Block * width + lane of each facet
+
+    // Copy the facets 'F' of the vertices 'V', the triangles of each leaf of 'bvh'
+    // starting a block
+    void build(const MatrixXd &V, const MatrixXi &F, const AABBTree &bvh);
+
+    // Test the lanes 'lanes' of block 'b', and return the mask of those hit between
+    // ray_epsilon() and 't_max', whose ray parameters are stored in 't'
+    int intersect_block(const ShearedRayT<Scalar> &ray, int b, int lanes, Scalar t_max, Scalar t[width]) const;
+
+    // Closest hit among the facets [first, first + count) of a leaf of the BVH that
+    // is nearer than 't'. Then 't' and 'facet' are set to the hit.
+    bool intersect_leaf(const ShearedRayT<Scalar> &ray, int first, int count, Scalar &t, int &facet) const;
+
+    // Test of the facet 'facet' alone
+    bool intersect_facet(const ShearedRayT<Scalar> &ray, int facet, Scalar &t) const;
+
+    // Subset of the rays of a packet sharing their axes that hit the facet 'facet'
+    // nearer than 't_max', whose ray parameters are stored in 't'
+    uint64_t intersect_packet(const ShearedPacketT<Scalar> &packet, uint64_t rays, int facet, const Scalar *t_max,
+                              Scalar *t) const;
+
+    // Set 'hit' to the point of parameter 't' of 'ray' on the facet 'facet'
+    void set_hit(const RayT<Scalar> &ray, int facet, Scalar t, IntersectionT<Scalar> &hit) const;
+};
+
+typedef TriangleBlocksT<double> TriangleBlocks;
+
+enum class BvhBuilder {
+    MEDIAN, // AABBTree constructor: median split along the longest axis of the mesh
+    SAH,    // build_sah_bvh()
+    LBVH    // build_lbvh()
 };
 
 struct Mesh : public Object {
     MatrixXd vertices; // n x 3 matrix (n points)
     MatrixXi facets; // m x 3 matrix (m triangles)
+    std::string path; // File the mesh was loaded from, if any
 
     AABBTree bvh;
+    TriangleBlocksT<double> triangles; // Facets tested by the rays, in the blocks of the leaves of 'bvh'
+
+    // Copies of 'bvh' and 'triangles' in float, and 4-wide trees, set up by init_float()
+    AABBTreeT<float> bvh_float;
+    TriangleBlocksT<float> triangles_float;
+    WideBvh bvh_wide;
+    CompressedBvh bvh_compressed;
 
     Mesh() = default; // Default empty constructor
     Mesh(const std::string &filename);
 
     virtual ~Mesh() = default;
 
-    virtual bool intersect(const Ray &ray, Intersection &hit) override;
+    // Builder and leaf size of 'bvh', and its SAH cost when it was built
+    BvhBuilder bvh_builder = BvhBuilder::SAH;
+    int bvh_leaf_size = bvh_max_leaf_size;
+    double bvh_built_cost = 0;
+
+    // Build 'bvh' (which reorders the facets) and the blocks of the facets
+    void build_bvh(BvhBuilder builder, int max_leaf_size = bvh_max_leaf_size);
+
+    // Move the vertices (the facets stay the same) and refit 'bvh' to them, or build
+    // it again if the refit made it bvh_rebuild_threshold times as costly as when it
+    // was built. Returns true if it was built again. The boxes of the instances
+    // follow the mesh, but the tree over the objects of a scene that uses the mesh
+    // must then be refitted with refit_object_bvh().
+    bool set_vertices(const MatrixXd &V);
+
+    // Set up the blocks of the facets, from the leaves of 'bvh'
+    void init_triangles();
+
+    void init_float();
+
+    // Read 'bvh' and the reordered facets from the BVH file of 'path', if it was
+    // built from the same file with the current builder settings
+    bool load_bvh_cache();
+    bool save_bvh_cache() const;
+
+    virtual bool intersect(const Ray &ray, Intersection &hit) const override {
+        return intersect_layout(ray, bvh, triangles, hit);
+    }
+    virtual bool intersect(const RayT<float> &ray, IntersectionT<float> &hit) const override {
+        return intersect_layout(ray, bvh_float, triangles_float, hit);
+    }
+    virtual AlignedBox3d bbox() const override { return bvh.nodes.empty() ? AlignedBox3d() : bvh.nodes[bvh.root].bbox; }
+
+    // Traversal of the tree of bvh_layout ('tree' for the binary one)
+    template <typename Scalar>
+    bool intersect_layout(const RayT<Scalar> &ray, const AABBTreeT<Scalar> &tree,
+                          const TriangleBlocksT<Scalar> &triangles, IntersectionT<Scalar> &hit) const {
+        BvhLayout layout = bvh_layout;
+        if (layout == BvhLayout::AUTO)
+            layout = facets.rows() >= compressed_bvh_min_facets ? BvhLayout::COMPRESSED : BvhLayout::WIDE;
+        if (layout == BvhLayout::WIDE) return intersect_wide(bvh_wide, ray, triangles, hit);
+        if (layout == BvhLayout::COMPRESSED) return intersect_wide(bvh_compressed, ray, triangles, hit);
+        return intersect_impl(ray, tree, triangles, hit);
+    }
+
+    template <typename Scalar>
+    bool intersect_impl(const RayT<Scalar> &ray, const AABBTreeT<Scalar> &tree,
+                        const TriangleBlocksT<Scalar> &triangles, IntersectionT<Scalar> &hit) const;
+
+    // Traversal of a 4-wide tree (WideBvh or CompressedBvh), with the triangles tested in 'Scalar'
+    template <typename Tree, typename Scalar>
+    bool intersect_wide(const Tree &tree, const RayT<Scalar> &ray, const TriangleBlocksT<Scalar> &triangles,
+                        IntersectionT<Scalar> &hit) const;
+
+    // Traversal of bvh_float with the subset 'rays' of a packet, whose hits are
+    // recorded as facets of 'instance' (see RayPacketT::finish())
+    template <typename Scalar>
+    void intersect_packet_facets(RayPacketT<Scalar> &packet, uint64_t rays, const Object *instance) const;
+
+    // Blocks of the facets in the given scalar type
+    template <typename Scalar>
+    const TriangleBlocksT<Scalar> &facet_triangles() const;
+};
+
+template <>
+const TriangleBlocksT<double> &Mesh::facet_triangles<double>() const { return triangles; }
+
+template <>
+const TriangleBlocksT<float> &Mesh::facet_triangles<float>() const { return triangles_float; }
+
+// A mesh placed in the scene by an affine transform, with its own material. The
+// geometry and the BVH of a mesh file are loaded once and shared by all its
+// instances, under the tree over the objects of the scene (Scene::object_bvh).
+// The rays are moved to the space of the mesh without normalizing their direction,
+// so that a hit has the same ray parameter in both spaces.
+struct MeshInstance : public Object {
+    std::shared_ptr<Mesh> mesh;
+    Affine3d transform = Affine3d::Identity(); // Mesh to scene
+    Affine3d inverse = Affine3d::Identity();   // Scene to mesh
+    Affine3f transform_float = Affine3f::Identity();
+    Affine3f inverse_float = Affine3f::Identity();
+    bool identity = true; // The rays and the hits are not transformed
+
+    MeshInstance() = default;
+    MeshInstance(const std::shared_ptr<Mesh> &m, const Affine3d &t) : mesh(m) { set_transform(t); }
+
+    virtual ~MeshInstance() = default;
+
+    void set_transform(const Affine3d &t);
+
+    virtual bool intersect(const Ray &ray, Intersection &hit) const override { return intersect_impl(ray, hit); }
+    virtual bool intersect(const RayT<float> &ray, IntersectionT<float> &hit) const override {
+        return intersect_impl(ray, hit);
+    }
+    virtual AlignedBox3d bbox() const override;
+    virtual void intersect_packet(RayPacketT<double> &packet, uint64_t rays) const override {
+        intersect_packet_impl(packet, rays);
+    }
+    virtual void intersect_packet(RayPacketT<float> &packet, uint64_t rays) const override {
+        intersect_packet_impl(packet, rays);
+    }
+
+    template <typename Scalar>
+    bool intersect_impl(const RayT<Scalar> &ray, IntersectionT<Scalar> &hit) const;
+
+    template <typename Scalar>
+    void intersect_packet_impl(RayPacketT<Scalar> &packet, uint64_t rays) const;
+
+    // Test the facet 'primitive' of the mesh only (see OccluderCache)
+    template <typename Scalar>
+    bool intersect_facet(const RayT<Scalar> &ray, int primitive, IntersectionT<Scalar> &hit) const;
+
+    // 'transform' and 'inverse' in the given scalar type
+    template <typename Scalar>
+    const Transform<Scalar, 3, Affine> &transform_as() const;
+    template <typename Scalar>
+    const Transform<Scalar, 3, Affine> &inverse_as() const;
+
+    // Move a ray to the space of the mesh, and a hit back to the scene
+    template <typename Scalar>
+    RayT<Scalar> ray_to_mesh(const RayT<Scalar> &ray) const {
+        return RayT<Scalar>(inverse_as<Scalar>() * ray.origin, inverse_as<Scalar>().linear() * ray.direction);
+    }
+    template <typename Scalar>
+    void hit_to_scene(IntersectionT<Scalar> &hit) const {
+        hit.position = transform_as<Scalar>() * hit.position;
+        hit.normal = (inverse_as<Scalar>().linear().transpose() * hit.normal).normalized();
+    }
+};
+
+template <>
+const Affine3d &MeshInstance::transform_as<double>() const { return transform; }
+template <>
+const Affine3f &MeshInstance::transform_as<float>() const { return transform_float; }
+template <>
+const Affine3d &MeshInstance::inverse_as<double>() const { return inverse; }
+template <>
+const Affine3f &MeshInstance::inverse_as<float>() const { return inverse_float; }
+
+// Binary tree over the lights, used to pick a few lights per shading point with a
+// probability that follows their estimated contribution
+struct LightTree {
+    struct Node {
+        AlignedBox3d bbox; // Bounding box of the positions of the lights below
+        double power;      // Total intensity of the lights below
+        int left;          // Index of the left child (-1 for a leaf)
+        int right;         // Index of the right child (-1 for a leaf)
+        int light;         // Index of the node light (-1 for internal nodes)
+    };
+
+    std::vector<Node> nodes;
+    int root = -1;
+
+    LightTree() = default; // Default empty constructor
+    LightTree(const std::vector<Light> &lights); // Build a tree over the lights of a scene
+
+    // Pick a light for the shading point 'p' of normal 'n' with the random number
+    // 'u' in [0, 1), and set 'pdf' to the probability of this choice
+    int sample(const Vector3d &p, const Vector3d &n, double u, double &pdf) const;
+
+    // Estimated contribution of a node to the shading point 'p' of normal 'n'
+    double importance(const Node &node, const Vector3d &p, const Vector3d &n) const;
+
+private:
+    int build(const std::vector<Light> &lights, std::vector<int> &indices, int begin, int end);
+};
+
+// Random numbers of one camera sample, see sampler.h
+struct SampleStream {
+    uint32_t pixel;
+    uint32_t sample;
+    uint32_t dimension = 0;
 
+    SampleStream(uint32_t p, uint32_t s) : pixel(p), sample(s) {}
+
+    double next() { return random_uniform(pixel, sample, 0, dimension++); }
 };
 
 struct Scene {
@@ -140,7 +778,22 @@ struct Scene {
     Camera camera;
     std::vector<Material> materials;
     std::vector<Light> lights;
-    std::vector<ObjectPtr> objects;
+    std::vector<ObjectPtr> objects;            // In the order of the leaves of object_bvh
+    std::vector<std::shared_ptr<Mesh>> meshes; // One per mesh file, shared by the instances in 'objects'
+
+    // Tree over the boxes of the objects, with one object per leaf, see build_object_bvh()
+    AABBTree object_bvh;
+    AABBTreeT<float> object_bvh_float;
+
+    template <typename Scalar>
+    const AABBTreeT<Scalar> &object_tree() const;
+
+    // Number of lights sampled per shading point with the light tree, 0 evaluates
+    // every light (reference mode)
+    int light_samples = 0;
+    LightTree light_tree;
+
+    RenderConfig render; // Defaults of the assignment and "Render" block of the scene file
 };
 
 struct Triangle_Centroid {
@@ -157,30 +810,83 @@ struct cmp {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// File of the BVH of a mesh file, next to it
+std::string bvh_cache_path(const std::string &mesh_file) { return mesh_file + ".bvh"; }
+
 // Read a triangle mesh from an off file
-void load_off(const std::string &filename, MatrixXd &V, MatrixXi &F) {
-    std::ifstream in(filename);
-    std::string token;
-    in >> token;
-    int nv, nf, ne;
-    in >> nv >> nf >> ne;
-    V.resize(nv, 3);
-    F.resize(nf, 3);
-    for (int i = 0; i < nv; ++i) {
-        in >> V(i, 0) >> V(i, 1) >> V(i, 2);
+Mesh::Mesh(const std::string &filename) {
+    // Load a mesh from a file (.off, .obj or .ply), and create a bvh. The mesh stays
+    // empty if the file cannot be read.
+    path = filename;
+    if (!load_mesh(filename, vertices, facets)) return;
+    if (use_bvh_cache && load_bvh_cache()) return;
+    build_bvh(BvhBuilder::SAH);
+    if (use_bvh_cache && !save_bvh_cache())
+        std::cerr << "Could not write the BVH cache " << bvh_cache_path(path) << std::endl;
+}
+
+void Mesh::build_bvh(BvhBuilder builder, int max_leaf_size) {
+    {
+        STATS_TIMER("bvh_build");
+        if (builder == BvhBuilder::SAH) {
+            bvh = build_sah_bvh(vertices, facets, max_leaf_size, default_thread_count());
+        } else if (builder == BvhBuilder::LBVH) {
+            bvh = build_lbvh(vertices, facets, max_leaf_size, default_thread_count());
+        } else {
+            totalNum = facets.rows(); // The constructor sorts the facets at the root only
+            bvh = AABBTree(vertices, facets, 0, facets.rows() - 1);
+        }
+    }
+    bvh_builder = builder;
+    bvh_leaf_size = max_leaf_size;
+    bvh_built_cost = bvh.sah_cost();
+
+    // The BVH construction reorders the facets, set up their blocks afterwards
+    init_triangles();
+    init_float();
+}
+
+bool Mesh::set_vertices(const MatrixXd &V) {
+    vertices = V;
+    {
+        STATS_TIMER("bvh_refit");
+        bvh.refit(vertices, facets, default_thread_count());
     }
-    for (int i = 0; i < nf; ++i) {
-        int s;
-        in >> s >> F(i, 0) >> F(i, 1) >> F(i, 2);
-        assert(s == 3);
+    if (bvh.sah_cost() > bvh_rebuild_threshold * bvh_built_cost) {
+        build_bvh(bvh_builder, bvh_leaf_size);
+        return true;
     }
-    totalNum = nf;
+    init_triangles();
+    init_float();
+    return false;
 }
 
-Mesh::Mesh(const std::string &filename) {
-    // Load a mesh from a file (assuming this is a .off file), and create a bvh
-    load_off(filename, vertices, facets);
-    bvh = AABBTree(vertices, facets, 0, facets.rows() - 1);
+void Mesh::init_triangles() {
+    STATS_TIMER("triangle_blocks");
+    triangles.build(vertices, facets, bvh);
+    triangles_float.build(vertices, facets, bvh);
+}
+
+void Mesh::init_float() {
+    bvh_float = bvh.cast<float>();
+    bvh_wide = WideBvh(bvh_float);
+    bvh_compressed = CompressedBvh(bvh_wide);
+}
+
+void MeshInstance::set_transform(const Affine3d &t) {
+    transform = t;
+    inverse = t.inverse();
+    transform_float = transform.cast<float>();
+    inverse_float = inverse.cast<float>();
+    identity = t.matrix().isIdentity(0);
+}
+
+AlignedBox3d MeshInstance::bbox() const {
+    AlignedBox3d box = mesh->bbox(), moved;
+    if (box.isEmpty()) return box;
+    for (int corner = 0; corner < 8; ++corner)
+        moved.extend(transform * box.corner(AlignedBox3d::CornerType(corner)));
+    return moved;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -196,7 +902,8 @@ AlignedBox3d bbox_triangle(const Vector3d &a, const Vector3d &b, const Vector3d
     return box;
 }
 
-AABBTree::AABBTree(const MatrixXd &V, MatrixXi &F, int left, int right) {
+template <>
+AABBTree::AABBTreeT(const MatrixXd &V, MatrixXi &F, int left, int right) {
     // Compute the centroids of all the triangles in the input mesh
     int n = right - left + 1;
     if (n == 1) {
@@ -205,6 +912,7 @@ AABBTree::AABBTree(const MatrixXd &V, MatrixXi &F, int left, int right) {
         node.left = -1;
         node.right = -1;
         node.triangle = left;
+        node.count = 1;
         node.bbox = bbox_triangle(V.row(F(node.triangle, 0)), V.row(F(node.triangle, 1)), V.row(F(node.triangle, 2)));
         this->nodes.push_back(node);
         this->root = 0;
@@ -271,6 +979,7 @@ AABBTree::AABBTree(const MatrixXd &V, MatrixXi &F, int left, int right) {
     node.left = bvh_left.root;
     node.right = bvh_right.root + bvh_left.nodes.size();
     node.triangle = -1;
+    node.count = 0;
 
     int offset = (int) bvh_left.nodes.size();
 
@@ -297,112 +1006,1081 @@ AABBTree::AABBTree(const MatrixXd &V, MatrixXi &F, int left, int right) {
     // Merge nodes 2 by 2, starting from the leaves of the forest, until only 1 tree is left.
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-bool Sphere::intersect(const Ray &ray, Intersection &hit) {
-    // TODO (Assignment 2)
-    double A = ray.direction.dot(ray.direction);
-    double B = 2 * ray.direction.dot(ray.origin - position);
-    double C = (ray.origin - position).dot(ray.origin - position) - radius * radius;
-    if (B * B - 4 * A * C >= 0) {
-        hit.ray_param = (-B - sqrt(B * B - 4 * A * C)) / (2 * A);
-        if (hit.ray_param < 0)
-            hit.ray_param = (-B + sqrt(B * B - 4 * A * C)) / (2 * A);
-        hit.position = ray.origin + hit.ray_param * ray.direction;
-        hit.normal = (hit.position - position).normalized();
-        if (hit.ray_param > epsilon) return true;
-        else return false;
-    } else return false;
-}
-
-bool Parallelogram::intersect(const Ray &ray, Intersection &hit) {
-    // TODO (Assignment 2)
-    Matrix3d A;
-    A << -u, -v, ray.direction;
-    Vector3d b(origin - ray.origin);
-    Vector3d x = A.colPivHouseholderQr().solve(b);
-    if (x(2) > epsilon && (0 <= x(0) && x(0) <= 1) && (0 <= x(1) && x(1) <= 1)) {
-        hit.ray_param = x(2);
-        hit.position = ray.origin + hit.ray_param * ray.direction;
-        hit.normal = u.cross(v).normalized();
-        return true;
-    } else return false;
+template <typename Scalar>
+template <typename Other>
+AABBTreeT<Other> AABBTreeT<Scalar>::cast() const {
+    AABBTreeT<Other> tree;
+    tree.root = root;
+    tree.nodes.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const Node &node = nodes[i];
+        typename AABBTreeT<Other>::Node &other = tree.nodes[i];
+        other.parent = node.parent;
+        other.left = node.left;
+        other.right = node.right;
+        other.triangle = node.triangle;
+        other.count = node.count;
+        // Pad the rounded box, so that it still contains the triangles
+        Matrix<Scalar, 3, 1> pad = Scalar(1e-6) * (node.bbox.min().cwiseAbs().cwiseMax(node.bbox.max().cwiseAbs())
+                                                   + Matrix<Scalar, 3, 1>::Ones());
+        other.bbox = AlignedBox<Other, 3>((node.bbox.min() - pad).template cast<Other>(),
+                                          (node.bbox.max() + pad).template cast<Other>());
+    }
+    return tree;
 }
 
 // -----------------------------------------------------------------------------
 
-bool intersect_triangle(const Ray &ray, const Vector3d &a, const Vector3d &b, const Vector3d &c, Intersection &hit) {
-    // TODO (Assignment 3)
-    //
-    // Compute whether the ray intersects the given triangle.
-    // If you have done the parallelogram case, this should be very similar to it.
-    Matrix3d A;
-    Vector3d u = b - a;
-    Vector3d v = c - a;
-    A << -u, -v, ray.direction;
-    Vector3d B(a - ray.origin);
-    Vector3d x = A.colPivHouseholderQr().solve(B);
-    if (x(2) > epsilon && x(0) >= 0 && x(1) >= 0 && (0 <= x(0) + x(1) && x(0) + x(1) <= 1)) {
-        hit.ray_param = x(2);
-        hit.position = ray.origin + hit.ray_param * ray.direction;
-        hit.normal = u.cross(v).normalized();
-        return true;
-    } else return false;
+// Costs of the surface area heuristic: a ray that hits the box of a node pays
+// sah_node_cost to test its children, or sah_triangle_cost per triangle of a leaf
+const double sah_node_cost = 1.0;
+const double sah_triangle_cost = 1.0;
+
+template <typename Scalar>
+double surface_area(const AlignedBox<Scalar, 3> &box) {
+    Matrix<Scalar, 3, 1> d = box.sizes();
+    return 2 * double(d(0) * d(1) + d(1) * d(2) + d(2) * d(0));
 }
 
-bool intersect_box(const Ray &ray, const AlignedBox3d &box) {
-    // TODO (Assignment 3)
-    //
-    // Compute whether the ray intersects the given box.
-    // There is no need to set the resulting normal and ray parameter, since
-    // we are not testing with the real surface here anyway.
-    double x_min = box.min()(0);
-    double y_min = box.min()(1);
-    double z_min = box.min()(2);
-    double x_max = box.max()(0);
-    double y_max = box.max()(1);
-    double z_max = box.max()(2);
-    double tx_max, tx_min, ty_max, ty_min, tz_max, tz_min, t_max, t_min;
-    Vector3d e = ray.origin;
-    Vector3d d = ray.direction;
-    if (d(0) > 0) {
-        tx_min = (x_min - e(0)) / d(0);
-        tx_max = (x_max - e(0)) / d(0);
-    } else if (d(0) < 0) {
-        tx_max = (x_min - e(0)) / d(0);
-        tx_min = (x_max - e(0)) / d(0);
+// The probability that a ray which hits the root box also hits the box of a node is
+// the ratio of their areas
+template <typename Scalar>
+double AABBTreeT<Scalar>::sah_cost() const {
+    if (nodes.empty()) return 0;
+    double root_area = surface_area(nodes[root].bbox);
+    double cost = 0;
+    for (const Node &node: nodes) {
+        double p = surface_area(node.bbox) / root_area;
+        cost += p * (node.triangle == -1 ? sah_node_cost : sah_triangle_cost * node.count);
     }
-    if (d(1) > 0) {
-        ty_min = (y_min - e(1)) / d(1);
-        ty_max = (y_max - e(1)) / d(1);
-    } else if (d(1) < 0) {
-        ty_max = (y_min - e(1)) / d(1);
-        ty_min = (y_max - e(1)) / d(1);
-    }
-    if (d(2) > 0) {
-        tz_min = (z_min - e(2)) / d(2);
-        tz_max = (z_max - e(2)) / d(2);
-    } else if (d(2) < 0) {
-        tz_max = (z_min - e(2)) / d(2);
-        tz_min = (z_max - e(2)) / d(2);
+    return cost;
+}
+
+template <typename Scalar>
+bool AABBTreeT<Scalar>::valid(int triangles) const {
+    int n = (int) nodes.size();
+    if (n == 0 || root < 0 || root >= n) return false;
+    std::vector<char> seen(n, 0);
+    std::vector<std::pair<int, int>> stack(1, std::make_pair(root, 0));
+    while (!stack.empty()) {
+        int index = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        if (index < 0 || index >= n || seen[index] || depth > bvh_max_depth) return false;
+        seen[index] = 1;
+        const Node &node = nodes[index];
+        if (node.triangle != -1) {
+            if (node.triangle < 0 || node.count < 1 || node.count > triangles - node.triangle) return false;
+        } else {
+            stack.push_back(std::make_pair(node.left, depth + 1));
+            stack.push_back(std::make_pair(node.right, depth + 1));
+        }
     }
-    t_max = std::min(tx_max, std::min(ty_max, tz_max));
-    t_min = std::max(tx_min, std::max(ty_min, tz_min));
-    return t_max > t_min;
+    return true;
 }
 
-bool Mesh::intersect(const Ray &ray, Intersection &closest_hit) {
-    // TODO (Assignment 3)
+// The leaves get the boxes of their triangles, and the boxes are merged up to the
+// root as in LbvhBuilder: the first child to reach a node stops there, the second
+// one goes on with the box of the node.
+template <>
+void AABBTree::refit(const MatrixXd &V, const MatrixXi &F, int threads) {
+    const int grain = 4096;
+    int n = nodes.size();
+    std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[n]);
+    parallel_for(n, threads, grain, [&](int i) { visits[i].store(0); });
+    parallel_for(n, threads, grain, [&](int i) {
+        Node &leaf = nodes[i];
+        if (leaf.triangle == -1) return;
+        leaf.bbox.setEmpty();
+        for (int t = leaf.triangle; t < leaf.triangle + leaf.count; ++t)
+            leaf.bbox.extend(bbox_triangle(V.row(F(t, 0)), V.row(F(t, 1)), V.row(F(t, 2))));
+        for (int node = leaf.parent; node != -1 && visits[node].fetch_add(1) == 1; node = nodes[node].parent)
+            nodes[node].bbox = nodes[nodes[node].left].bbox.merged(nodes[nodes[node].right].bbox);
+    });
+}
 
-    // Method (1): Traverse every triangle and return the closest hit.
-//    double ray_param = INFINITY;
-//    bool res = false;
+// Binned SAH builder (Wald 2007, "On fast Construction of SAH-based Bounding Volume
+// Hierarchies"). The centroids of a node are sorted into 'bins' slabs along each
+// axis, and the node is split at the slab boundary of lowest SAH cost over the
+// three axes. A node becomes a leaf when it has at most 'max_leaf_size' triangles
+// and splitting it does not lower the cost. The two subtrees of the large nodes
+// are built on two threads. Below depth bvh_max_depth - 32, the nodes are split
+// in two halves, so that the depth stays under bvh_max_depth.
+struct SahBuilder {
+    static const int bins = 16;
+    static const int parallel_min = 4096; // Smallest node whose subtrees are built in parallel
+
+    int max_leaf_size;
+    std::vector<AlignedBox3d> boxes; // Bounding box of each triangle
+    std::vector<Vector3d> centroids; // Center of the box of each triangle
+    std::vector<int> order;          // Triangles, permuted so that each node owns a range
+
+    SahBuilder(const MatrixXd &V, const MatrixXi &F, int max_leaf_size);
+    SahBuilder(const std::vector<AlignedBox3d> &boxes, int max_leaf_size);
+
+    // Build the subtree of the triangles order[begin, end), whose root is at 'depth',
+    // into 'nodes' on 'threads' threads, and return the index of its root
+    int build(int begin, int end, int depth, int threads, std::vector<AABBTree::Node> &nodes);
+};
+
+SahBuilder::SahBuilder(const MatrixXd &V, const MatrixXi &F, int max_leaf_size)
+    : max_leaf_size(std::max(max_leaf_size, 1)), boxes(F.rows()), centroids(F.rows()), order(F.rows()) {
+    for (int i = 0; i < F.rows(); ++i) {
+        boxes[i] = bbox_triangle(V.row(F(i, 0)), V.row(F(i, 1)), V.row(F(i, 2)));
+        centroids[i] = boxes[i].center();
+        order[i] = i;
+    }
+}
+
+SahBuilder::SahBuilder(const std::vector<AlignedBox3d> &b, int max_leaf_size)
+    : max_leaf_size(std::max(max_leaf_size, 1)), boxes(b), centroids(b.size()), order(b.size()) {
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        centroids[i] = boxes[i].isEmpty() ? Vector3d(Vector3d::Zero()) : Vector3d(boxes[i].center());
+        order[i] = i;
+    }
+}
+
+int SahBuilder::build(int begin, int end, int depth, int threads, std::vector<AABBTree::Node> &nodes) {
+    int n = end - begin;
+    AABBTree::Node node;
+    AlignedBox3d centroid_box;
+    for (int i = begin; i < end; ++i) {
+        node.bbox.extend(boxes[order[i]]);
+        centroid_box.extend(centroids[order[i]]);
+    }
+    node.parent = -1;
+    node.left = -1;
+    node.right = -1;
+    node.triangle = -1;
+    node.count = 0;
+    int index = nodes.size();
+    nodes.push_back(node);
+
+    // Cheapest split: triangles of the bins [0, best_bin] of 'best_axis' on the left
+    int best_axis = -1, best_bin = -1;
+    double best_cost = INFINITY;
+    for (int axis = 0; axis < 3 && n > 1 && depth < bvh_max_depth - 32; ++axis) {
+        double lo = centroid_box.min()(axis);
+        double extent = centroid_box.max()(axis) - lo;
+        if (extent <= 0) continue;
+        AlignedBox3d bin_boxes[bins];
+        int bin_counts[bins] = {};
+        for (int i = begin; i < end; ++i) {
+            int b = std::min(int(bins * (centroids[order[i]](axis) - lo) / extent), bins - 1);
+            bin_boxes[b].extend(boxes[order[i]]);
+            bin_counts[b]++;
+        }
+        // Sweep from the right to get the area and the number of triangles on the right
+        // of each boundary, then from the left to evaluate the splits
+        double right_area[bins];
+        int right_count[bins];
+        AlignedBox3d box;
+        int count = 0;
+        for (int b = bins - 1; b > 0; --b) {
+            box.extend(bin_boxes[b]);
+            count += bin_counts[b];
+            right_area[b] = count > 0 ? surface_area(box) : 0;
+            right_count[b] = count;
+        }
+        box.setEmpty();
+        count = 0;
+        for (int b = 0; b < bins - 1; ++b) {
+            box.extend(bin_boxes[b]);
+            count += bin_counts[b];
+            if (count == 0 || right_count[b + 1] == 0) continue;
+            double cost = count * surface_area(box) + right_count[b + 1] * right_area[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    double leaf_cost = sah_triangle_cost * n;
+    double split_cost = sah_node_cost + sah_triangle_cost * best_cost / surface_area(node.bbox);
+    if (n == 1 || (n <= max_leaf_size && (best_axis < 0 || leaf_cost <= split_cost))) {
+        nodes[index].triangle = begin;
+        nodes[index].count = n;
+        return index;
+    }
+
+    int mid;
+    if (best_axis < 0) {
+        // All the centroids are at the same point (or the tree is too deep), split the
+        // range in two halves
+        mid = begin + n / 2;
+    } else {
+        double lo = centroid_box.min()(best_axis);
+        double extent = centroid_box.max()(best_axis) - lo;
+        mid = std::partition(order.begin() + begin, order.begin() + end, [&](int t) {
+            return std::min(int(bins * (centroids[t](best_axis) - lo) / extent), bins - 1) <= best_bin;
+        }) - order.begin();
+    }
+
+    int left, right;
+    if (threads > 1 && n >= parallel_min) {
+        // The right subtree is built in its own array, and appended afterwards
+        std::vector<AABBTree::Node> right_nodes;
+        int right_root;
+        std::thread worker([&]() { right_root = build(mid, end, depth + 1, threads / 2, right_nodes); });
+        left = build(begin, mid, depth + 1, threads - threads / 2, nodes);
+        worker.join();
+        int offset = nodes.size();
+        for (AABBTree::Node &child: right_nodes) {
+            if (child.left != -1) {
+                child.left += offset;
+                child.right += offset;
+            }
+            if (child.parent != -1) child.parent += offset;
+            nodes.push_back(child);
+        }
+        right = right_root + offset;
+    } else {
+        left = build(begin, mid, depth + 1, 1, nodes);
+        right = build(mid, end, depth + 1, 1, nodes);
+    }
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[left].parent = index;
+    nodes[right].parent = index;
+    return index;
+}
+
+AABBTree build_sah_bvh(const MatrixXd &V, MatrixXi &F, int max_leaf_size, int threads) {
+    AABBTree tree;
+    tree.root = 0;
+    if (F.rows() == 0) return tree;
+    SahBuilder builder(V, F, max_leaf_size);
+    tree.nodes.reserve(2 * F.rows());
+    builder.build(0, F.rows(), 0, threads, tree.nodes);
+
+    MatrixXi sorted(F.rows(), F.cols());
+    for (int i = 0; i < F.rows(); ++i)
+        sorted.row(i) = F.row(builder.order[i]);
+    F = sorted;
+    return tree;
+}
+
+AABBTree build_sah_bvh(const std::vector<AlignedBox3d> &boxes, int max_leaf_size, int threads, std::vector<int> &order) {
+    AABBTree tree;
+    tree.root = 0;
+    order.clear();
+    if (boxes.empty()) return tree;
+    SahBuilder builder(boxes, max_leaf_size);
+    tree.nodes.reserve(2 * boxes.size());
+    builder.build(0, boxes.size(), 0, threads, tree.nodes);
+    order = builder.order;
+    return tree;
+}
+
+// -----------------------------------------------------------------------------
+
+// Spread the 10 low bits of x to every third bit
+inline uint32_t expand_bits(uint32_t x) {
+    x = (x * 0x00010001u) & 0xFF0000FFu;
+    x = (x * 0x00000101u) & 0x0F00F00Fu;
+    x = (x * 0x00000011u) & 0xC30C30C3u;
+    x = (x * 0x00000005u) & 0x49249249u;
+    return x;
+}
+
+// 30 bit Morton code of a point of the unit cube
+inline uint32_t morton_code(const Vector3d &p) {
+    auto quantize = [](double x) { return uint32_t(std::min(std::max(x * 1024, 0.0), 1023.0)); };
+    return (expand_bits(quantize(p(0))) << 2) | (expand_bits(quantize(p(1))) << 1) | expand_bits(quantize(p(2)));
+}
+
+// Sort 'keys' on their bits [first_bit, last_bit) with a least significant digit
+// radix sort, 'radix_bits' at a time. Each thread counts and then scatters its own
+// chunk of the keys, so that the sort is stable.
+void radix_sort(std::vector<uint64_t> &keys, int first_bit, int last_bit, int threads) {
+    const int radix_bits = 10, buckets = 1 << radix_bits;
+    int n = keys.size();
+    int chunks = std::max(1, std::min(threads, n / buckets));
+    int chunk_size = (n + chunks - 1) / chunks;
+    std::vector<uint64_t> sorted(n);
+    std::vector<int> offsets(size_t(chunks) * buckets);
+    for (int shift = first_bit; shift < last_bit; shift += radix_bits) {
+        auto bucket = [&](uint64_t key) { return int((key >> shift) & (buckets - 1)); };
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for(chunks, threads, 1, [&](int c) {
+            for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); ++i)
+                offsets[c * buckets + bucket(keys[i])]++;
+        });
+        // Keys of bucket b from chunk c go after those of the smaller buckets, and of
+        // bucket b from the previous chunks
+        int sum = 0;
+        for (int b = 0; b < buckets; ++b) {
+            for (int c = 0; c < chunks; ++c) {
+                int count = offsets[c * buckets + b];
+                offsets[c * buckets + b] = sum;
+                sum += count;
+            }
+        }
+        parallel_for(chunks, threads, 1, [&](int c) {
+            for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); ++i)
+                sorted[offsets[c * buckets + bucket(keys[i])]++] = keys[i];
+        });
+        keys.swap(sorted);
+    }
+}
+
+// Linear BVH builder (Karras 2012, "Maximizing Parallelism in the Construction of
+// BVHs, Octrees, and k-d Trees"). The triangles are sorted by the Morton code of
+// their centroid, the code being followed by the index of the triangle so that all
+// the keys differ. Inner node i of the radix tree over the sorted keys starts or
+// ends at key i, and is found from the keys alone, independently of the other
+// nodes. The boxes are then merged bottom-up: the first child to reach a node stops
+// there, the second one goes on with the box of the node. Finally, the tree is
+// copied in depth-first order, with the nodes of at most 'max_leaf_size' triangles
+// turned into leaves. The size of each subtree is known, so that the subtrees of
+// the large nodes are copied on two threads as in SahBuilder, and every other step
+// is a parallel loop.
+//
+// The radix tree has n - 1 inner nodes (0 is the root), followed by n leaves.
+struct LbvhBuilder {
+    static const int parallel_min = 4096; // Smallest node whose subtrees are copied in parallel
+
+    int n;
+    int max_leaf_size;
+    std::vector<uint64_t> keys;               // Morton code << 32 | triangle, sorted
+    std::vector<AlignedBox3d> triangle_boxes; // Boxes of the triangles, in the order of the facets
+    std::vector<AlignedBox3d> boxes;          // Boxes of the inner nodes
+    std::vector<int> left, right;    // Children of the inner nodes
+    std::vector<int> first, last;    // Leaves under each inner node
+    std::vector<int> parent;         // Parent of each node (-1 for the root)
+    std::vector<int> size;           // Number of nodes of the subtree of each inner node, once copied
+
+    LbvhBuilder(const MatrixXd &V, const MatrixXi &F, int max_leaf_size, int threads);
+
+    // Length of the common prefix of keys i and j (-1 if j is out of range)
+    int delta(int i, int j) const {
+        if (j < 0 || j >= n) return -1;
+        return count_leading_zeros64(keys[i] ^ keys[j]);
+    }
+
+    // Find the children and the range of the inner node i
+    void build_node(int i);
+
+    const AlignedBox3d &box(int index) const {
+        return index >= n - 1 ? triangle_boxes[uint32_t(keys[index - (n - 1)])] : boxes[index];
+    }
+
+    // Number of nodes of the subtree of node 'index', once copied
+    int subtree_size(int index) const { return index >= n - 1 ? 1 : size[index]; }
+
+    // Copy the subtree of node 'index' to nodes[position...], on 'threads' threads
+    void emit(int index, int parent_index, int position, int threads, std::vector<AABBTree::Node> &nodes) const;
+};
+
+LbvhBuilder::LbvhBuilder(const MatrixXd &V, const MatrixXi &F, int max_leaf_size, int threads)
+    : n(F.rows()), max_leaf_size(std::max(max_leaf_size, 1)), keys(n), triangle_boxes(n), boxes(n - 1), left(n - 1),
+      right(n - 1), first(n - 1), last(n - 1), parent(2 * n - 1, -1), size(n - 1) {
+    const int grain = 4096;
+    parallel_for(n, threads, grain, [&](int i) {
+        triangle_boxes[i] = bbox_triangle(V.row(F(i, 0)), V.row(F(i, 1)), V.row(F(i, 2)));
+    });
+
+    // Box of the centroids, one part per chunk of triangles
+    int chunks = (n + grain - 1) / grain;
+    std::vector<AlignedBox3d> parts(chunks);
+    parallel_for(chunks, threads, 1, [&](int c) {
+        for (int i = c * grain; i < std::min(n, (c + 1) * grain); ++i) parts[c].extend(triangle_boxes[i].center());
+    });
+    AlignedBox3d centroid_box;
+    for (const AlignedBox3d &part: parts) centroid_box.extend(part);
+    Vector3d scale = centroid_box.sizes().cwiseMax(1e-30).cwiseInverse();
+
+    parallel_for(n, threads, grain, [&](int i) {
+        Vector3d p = (triangle_boxes[i].center() - centroid_box.min()).cwiseProduct(scale);
+        keys[i] = uint64_t(morton_code(p)) << 32 | uint32_t(i);
+    });
+    radix_sort(keys, 32, 62, threads);
+
+    parallel_for(n - 1, threads, grain, [&](int i) { build_node(i); });
+
+    // Merge the boxes and count the nodes from the leaves up
+    std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[n - 1]);
+    parallel_for(n - 1, threads, grain, [&](int i) { visits[i].store(0); });
+    parallel_for(n, threads, grain, [&](int k) {
+        for (int node = parent[n - 1 + k]; node != -1 && visits[node].fetch_add(1) == 1; node = parent[node]) {
+            boxes[node] = box(left[node]).merged(box(right[node]));
+            bool leaf = last[node] - first[node] < max_leaf_size;
+            size[node] = leaf ? 1 : 1 + subtree_size(left[node]) + subtree_size(right[node]);
+        }
+    });
+}
+
+void LbvhBuilder::build_node(int i) {
+    // Direction of the range of the node: towards the neighbor with the longest common prefix
+    int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+    int delta_min = delta(i, i - d);
+
+    // Other end j of the range: exponential then binary search of the last key
+    // whose common prefix with key i is longer than delta_min
+    int length_max = 2;
+    while (delta(i, i + length_max * d) > delta_min) length_max *= 2;
+    int length = 0;
+    for (int t = length_max / 2; t >= 1; t /= 2)
+        if (delta(i, i + (length + t) * d) > delta_min) length += t;
+    int j = i + length * d;
+
+    // Split: the last key (from i) that shares more than the common prefix of the range
+    int delta_node = delta(i, j);
+    int split = 0;
+    for (int t = (length + 1) / 2;; t = (t + 1) / 2) {
+        if (delta(i, i + (split + t) * d) > delta_node) split += t;
+        if (t == 1) break;
+    }
+    int gamma = i + split * d + std::min(d, 0);
+
+    first[i] = std::min(i, j);
+    last[i] = std::max(i, j);
+    left[i] = first[i] == gamma ? n - 1 + gamma : gamma;
+    right[i] = last[i] == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+    parent[left[i]] = i;
+    parent[right[i]] = i;
+}
+
+void LbvhBuilder::emit(int index, int parent_index, int position, int threads,
+                       std::vector<AABBTree::Node> &nodes) const {
+    AABBTree::Node &node = nodes[position];
+    node.bbox = box(index);
+    node.parent = parent_index;
+    node.left = -1;
+    node.right = -1;
+    node.triangle = -1;
+    node.count = 0;
+
+    bool leaf = index >= n - 1;
+    int begin = leaf ? index - (n - 1) : first[index];
+    int end = leaf ? begin + 1 : last[index] + 1;
+    if (end - begin <= max_leaf_size) {
+        node.triangle = begin;
+        node.count = end - begin;
+        return;
+    }
+    node.left = position + 1;
+    node.right = position + 1 + subtree_size(left[index]);
+    if (threads > 1 && end - begin >= parallel_min) {
+        std::thread worker([&]() { emit(right[index], position, node.right, threads / 2, nodes); });
+        emit(left[index], position, node.left, threads - threads / 2, nodes);
+        worker.join();
+    } else {
+        emit(left[index], position, node.left, 1, nodes);
+        emit(right[index], position, node.right, 1, nodes);
+    }
+}
+
+AABBTree build_lbvh(const MatrixXd &V, MatrixXi &F, int max_leaf_size, int threads) {
+    AABBTree tree;
+    tree.root = 0;
+    if (F.rows() == 0) return tree;
+    LbvhBuilder builder(V, F, max_leaf_size, threads);
+    tree.nodes.resize(builder.subtree_size(0)); // The root is the only leaf if there is a single triangle
+    builder.emit(0, -1, 0, threads, tree.nodes);
+
+    MatrixXi sorted(F.rows(), F.cols());
+    parallel_for(F.rows(), threads, 4096, [&](int k) {
+        for (int c = 0; c < F.cols(); ++c) sorted(k, c) = F(uint32_t(builder.keys[k]), c);
+    });
+    F = sorted;
+    return tree;
+}
+
+// -----------------------------------------------------------------------------
+
+WideBvh::WideBvh(const AABBTreeT<float> &tree) {
+    if (!tree.nodes.empty()) collapse(tree, tree.root);
+}
+
+int WideBvh::collapse(const AABBTreeT<float> &tree, int index) {
+    int result = nodes.size();
+    nodes.emplace_back();
+
+    // Open the inner child of largest area until there are 'width' children
+    std::vector<int> children;
+    if (tree.nodes[index].triangle != -1) {
+        children.push_back(index); // The whole tree is a single leaf
+    } else {
+        children.push_back(tree.nodes[index].left);
+        children.push_back(tree.nodes[index].right);
+    }
+    while (children.size() < width) {
+        int largest = -1;
+        double largest_area = -1;
+        for (size_t k = 0; k < children.size(); ++k) {
+            const AABBTreeT<float>::Node &c = tree.nodes[children[k]];
+            if (c.triangle == -1 && surface_area(c.bbox) > largest_area) {
+                largest = k;
+                largest_area = surface_area(c.bbox);
+            }
+        }
+        if (largest < 0) break;
+        int c = children[largest];
+        children[largest] = tree.nodes[c].left;
+        children.push_back(tree.nodes[c].right);
+    }
+
+    Node node;
+    for (int k = 0; k < width; ++k) {
+        if (k >= int(children.size())) {
+            node.min_x[k] = node.min_y[k] = node.min_z[k] = INFINITY;
+            node.max_x[k] = node.max_y[k] = node.max_z[k] = INFINITY;
+            node.child[k] = -1;
+            node.count[k] = 0;
+            continue;
+        }
+        const AABBTreeT<float>::Node &c = tree.nodes[children[k]];
+        node.min_x[k] = c.bbox.min()(0);
+        node.min_y[k] = c.bbox.min()(1);
+        node.min_z[k] = c.bbox.min()(2);
+        node.max_x[k] = c.bbox.max()(0);
+        node.max_y[k] = c.bbox.max()(1);
+        node.max_z[k] = c.bbox.max()(2);
+        if (c.triangle != -1) {
+            node.child[k] = c.triangle;
+            node.count[k] = c.count;
+        } else {
+            node.child[k] = collapse(tree, children[k]);
+            node.count[k] = 0;
+        }
+    }
+    nodes[result] = node;
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+
+// 2^e as a float, for -126 <= e <= 127
+inline float power_of_two(int e) {
+    int32_t bits = (e + 127) << 23;
+    float x;
+    memcpy(&x, &bits, 4);
+    return x;
+}
+
+CompressedBvh::CompressedBvh(const WideBvh &tree) : nodes(tree.nodes.size()) {
+    for (size_t i = 0; i < tree.nodes.size(); ++i) {
+        const WideBvh::Node &wide = tree.nodes[i];
+        Node &node = nodes[i];
+        memset(&node, 0, sizeof(Node));
+        for (int k = 0; k < width; ++k) {
+            node.child[k] = wide.child[k];
+            node.count[k] = wide.count[k];
+            if (wide.child[k] != -1) node.valid |= 1 << k;
+        }
+
+        const float *mins[3] = {wide.min_x, wide.min_y, wide.min_z};
+        const float *maxs[3] = {wide.max_x, wide.max_y, wide.max_z};
+        for (int a = 0; a < 3; ++a) {
+            float lo = INFINITY, hi = -INFINITY;
+            for (int k = 0; k < width; ++k) {
+                if (!(node.valid & (1 << k))) continue;
+                lo = std::min(lo, mins[a][k]);
+                hi = std::max(hi, maxs[a][k]);
+            }
+            node.origin[a] = lo;
+
+            // Smallest step with 255 steps over the box of the node, larger if the
+            // rounding of the decoded bounds needs it
+            int e;
+            std::frexp(double(hi - lo) / 255, &e);
+            for (e = std::max(e, -126);; ++e) {
+                float step = power_of_two(e);
+                auto decode = [&](int q) { return lo + float(q) * step; };
+                bool fits = true;
+                for (int k = 0; k < width && fits; ++k) {
+                    if (!(node.valid & (1 << k))) continue;
+                    int q_min = std::max(int(std::floor((mins[a][k] - lo) / step)), 0);
+                    int q_max = std::min(int(std::ceil((maxs[a][k] - lo) / step)), 255);
+                    while (q_min > 0 && decode(q_min) > mins[a][k]) --q_min;
+                    while (q_max < 255 && decode(q_max) < maxs[a][k]) ++q_max;
+                    fits = decode(q_max) >= maxs[a][k];
+                    node.q_min[a][k] = q_min;
+                    node.q_max[a][k] = q_max;
+                }
+                if (fits) break;
+            }
+            node.exponent[a] = e;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename Scalar>
+bool Sphere::intersect_impl(const RayT<Scalar> &ray, IntersectionT<Scalar> &hit) const {
+    // TODO (Assignment 2)
+    Matrix<Scalar, 3, 1> position = this->position.cast<Scalar>();
+    Scalar radius = this->radius;
+    Scalar A = ray.direction.dot(ray.direction);
+    Scalar B = 2 * ray.direction.dot(ray.origin - position);
+    Scalar C = (ray.origin - position).dot(ray.origin - position) - radius * radius;
+    if (B * B - 4 * A * C >= 0) {
+        hit.ray_param = (-B - sqrt(B * B - 4 * A * C)) / (2 * A);
+        if (hit.ray_param < 0)
+            hit.ray_param = (-B + sqrt(B * B - 4 * A * C)) / (2 * A);
+        hit.position = ray.origin + hit.ray_param * ray.direction;
+        hit.normal = (hit.position - position).normalized();
+        if (hit.ray_param > ray_epsilon<Scalar>()) return true;
+        else return false;
+    } else return false;
+}
+
+template <typename Scalar>
+PlanarPatchT<Scalar>::PlanarPatchT(const Vector3 &origin, const Vector3 &u, const Vector3 &v) {
+    Vector3 n = u.cross(v);
+    Scalar n2 = n.squaredNorm();
+    normal = n.normalized();
+    offset = normal.dot(origin);
+    // Degenerate patches get a null basis, and are never hit
+    u_dual = n2 > 0 ? Vector3(v.cross(n) / n2) : Vector3(0, 0, 0);
+    v_dual = n2 > 0 ? Vector3(n.cross(u) / n2) : Vector3(0, 0, 0);
+    u_offset = origin.dot(u_dual);
+    v_offset = origin.dot(v_dual);
+}
+
+template <typename Scalar>
+bool PlanarPatchT<Scalar>::intersect(const RayT<Scalar> &ray, Scalar &t, Scalar &a, Scalar &b) const {
+    Scalar denom = normal.dot(ray.direction);
+    if (denom == 0) return false;
+    t = (offset - normal.dot(ray.origin)) / denom;
+    Vector3 p = ray.origin + t * ray.direction;
+    a = p.dot(u_dual) - u_offset;
+    b = p.dot(v_dual) - v_offset;
+    return true;
+}
+
+template <typename Scalar>
+template <typename Other>
+PlanarPatchT<Other> PlanarPatchT<Scalar>::cast() const {
+    PlanarPatchT<Other> patch;
+    patch.normal = normal.template cast<Other>();
+    patch.offset = offset;
+    patch.u_dual = u_dual.template cast<Other>();
+    patch.v_dual = v_dual.template cast<Other>();
+    patch.u_offset = u_offset;
+    patch.v_offset = v_offset;
+    return patch;
+}
+
+template <typename Scalar>
+bool Parallelogram::intersect_impl(const RayT<Scalar> &ray, const PlanarPatchT<Scalar> &plane,
+                                   IntersectionT<Scalar> &hit) const {
+    // TODO (Assignment 2)
+    Scalar t, a, b;
+    if (plane.intersect(ray, t, a, b) && t > ray_epsilon<Scalar>() && (0 <= a && a <= 1) && (0 <= b && b <= 1)) {
+        hit.ray_param = t;
+        hit.position = ray.origin + hit.ray_param * ray.direction;
+        hit.normal = plane.normal;
+        return true;
+    } else return false;
+}
+
+// -----------------------------------------------------------------------------
+
+// Triangle test with the plane of the facet, which the meshes used before
+// TriangleBlocksT. Only used by benchmark_intersection() to compare with the
+// watertight test.
+template <typename Scalar>
+bool intersect_triangle(const RayT<Scalar> &ray, const PlanarPatchT<Scalar> &triangle, IntersectionT<Scalar> &hit) {
+    // TODO (Assignment 3)
+    //
+    // Compute whether the ray intersects the given triangle.
+    // If you have done the parallelogram case, this should be very similar to it.
+    STATS_INC(TRIANGLE_TESTS);
+    Scalar t, a, b;
+    if (triangle.intersect(ray, t, a, b) && t > ray_epsilon<Scalar>() && a >= 0 && b >= 0 && a + b <= 1) {
+        hit.ray_param = t;
+        hit.position = ray.origin + hit.ray_param * ray.direction;
+        hit.normal = triangle.normal;
+        return true;
+    } else return false;
+}
+
+// Reference version of the triangle test, solving the 3x3 system for every ray.
+// Only used by benchmark_intersection() to measure the gain of PlanarPatch.
+bool intersect_triangle_qr(const Ray &ray, const Vector3d &a, const Vector3d &b, const Vector3d &c, Intersection &hit) {
+    Matrix3d A;
+    Vector3d u = b - a;
+    Vector3d v = c - a;
+    A << -u, -v, ray.direction;
+    Vector3d B(a - ray.origin);
+    Vector3d x = A.colPivHouseholderQr().solve(B);
+    if (x(2) > epsilon && x(0) >= 0 && x(1) >= 0 && (0 <= x(0) + x(1) && x(0) + x(1) <= 1)) {
+        hit.ray_param = x(2);
+        hit.position = ray.origin + hit.ray_param * ray.direction;
+        hit.normal = u.cross(v).normalized();
+        return true;
+    } else return false;
+}
+
+#if defined(__SSE2__)
+// SSE registers of 4 floats or 2 doubles, for the triangle tests
+template <typename Scalar>
+struct Lanes;
+
+template <>
+struct Lanes<float> {
+    typedef __m128 Type;
+    static const int width = 4;
+    static Type load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, Type a) { _mm_storeu_ps(p, a); }
+    static Type set1(float x) { return _mm_set1_ps(x); }
+    static Type add(Type a, Type b) { return _mm_add_ps(a, b); }
+    static Type sub(Type a, Type b) { return _mm_sub_ps(a, b); }
+    static Type mul(Type a, Type b) { return _mm_mul_ps(a, b); }
+    static Type div(Type a, Type b) { return _mm_div_ps(a, b); }
+    static Type less(Type a, Type b) { return _mm_cmplt_ps(a, b); }
+    static Type less_equal(Type a, Type b) { return _mm_cmple_ps(a, b); }
+    static Type equal(Type a, Type b) { return _mm_cmpeq_ps(a, b); }
+    static Type not_equal(Type a, Type b) { return _mm_cmpneq_ps(a, b); }
+    static Type both(Type a, Type b) { return _mm_and_ps(a, b); }
+    static int mask(Type a) { return _mm_movemask_ps(a); }
+    // Same sum as Vector3f::dot(), which Eigen does not vectorize
+    static Type dot(const Type x[3], Type y0, Type y1, Type y2) {
+        return add(mul(x[0], y0), add(mul(x[1], y1), mul(x[2], y2)));
+    }
+};
+
+template <>
+struct Lanes<double> {
+    typedef __m128d Type;
+    static const int width = 2;
+    static Type load(const double *p) { return _mm_loadu_pd(p); }
+    static void store(double *p, Type a) { _mm_storeu_pd(p, a); }
+    static Type set1(double x) { return _mm_set1_pd(x); }
+    static Type add(Type a, Type b) { return _mm_add_pd(a, b); }
+    static Type sub(Type a, Type b) { return _mm_sub_pd(a, b); }
+    static Type mul(Type a, Type b) { return _mm_mul_pd(a, b); }
+    static Type div(Type a, Type b) { return _mm_div_pd(a, b); }
+    static Type less(Type a, Type b) { return _mm_cmplt_pd(a, b); }
+    static Type less_equal(Type a, Type b) { return _mm_cmple_pd(a, b); }
+    static Type equal(Type a, Type b) { return _mm_cmpeq_pd(a, b); }
+    static Type not_equal(Type a, Type b) { return _mm_cmpneq_pd(a, b); }
+    static Type both(Type a, Type b) { return _mm_and_pd(a, b); }
+    static int mask(Type a) { return _mm_movemask_pd(a); }
+    // Same sum as Vector3d::dot(), which Eigen vectorizes over the first two components
+    static Type dot(const Type x[3], Type y0, Type y1, Type y2) {
+        return add(add(mul(x[0], y0), mul(x[1], y1)), mul(x[2], y2));
+    }
+};
+
+// Watertight test of the lanes 'group', with the vertices of the triangles relative
+// to the origins of the rays in their sheared spaces (before the scale 'sz' along
+// z). Returns the lanes hit between ray_epsilon() and 'far', with 'param' set.
+template <typename Scalar>
+int intersect_sheared(const typename Lanes<Scalar>::Type x[3], const typename Lanes<Scalar>::Type y[3],
+                      const typename Lanes<Scalar>::Type az[3], typename Lanes<Scalar>::Type sz,
+                      typename Lanes<Scalar>::Type far, int group, typename Lanes<Scalar>::Type &param) {
+    typedef Lanes<Scalar> L;
+    typedef typename L::Type V;
+    V zero = L::set1(0);
+    // Edge functions: signed areas of the origin with the 3 edges
+    V u = L::sub(L::mul(x[2], y[1]), L::mul(y[2], x[1]));
+    V v = L::sub(L::mul(x[0], y[2]), L::mul(y[0], x[2]));
+    V w = L::sub(L::mul(x[1], y[0]), L::mul(y[1], x[0]));
+    int on_edge = L::mask(L::equal(u, zero)) | L::mask(L::equal(v, zero)) | L::mask(L::equal(w, zero));
+    if (sizeof(Scalar) < sizeof(double) && (on_edge & group)) {
+        // A zero in float may be a rounding error: the edge functions of these
+        // lanes are computed again in double
+        Scalar xs[3][L::width], ys[3][L::width], us[L::width], vs[L::width], ws[L::width];
+        for (int k = 0; k < 3; ++k) {
+            L::store(xs[k], x[k]);
+            L::store(ys[k], y[k]);
+        }
+        L::store(us, u);
+        L::store(vs, v);
+        L::store(ws, w);
+        for (int l = 0; l < L::width; ++l) {
+            if (!(on_edge & group >> l & 1)) continue;
+            us[l] = Scalar(double(xs[2][l]) * ys[1][l] - double(ys[2][l]) * xs[1][l]);
+            vs[l] = Scalar(double(xs[0][l]) * ys[2][l] - double(ys[0][l]) * xs[2][l]);
+            ws[l] = Scalar(double(xs[1][l]) * ys[0][l] - double(ys[1][l]) * xs[0][l]);
+        }
+        u = L::load(us);
+        v = L::load(vs);
+        w = L::load(ws);
+    }
+    int negative = L::mask(L::less(u, zero)) | L::mask(L::less(v, zero)) | L::mask(L::less(w, zero));
+    int positive = L::mask(L::less(zero, u)) | L::mask(L::less(zero, v)) | L::mask(L::less(zero, w));
+    int inside = ~(negative & positive) & group;
+    if (!inside) return 0; // Most tests stop here, before the division
+    V det = L::add(L::add(u, v), w);
+    V dot = L::add(L::add(L::mul(u, az[0]), L::mul(v, az[1])), L::mul(w, az[2]));
+    param = L::div(L::mul(sz, dot), det);
+    return inside & L::mask(L::not_equal(det, zero)) &
+           L::mask(L::both(L::less(L::set1(ray_epsilon<Scalar>()), param), L::less(param, far)));
+}
+#endif
+
+template <typename Scalar>
+ShearedRayT<Scalar>::ShearedRayT(const RayT<Scalar> &ray) {
+    for (int a = 0; a < 3; ++a) origin[a] = ray.origin(a);
+    ray.direction.cwiseAbs().maxCoeff(&kz);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    // Keep the orientation of the triangles, so that the signs of their edges do not
+    // depend on the direction of the ray
+    if (ray.direction(kz) < 0) std::swap(kx, ky);
+    sx = ray.direction(kx) / ray.direction(kz);
+    sy = ray.direction(ky) / ray.direction(kz);
+    sz = 1 / ray.direction(kz);
+}
+
+template <typename Scalar>
+ShearedPacketT<Scalar>::ShearedPacketT(const RayPacketT<Scalar> &packet, uint64_t rays) {
+    int first = -1;
+    for (int k = 0; k < packet.size; ++k) {
+        if (!(rays >> k & 1)) continue;
+        ray[k] = ShearedRayT<Scalar>(packet.ray(k));
+        if (first == -1) first = k;
+        const ShearedRayT<Scalar> &r = ray[k];
+        shared = shared && r.kx == ray[first].kx && r.ky == ray[first].ky && r.kz == ray[first].kz;
+        origin[0][k] = r.origin[r.kx];
+        origin[1][k] = r.origin[r.ky];
+        origin[2][k] = r.origin[r.kz];
+        sx[k] = r.sx;
+        sy[k] = r.sy;
+        sz[k] = r.sz;
+    }
+}
+
+template <typename Scalar>
+void TriangleBlocksT<Scalar>::build(const MatrixXd &V, const MatrixXi &F, const AABBTree &bvh) {
+    // Number of triangles of the leaf starting at each facet, 0 inside a leaf
+    std::vector<int> leaf_size(F.rows(), 0);
+    for (const AABBTree::Node &node: bvh.nodes)
+        if (node.triangle != -1) leaf_size[node.triangle] = node.count;
+    slots.resize(F.rows());
+    int count = 0;
+    for (int i = 0; i < F.rows(); ++i) {
+        int lane = count % width;
+        if (lane > 0 && lane + leaf_size[i] > width)
+            count += width - lane; // The leaf starts a new block
+        slots[i] = count++;
+    }
+    blocks.assign((count + width - 1) / width, Block()); // The padding lanes are zeros
+    parallel_for(F.rows(), default_thread_count(), 4096, [&](int i) {
+        Block &block = blocks[slots[i] / width];
+        for (int k = 0; k < 3; ++k)
+            for (int a = 0; a < 3; ++a) block.vertex[k][a][slots[i] % width] = Scalar(V(F(i, k), a));
+    });
+}
+
+template <typename Scalar>
+int TriangleBlocksT<Scalar>::intersect_block(const ShearedRayT<Scalar> &ray, int b, int lanes, Scalar t_max,
+                                             Scalar t[width]) const {
+    STATS_ADD(TRIANGLE_TESTS, popcount64(lanes));
+    const Block &block = blocks[b];
+    const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    int mask = 0;
+#if defined(__SSE2__)
+    typedef Lanes<Scalar> L;
+    typedef typename L::Type V;
+    V far = L::set1(t_max);
+    V sx = L::set1(ray.sx), sy = L::set1(ray.sy), sz = L::set1(ray.sz);
+    V ox = L::set1(ray.origin[kx]), oy = L::set1(ray.origin[ky]), oz = L::set1(ray.origin[kz]);
+    for (int g = 0; g < width; g += L::width) {
+        int group = lanes >> g & ((1 << L::width) - 1);
+        if (!group) continue;
+        // Vertices relative to the origin, in the sheared space
+        V x[3], y[3], az[3];
+        for (int k = 0; k < 3; ++k) {
+            az[k] = L::sub(L::load(&block.vertex[k][kz][g]), oz);
+            x[k] = L::sub(L::sub(L::load(&block.vertex[k][kx][g]), ox), L::mul(sx, az[k]));
+            y[k] = L::sub(L::sub(L::load(&block.vertex[k][ky][g]), oy), L::mul(sy, az[k]));
+        }
+        V param;
+        int hit = intersect_sheared<Scalar>(x, y, az, sz, far, group, param);
+        if (!hit) continue;
+        L::store(t + g, param);
+        mask |= hit << g;
+    }
+#else
+    for (int l = 0; l < width; ++l) {
+        if (!(lanes >> l & 1)) continue;
+        Scalar x[3], y[3], z[3];
+        for (int k = 0; k < 3; ++k) {
+            Scalar az = block.vertex[k][kz][l] - ray.origin[kz];
+            x[k] = (block.vertex[k][kx][l] - ray.origin[kx]) - ray.sx * az;
+            y[k] = (block.vertex[k][ky][l] - ray.origin[ky]) - ray.sy * az;
+            z[k] = ray.sz * az;
+        }
+        Scalar u = x[2] * y[1] - y[2] * x[1];
+        Scalar v = x[0] * y[2] - y[0] * x[2];
+        Scalar w = x[1] * y[0] - y[1] * x[0];
+        if (sizeof(Scalar) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+            u = Scalar(double(x[2]) * y[1] - double(y[2]) * x[1]);
+            v = Scalar(double(x[0]) * y[2] - double(y[0]) * x[2]);
+            w = Scalar(double(x[1]) * y[0] - double(y[1]) * x[0]);
+        }
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) continue;
+        Scalar det = u + v + w;
+        if (det == 0) continue;
+        t[l] = (u * z[0] + v * z[1] + w * z[2]) / det;
+        if (ray_epsilon<Scalar>() < t[l] && t[l] < t_max) mask |= 1 << l;
+    }
+#endif
+    return mask;
+}
+
+template <typename Scalar>
+bool TriangleBlocksT<Scalar>::intersect_leaf(const ShearedRayT<Scalar> &ray, int first, int count, Scalar &t,
+                                             int &facet) const {
+    bool found = false;
+    for (int slot = slots[first], i = first; i < first + count;) {
+        // Lanes [lane, lane + n) of the block of 'slot'
+        int lane = slot % width, n = std::min(width - lane, first + count - i);
+        Scalar params[width];
+        int mask = intersect_block(ray, slot / width, ((1 << n) - 1) << lane, t, params);
+        // The first of the nearest lanes, as if the facets were tested in order
+        for (int l = lane; l < lane + n; ++l) {
+            if ((mask >> l & 1) && params[l] < t) {
+                t = params[l];
+                facet = i + l - lane;
+                found = true;
+            }
+        }
+        slot += n;
+        i += n;
+    }
+    return found;
+}
+
+template <typename Scalar>
+bool TriangleBlocksT<Scalar>::intersect_facet(const ShearedRayT<Scalar> &ray, int facet, Scalar &t) const {
+    Scalar params[width];
+    int lane = slots[facet] % width;
+    if (!intersect_block(ray, slots[facet] / width, 1 << lane, std::numeric_limits<Scalar>::infinity(), params))
+        return false;
+    t = params[lane];
+    return true;
+}
+
+template <typename Scalar>
+uint64_t TriangleBlocksT<Scalar>::intersect_packet(const ShearedPacketT<Scalar> &packet, uint64_t rays, int facet,
+                                                   const Scalar *t_max, Scalar *t) const {
+    const Block &block = blocks[slots[facet] / width];
+    int lane = slots[facet] % width;
+    int first = count_trailing_zeros64(rays);
+    const int axis[3] = {packet.ray[first].kx, packet.ray[first].ky, packet.ray[first].kz};
+    uint64_t mask = 0;
+#if defined(__SSE2__)
+    typedef Lanes<Scalar> L;
+    typedef typename L::Type V;
+    STATS_ADD(TRIANGLE_TESTS, popcount64(rays));
+    for (int g = first / L::width * L::width; g < ShearedPacketT<Scalar>::max_size && rays >> g; g += L::width) {
+        int group = rays >> g & ((1 << L::width) - 1);
+        if (!group) continue;
+        V sx = L::load(&packet.sx[g]), sy = L::load(&packet.sy[g]);
+        V x[3], y[3], az[3];
+        for (int k = 0; k < 3; ++k) {
+            az[k] = L::sub(L::set1(block.vertex[k][axis[2]][lane]), L::load(&packet.origin[2][g]));
+            x[k] = L::sub(L::sub(L::set1(block.vertex[k][axis[0]][lane]), L::load(&packet.origin[0][g])),
+                          L::mul(sx, az[k]));
+            y[k] = L::sub(L::sub(L::set1(block.vertex[k][axis[1]][lane]), L::load(&packet.origin[1][g])),
+                          L::mul(sy, az[k]));
+        }
+        V param;
+        int hit = intersect_sheared<Scalar>(x, y, az, L::load(&packet.sz[g]), L::load(&t_max[g]), group, param);
+        if (!hit) continue;
+        L::store(t + g, param);
+        mask |= uint64_t(hit) << g;
+    }
+#else
+    (void) axis;
+    for (int k = first; k < ShearedPacketT<Scalar>::max_size && rays >> k; ++k)
+        if ((rays >> k & 1) && intersect_facet(packet.ray[k], facet, t[k]) && t[k] < t_max[k]) mask |= uint64_t(1) << k;
+#endif
+    return mask;
+}
+
+template <typename Scalar>
+void TriangleBlocksT<Scalar>::set_hit(const RayT<Scalar> &ray, int facet, Scalar t, IntersectionT<Scalar> &hit) const {
+    const Block &block = blocks[slots[facet] / width];
+    int lane = slots[facet] % width;
+    Matrix<Scalar, 3, 1> v[3];
+    for (int k = 0; k < 3; ++k)
+        v[k] = Matrix<Scalar, 3, 1>(block.vertex[k][0][lane], block.vertex[k][1][lane], block.vertex[k][2][lane]);
+    hit.ray_param = t;
+    hit.position = ray.origin + t * ray.direction;
+    hit.normal = (v[1] - v[0]).cross(v[2] - v[0]).normalized();
+    hit.primitive = facet;
+}
+
+template <typename Scalar>
+bool intersect_box(const RayT<Scalar> &ray, const AlignedBox<Scalar, 3> &box, Scalar &t_entry) {
+    // TODO (Assignment 3)
+    //
+    // Compute whether the ray intersects the given box.
+    // There is no need to set the resulting normal and ray parameter, since
+    // we are not testing with the real surface here anyway. 't_entry' is set to the
+    // ray parameter where the ray enters the box, to sort and cull the nodes of a BVH.
+    STATS_INC(BOX_TESTS);
+    Scalar x_min = box.min()(0);
+    Scalar y_min = box.min()(1);
+    Scalar z_min = box.min()(2);
+    Scalar x_max = box.max()(0);
+    Scalar y_max = box.max()(1);
+    Scalar z_max = box.max()(2);
+    Scalar tx_max, tx_min, ty_max, ty_min, tz_max, tz_min, t_max, t_min;
+    Matrix<Scalar, 3, 1> e = ray.origin;
+    Matrix<Scalar, 3, 1> d = ray.direction;
+    if (d(0) > 0) {
+        tx_min = (x_min - e(0)) / d(0);
+        tx_max = (x_max - e(0)) / d(0);
+    } else if (d(0) < 0) {
+        tx_max = (x_min - e(0)) / d(0);
+        tx_min = (x_max - e(0)) / d(0);
+    } else {
+        // The ray is parallel to the slab, and is either always or never inside it
+        if (e(0) < x_min || e(0) > x_max) return false;
+        tx_min = -std::numeric_limits<Scalar>::infinity();
+        tx_max = std::numeric_limits<Scalar>::infinity();
+    }
+    if (d(1) > 0) {
+        ty_min = (y_min - e(1)) / d(1);
+        ty_max = (y_max - e(1)) / d(1);
+    } else if (d(1) < 0) {
+        ty_max = (y_min - e(1)) / d(1);
+        ty_min = (y_max - e(1)) / d(1);
+    } else {
+        // The ray is parallel to the slab, and is either always or never inside it
+        if (e(1) < y_min || e(1) > y_max) return false;
+        ty_min = -std::numeric_limits<Scalar>::infinity();
+        ty_max = std::numeric_limits<Scalar>::infinity();
+    }
+    if (d(2) > 0) {
+        tz_min = (z_min - e(2)) / d(2);
+        tz_max = (z_max - e(2)) / d(2);
+    } else if (d(2) < 0) {
+        tz_max = (z_min - e(2)) / d(2);
+        tz_min = (z_max - e(2)) / d(2);
+    } else {
+        // The ray is parallel to the slab, and is either always or never inside it
+        if (e(2) < z_min || e(2) > z_max) return false;
+        tz_min = -std::numeric_limits<Scalar>::infinity();
+        tz_max = std::numeric_limits<Scalar>::infinity();
+    }
+    t_max = std::min(tx_max, std::min(ty_max, tz_max));
+    t_min = std::max(tx_min, std::max(ty_min, tz_min));
+    t_entry = t_min;
+    return t_max >= t_min; // Inclusive, so that the flat boxes of axis-aligned facets are hit
+}
+
+template <typename Scalar>
+bool Mesh::intersect_impl(const RayT<Scalar> &ray, const AABBTreeT<Scalar> &tree,
+                          const TriangleBlocksT<Scalar> &triangles, IntersectionT<Scalar> &closest_hit) const {
+    // TODO (Assignment 3)
+
+    // Method (1): Traverse every triangle and return the closest hit.
+//    double ray_param = INFINITY;
+//    bool res = false;
 //    for (int i = 0; i < facets.rows(); i++) {
 //        Intersection hit;
-//        Vector3d a(vertices(facets(i, 0), 0), vertices(facets(i, 0), 1), vertices(facets(i, 0), 2));
-//        Vector3d b(vertices(facets(i, 1), 0), vertices(facets(i, 1), 1), vertices(facets(i, 1), 2));
-//        Vector3d c(vertices(facets(i, 2), 0), vertices(facets(i, 2), 1), vertices(facets(i, 2), 2));
-//        if (intersect_triangle(ray, a, b, c, hit)) {
+//        if (intersect_triangle(ray, planes[i], hit)) {
 //            res = true;
 //            if (hit.ray_param < ray_param) {
 //                ray_param = hit.ray_param;
@@ -415,35 +2093,698 @@ bool Mesh::intersect(const Ray &ray, Intersection &closest_hit) {
 
     // Method (2): Traverse the BVH tree and test the intersection with a
     // triangles at the leaf nodes that intersects the input ray.
+    // The nodes to visit are kept on a small stack with the ray parameter where the
+    // ray enters their box. The nearer child is visited first, and a node is
+    // skipped when the ray enters it beyond the closest hit found so far. Nothing
+    // is modified, so several threads can traverse the same tree.
+    typedef typename AABBTreeT<Scalar>::Node Node;
+    struct Entry {
+        int node;
+        Scalar t; // Entry point of the ray in the box of the node
+    };
+    Entry stack[bvh_max_depth + 2]; // The depth of the tree is at most bvh_max_depth
+    int size = 0;
+
+    Scalar t;
+    if (tree.nodes.empty() || !intersect_box(ray, tree.nodes[tree.root].bbox, t)) return false;
+    stack[size++] = {tree.root, t};
+    ShearedRayT<Scalar> sheared(ray);
+    Scalar t_closest = std::numeric_limits<Scalar>::infinity();
+    int facet = -1;
+    while (size > 0) {
+        Entry entry = stack[--size];
+        if (entry.t > t_closest) continue;
+        STATS_INC(BVH_NODES);
+
+        const Node &node = tree.nodes[entry.node];
+        if (node.triangle != -1) {
+            triangles.intersect_leaf(sheared, node.triangle, node.count, t_closest, facet);
+            continue;
+        }
+
+        Scalar t_left, t_right;
+        bool left = intersect_box(ray, tree.nodes[node.left].bbox, t_left) && !(t_left > t_closest);
+        bool right = intersect_box(ray, tree.nodes[node.right].bbox, t_right) && !(t_right > t_closest);
+        // Push the farther child first, so that the nearer one is popped first
+        if (left && right) {
+            if (t_left <= t_right) {
+                stack[size++] = {node.right, t_right};
+                stack[size++] = {node.left, t_left};
+            } else {
+                stack[size++] = {node.left, t_left};
+                stack[size++] = {node.right, t_right};
+            }
+        } else if (left) {
+            stack[size++] = {node.left, t_left};
+        } else if (right) {
+            stack[size++] = {node.right, t_right};
+        }
+    }
+    // The normal of the closest hit only
+    if (facet < 0) return false;
+    triangles.set_hit(ray, facet, t_closest, closest_hit);
+    return true;
+}
 
-    int triangle_index = this->bvh.nodes[this->bvh.root].triangle;
-    if (triangle_index != -1) {
-        Vector3d a = vertices.row(facets(triangle_index, 0));
-        Vector3d b = vertices.row(facets(triangle_index, 1));
-        Vector3d c = vertices.row(facets(triangle_index, 2));
-        if (intersect_triangle(ray, a, b, c, closest_hit))
-            return true;
-    } else if (intersect_box(ray, this->bvh.nodes[this->bvh.root].bbox)) {
-        Intersection hit1, hit2;
-        this->bvh.root = this->bvh.nodes[this->bvh.root].left;
-        bool flag1 = intersect(ray, hit1);
-        this->bvh.root = this->bvh.nodes[this->bvh.root].parent;
-        this->bvh.root = this->bvh.nodes[this->bvh.root].right;
-        bool flag2 = intersect(ray, hit2);
-        this->bvh.root = this->bvh.nodes[this->bvh.root].parent;
-        if (flag1 && flag2) {
-            closest_hit = hit1.ray_param < hit2.ray_param ? hit1 : hit2;
-            return true;
-        } else if (flag1) {
-            closest_hit = hit1;
-            return true;
-        } else if (flag2) {
-            closest_hit = hit2;
-            return true;
-        } else return false;
+// Slab test of a ray (origin 'o', inverse direction 'inv') against the boxes of
+// the children of a node. Returns the mask of the boxes that the ray crosses
+// between 0 and 't_max', and sets 't' to the distances where it enters them.
+int intersect_boxes(const WideBvh::Node &node, const float o[3], const float inv[3], float t_max, float t[4]) {
+    STATS_ADD(BOX_TESTS, WideBvh::width);
+#if defined(__SSE2__)
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x), _mm_set1_ps(o[0])), _mm_set1_ps(inv[0]));
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_x), _mm_set1_ps(o[0])), _mm_set1_ps(inv[0]));
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y), _mm_set1_ps(o[1])), _mm_set1_ps(inv[1]));
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_y), _mm_set1_ps(o[1])), _mm_set1_ps(inv[1]));
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z), _mm_set1_ps(o[2])), _mm_set1_ps(inv[2]));
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_z), _mm_set1_ps(o[2])), _mm_set1_ps(inv[2]));
+    __m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                               _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+    __m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                              _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+    _mm_storeu_ps(t, t_near);
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+    int mask = 0;
+    for (int k = 0; k < WideBvh::width; ++k) {
+        float tx0 = (node.min_x[k] - o[0]) * inv[0], tx1 = (node.max_x[k] - o[0]) * inv[0];
+        float ty0 = (node.min_y[k] - o[1]) * inv[1], ty1 = (node.max_y[k] - o[1]) * inv[1];
+        float tz0 = (node.min_z[k] - o[2]) * inv[2], tz1 = (node.max_z[k] - o[2]) * inv[2];
+        t[k] = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+        float t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), t_max));
+        if (t[k] <= t_far) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
 
+// Same test with the boxes of a compressed node. The bounds are never decoded:
+// along axis a, origin + q * step is reached at t = q * step * inv + (origin - o) * inv.
+int intersect_boxes(const CompressedBvh::Node &node, const float o[3], const float inv[3], float t_max, float t[4]) {
+    STATS_ADD(BOX_TESTS, CompressedBvh::width);
+    float scale[3], offset[3];
+    for (int a = 0; a < 3; ++a) {
+        scale[a] = power_of_two(node.exponent[a]) * inv[a];
+        offset[a] = (node.origin[a] - o[a]) * inv[a];
     }
-    return false;
+#if defined(__SSE2__)
+    // q_min and the first row of q_max in one load, the two other rows of q_max in another
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(node.q_min));
+    __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.q_max[1]));
+    __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero), b_lo = _mm_unpacklo_epi8(b, zero);
+    __m128 q[6] = {_mm_cvtepi32_ps(_mm_unpacklo_epi16(a_lo, zero)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(a_lo, zero)),
+                   _mm_cvtepi32_ps(_mm_unpacklo_epi16(a_hi, zero)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(a_hi, zero)),
+                   _mm_cvtepi32_ps(_mm_unpacklo_epi16(b_lo, zero)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(b_lo, zero))};
+    __m128 t_near = _mm_setzero_ps(), t_far = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; ++a) {
+        __m128 t0 = _mm_add_ps(_mm_mul_ps(q[a], _mm_set1_ps(scale[a])), _mm_set1_ps(offset[a]));
+        __m128 t1 = _mm_add_ps(_mm_mul_ps(q[a + 3], _mm_set1_ps(scale[a])), _mm_set1_ps(offset[a]));
+        t_near = _mm_max_ps(t_near, _mm_min_ps(t0, t1));
+        t_far = _mm_min_ps(t_far, _mm_max_ps(t0, t1));
+    }
+    _mm_storeu_ps(t, t_near);
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & node.valid;
+#else
+    int mask = 0;
+    for (int k = 0; k < CompressedBvh::width; ++k) {
+        float t_far = t_max;
+        t[k] = 0;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = node.q_min[a][k] * scale[a] + offset[a];
+            float t1 = node.q_max[a][k] * scale[a] + offset[a];
+            t[k] = std::max(t[k], std::min(t0, t1));
+            t_far = std::min(t_far, std::max(t0, t1));
+        }
+        if (t[k] <= t_far) mask |= 1 << k;
+    }
+    return mask & node.valid;
+#endif
+}
+
+template <typename Tree, typename Scalar>
+bool Mesh::intersect_wide(const Tree &tree, const RayT<Scalar> &ray, const TriangleBlocksT<Scalar> &triangles,
+                          IntersectionT<Scalar> &closest_hit) const {
+    if (tree.nodes.empty()) return false;
+
+    // The boxes are tested in float. A zero component of the direction is replaced
+    // by a tiny one, so that the slab test never computes 0 * infinity.
+    float o[3], inv[3];
+    for (int k = 0; k < 3; ++k) {
+        o[k] = float(ray.origin(k));
+        float d = float(ray.direction(k));
+        inv[k] = 1.0f / (d != 0 ? d : 1e-30f);
+    }
+
+    // Same traversal as intersect_impl(), with up to 'width' children pushed at once
+    // (nearest last). An entry is an inner node, or the triangles of a leaf.
+    struct Entry {
+        int child;
+        int count;
+        float t;
+    };
+    Entry stack[(Tree::width - 1) * bvh_max_depth + 2];
+    int size = 0;
+    stack[size++] = {0, 0, 0.0f};
+    float t_max = std::numeric_limits<float>::max(); // The empty lanes are at +infinity
+    ShearedRayT<Scalar> sheared(ray);
+    Scalar t_closest = std::numeric_limits<Scalar>::infinity();
+    int facet = -1;
+    while (size > 0) {
+        Entry entry = stack[--size];
+        if (entry.t > t_max) continue;
+
+        if (entry.count > 0) {
+            if (triangles.intersect_leaf(sheared, entry.child, entry.count, t_closest, facet))
+                t_max = float(t_closest);
+            continue;
+        }
+
+        STATS_INC(BVH_NODES);
+        const typename Tree::Node &node = tree.nodes[entry.child];
+        float t[Tree::width];
+        int mask = intersect_boxes(node, o, inv, t_max, t);
+
+        // Sort the children hit by decreasing distance
+        int order[Tree::width];
+        int n = 0;
+        for (int k = 0; k < Tree::width; ++k) {
+            if (!(mask & (1 << k))) continue;
+            int m = n++;
+            for (; m > 0 && t[order[m - 1]] < t[k]; --m) order[m] = order[m - 1];
+            order[m] = k;
+        }
+        for (int m = 0; m < n; ++m)
+            stack[size++] = {node.child[order[m]], node.count[order[m]], t[order[m]]};
+    }
+    if (facet < 0) return false;
+    triangles.set_hit(ray, facet, t_closest, closest_hit);
+    return true;
+}
+
+template <typename Scalar>
+bool MeshInstance::intersect_impl(const RayT<Scalar> &ray, IntersectionT<Scalar> &hit) const {
+    if (identity) return mesh->intersect(ray, hit);
+    if (!mesh->intersect(ray_to_mesh(ray), hit)) return false;
+    hit_to_scene(hit);
+    return true;
+}
+
+template <typename Scalar>
+bool MeshInstance::intersect_facet(const RayT<Scalar> &ray, int primitive, IntersectionT<Scalar> &hit) const {
+    const TriangleBlocksT<Scalar> &triangles = mesh->facet_triangles<Scalar>();
+    RayT<Scalar> local = identity ? ray : ray_to_mesh(ray);
+    Scalar t;
+    if (!triangles.intersect_facet(ShearedRayT<Scalar>(local), primitive, t)) return false;
+    triangles.set_hit(local, primitive, t, hit);
+    if (!identity) hit_to_scene(hit);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+
+template <>
+const AABBTree &Scene::object_tree<double>() const { return object_bvh; }
+
+template <>
+const AABBTreeT<float> &Scene::object_tree<float>() const { return object_bvh_float; }
+
+// Box of an object in the tree over the objects. The boxes are padded, for the flat
+// ones (such as a parallelogram in an axis plane) to be hit by the slab test.
+AlignedBox3d object_bvh_box(const Object &object) {
+    AlignedBox3d box = object.bbox();
+    if (!box.isEmpty()) {
+        Vector3d padding = Vector3d::Constant(1e-9 * (1 + box.diagonal().norm()));
+        box = AlignedBox3d(box.min() - padding, box.max() + padding);
+    }
+    return box;
+}
+
+// Build the tree over the objects of the scene, and sort the objects in the order
+// of its leaves. An object costs much more than a triangle, so each one gets its
+// own leaf.
+void build_object_bvh(Scene &scene) {
+    std::vector<AlignedBox3d> boxes;
+    for (const ObjectPtr &object: scene.objects)
+        boxes.push_back(object_bvh_box(*object));
+    std::vector<int> order;
+    scene.object_bvh = build_sah_bvh(boxes, 1, default_thread_count(), order);
+    std::vector<ObjectPtr> objects;
+    for (int i: order) objects.push_back(scene.objects[i]);
+    scene.objects = objects;
+    scene.object_bvh_float = scene.object_bvh.cast<float>();
+}
+
+// Recompute the boxes of the subtree 'index' of the tree over the objects
+void refit_object_node(Scene &scene, int index) {
+    AABBTree::Node &node = scene.object_bvh.nodes[index];
+    if (node.triangle != -1) {
+        node.bbox = object_bvh_box(*scene.objects[node.triangle]);
+        return;
+    }
+    refit_object_node(scene, node.left);
+    refit_object_node(scene, node.right);
+    const std::vector<AABBTree::Node> &nodes = scene.object_bvh.nodes;
+    node.bbox = nodes[node.left].bbox.merged(nodes[node.right].bbox);
+}
+
+// Refit the tree over the objects to their current boxes, after Mesh::set_vertices()
+// moved the vertices of a mesh of the scene, keeping the order of the objects
+void refit_object_bvh(Scene &scene) {
+    if (scene.object_bvh.nodes.empty()) return;
+    refit_object_node(scene, scene.object_bvh.root);
+    scene.object_bvh_float = scene.object_bvh.cast<float>();
+}
+
+// Call visit(object) for the objects whose box the ray enters before 'max_param',
+// the nearer boxes first, until visit() returns false. visit() may lower
+// 'max_param', to skip the objects behind a hit.
+template <typename Scalar, typename F>
+void traverse_objects(const Scene &scene, const RayT<Scalar> &ray, const Scalar &max_param, const F &visit) {
+    const AABBTreeT<Scalar> &tree = scene.object_tree<Scalar>();
+    typedef typename AABBTreeT<Scalar>::Node Node;
+    struct Entry {
+        int node;
+        Scalar t;
+    };
+    Entry stack[bvh_max_depth + 2];
+    int size = 0;
+
+    Scalar t;
+    if (tree.nodes.empty() || !intersect_box(ray, tree.nodes[tree.root].bbox, t)) return;
+    stack[size++] = {tree.root, t};
+    while (size > 0) {
+        Entry entry = stack[--size];
+        if (entry.t > max_param) continue;
+        const Node &node = tree.nodes[entry.node];
+        if (node.triangle != -1) {
+            for (int i = node.triangle; i < node.triangle + node.count; ++i)
+                if (!visit(scene.objects[i].get())) return;
+            continue;
+        }
+        Scalar t_left, t_right;
+        bool left = intersect_box(ray, tree.nodes[node.left].bbox, t_left) && t_left <= max_param;
+        bool right = intersect_box(ray, tree.nodes[node.right].bbox, t_right) && t_right <= max_param;
+        if (left && right) {
+            if (t_left <= t_right) {
+                stack[size++] = {node.right, t_right};
+                stack[size++] = {node.left, t_left};
+            } else {
+                stack[size++] = {node.left, t_left};
+                stack[size++] = {node.right, t_right};
+            }
+        } else if (left) {
+            stack[size++] = {node.left, t_left};
+        } else if (right) {
+            stack[size++] = {node.right, t_right};
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename Scalar>
+RayT<Scalar> RayPacketT<Scalar>::ray(int k) const {
+    typedef Matrix<Scalar, 3, 1> Vector3;
+    return RayT<Scalar>(Vector3(origin[0][k], origin[1][k], origin[2][k]),
+                        Vector3(direction[0][k], direction[1][k], direction[2][k]));
+}
+
+template <typename Scalar>
+void RayPacketT<Scalar>::set_ray(int k, const RayT<Scalar> &ray) {
+    for (int a = 0; a < 3; ++a) {
+        origin[a][k] = ray.origin(a);
+        direction[a][k] = ray.direction(a);
+    }
+}
+
+template <typename Scalar>
+void RayPacketT<Scalar>::prepare(uint64_t rays) {
+    const float infinity = std::numeric_limits<float>::infinity();
+    prepared = rays;
+    coherent = true;
+    for (int a = 0; a < 3; ++a) {
+        origin_min[a] = inverse_min[a] = infinity;
+        origin_max[a] = inverse_max[a] = -infinity;
+        direction_sum[a] = 0;
+        for (int k = 0; k < size; ++k) {
+            if (!(rays >> k & 1)) continue;
+            float o = float(origin[a][k]);
+            float d = float(direction[a][k]);
+            float inv = 1.0f / (d != 0 ? d : 1e-30f);
+            box_origin[a][k] = o;
+            box_inverse[a][k] = inv;
+            origin_min[a] = std::min(origin_min[a], o);
+            origin_max[a] = std::max(origin_max[a], o);
+            inverse_min[a] = std::min(inverse_min[a], inv);
+            inverse_max[a] = std::max(inverse_max[a], inv);
+            direction_sum[a] += d;
+        }
+        coherent = coherent && (inverse_min[a] > 0 || inverse_max[a] < 0);
+    }
+    update_bound();
+}
+
+template <typename Scalar>
+void RayPacketT<Scalar>::update_bound() {
+    t_bound = 0;
+    for (int k = 0; k < size; ++k)
+        if (prepared >> k & 1) t_bound = std::max(t_bound, t_max[k]);
+}
+
+template <typename Scalar>
+bool RayPacketT<Scalar>::intersect_box(int k, const AlignedBox3f &box, float &t_entry) const {
+    STATS_INC(BOX_TESTS);
+    float t_near = 0, t_far = t_max[k];
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (box.min()(a) - box_origin[a][k]) * box_inverse[a][k];
+        float t1 = (box.max()(a) - box_origin[a][k]) * box_inverse[a][k];
+        t_near = std::max(t_near, std::min(t0, t1));
+        t_far = std::min(t_far, std::max(t0, t1));
+    }
+    t_entry = t_near;
+    return t_near <= t_far;
+}
+
+template <typename Scalar>
+uint64_t RayPacketT<Scalar>::intersect_box(const AlignedBox3f &box, uint64_t rays) const {
+    uint64_t result = 0;
+    // Groups of 4 rays, skipping the ones without a ray of 'rays'
+    for (int g = 0; g < size; g += 4) {
+        int lanes = int(rays >> g) & 15;
+        if (!lanes) continue;
+        STATS_ADD(BOX_TESTS, 4);
+#if defined(__SSE2__)
+        __m128 t_near = _mm_setzero_ps(), t_far = _mm_loadu_ps(&t_max[g]);
+        for (int a = 0; a < 3; ++a) {
+            __m128 o = _mm_loadu_ps(&box_origin[a][g]), inv = _mm_loadu_ps(&box_inverse[a][g]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min()(a)), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max()(a)), o), inv);
+            t_near = _mm_max_ps(t_near, _mm_min_ps(t0, t1));
+            t_far = _mm_min_ps(t_far, _mm_max_ps(t0, t1));
+        }
+        result |= uint64_t(_mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & lanes) << g;
+#else
+        for (int m = 0; m < 4; ++m) {
+            float t_entry;
+            if ((lanes >> m & 1) && intersect_box(g + m, box, t_entry)) result |= uint64_t(1) << (g + m);
+        }
+#endif
+    }
+    return result;
+}
+
+template <typename Scalar>
+bool RayPacketT<Scalar>::misses(const AlignedBox3f &box) const {
+    if (!coherent) return false;
+    // Along each axis, all the rays enter the slab by the same plane. The distance
+    // (plane - o) * inv is bilinear in the origin and the inverse direction, so its
+    // bounds over the packet are at the corners of their ranges. The rounding of
+    // the float operations is monotonic, and keeps them bounds of the slab tests
+    // of intersect_box().
+    float t_near = 0, t_far = t_bound;
+    for (int a = 0; a < 3; ++a) {
+        bool positive = inverse_min[a] > 0;
+        float near = positive ? box.min()(a) : box.max()(a);
+        float far = positive ? box.max()(a) : box.min()(a);
+        float n0 = near - origin_max[a], n1 = near - origin_min[a];
+        float f0 = far - origin_max[a], f1 = far - origin_min[a];
+        t_near = std::max(t_near, std::min(std::min(n0 * inverse_min[a], n0 * inverse_max[a]),
+                                           std::min(n1 * inverse_min[a], n1 * inverse_max[a])));
+        t_far = std::min(t_far, std::max(std::max(f0 * inverse_min[a], f0 * inverse_max[a]),
+                                         std::max(f1 * inverse_min[a], f1 * inverse_max[a])));
+    }
+    return t_near > t_far;
+}
+
+template <typename Scalar>
+void RayPacketT<Scalar>::finish() {
+    for (int k = 0; k < size; ++k) {
+        if (!object[k] || facet[k] < 0) continue;
+        // Only the mesh instances record a facet, see MeshInstance::intersect_packet_impl()
+        static_cast<const MeshInstance *>(object[k])->intersect_facet(ray(k), facet[k], hit[k]);
+        hit[k].primitive = facet[k];
+    }
+}
+
+// Same test as find_nearest_object() for each ray
+template <typename Scalar>
+void intersect_rays(const Object &object, RayPacketT<Scalar> &packet, uint64_t rays) {
+    for (int k = 0; k < packet.size; ++k) {
+        if (!(rays >> k & 1)) continue;
+        IntersectionT<Scalar> hit;
+        if (object.intersect(packet.ray(k), hit) && hit.ray_param < packet.t[k]) {
+            packet.set_hit(k, hit.ray_param, &object, -1);
+            packet.hit[k] = hit;
+        }
+    }
+}
+
+void Object::intersect_packet(RayPacketT<double> &packet, uint64_t rays) const { intersect_rays(*this, packet, rays); }
+
+void Object::intersect_packet(RayPacketT<float> &packet, uint64_t rays) const { intersect_rays(*this, packet, rays); }
+
+
+// Traversal of the subtree of 'start' by the ray k of a packet alone, calling
+// leaf(node, rays) as traverse_packet() with the ray k only
+template <typename Scalar, typename F>
+void traverse_packet_ray(const AABBTreeT<float> &tree, RayPacketT<Scalar> &packet, int k, int start, const F &leaf) {
+    typedef AABBTreeT<float>::Node Node;
+    struct Entry {
+        int node;
+        float t;
+    };
+    Entry stack[bvh_max_depth + 2];
+    int size = 0;
+    stack[size++] = {start, 0.0f};
+    while (size > 0) {
+        Entry entry = stack[--size];
+        if (entry.t > packet.t_max[k]) continue;
+        STATS_INC(BVH_NODES);
+        const Node &node = tree.nodes[entry.node];
+        if (node.triangle != -1) {
+            leaf(node, uint64_t(1) << k);
+            continue;
+        }
+        float t_left, t_right;
+        bool left = packet.intersect_box(k, tree.nodes[node.left].bbox, t_left);
+        bool right = packet.intersect_box(k, tree.nodes[node.right].bbox, t_right);
+        if (left && right) {
+            if (t_left <= t_right) {
+                stack[size++] = {node.right, t_right};
+                stack[size++] = {node.left, t_left};
+            } else {
+                stack[size++] = {node.left, t_left};
+                stack[size++] = {node.right, t_right};
+            }
+        } else if (left) {
+            stack[size++] = {node.left, t_left};
+        } else if (right) {
+            stack[size++] = {node.right, t_right};
+        }
+    }
+}
+
+// Call leaf(node, rays) for the leaves of 'tree' with the subset of 'rays' of the
+// packet that enter them before their closest hits. A node is first culled for the
+// whole packet by RayPacketT::misses(), then the rays that entered its parent are
+// tested against its box 4 at a time. Once at most packet_min_rays rays are left,
+// they traverse the rest of the subtree one at a time. The children are visited
+// nearer first along the mean direction of the packet.
+template <typename Scalar, typename F>
+void traverse_packet(const AABBTreeT<float> &tree, RayPacketT<Scalar> &packet, uint64_t rays, const F &leaf) {
+    typedef AABBTreeT<float>::Node Node;
+    struct Entry {
+        int node;
+        uint64_t rays; // Rays that entered the parent
+    };
+    Entry stack[bvh_max_depth + 2];
+    int size = 0;
+
+    if (tree.nodes.empty()) return;
+    stack[size++] = {tree.root, rays};
+    while (size > 0) {
+        Entry entry = stack[--size];
+        const Node &node = tree.nodes[entry.node];
+        if (packet.misses(node.bbox)) continue;
+        uint64_t active = packet.intersect_box(node.bbox, entry.rays);
+        if (!active) continue;
+
+        if (popcount64(active) <= packet_min_rays) {
+            for (int k = 0; k < packet.size; ++k)
+                if (active >> k & 1) traverse_packet_ray(tree, packet, k, entry.node, leaf);
+            packet.update_bound();
+            continue;
+        }
+        STATS_INC(BVH_NODES);
+
+        if (node.triangle != -1) {
+            leaf(node, active);
+            packet.update_bound();
+            continue;
+        }
+
+        // Push the farther child first, so that the nearer one is popped first
+        Vector3f offset = tree.nodes[node.right].bbox.center() - tree.nodes[node.left].bbox.center();
+        int axis;
+        offset.cwiseAbs().maxCoeff(&axis);
+        if (offset(axis) * packet.direction_sum[axis] >= 0) {
+            stack[size++] = {node.right, active};
+            stack[size++] = {node.left, active};
+        } else {
+            stack[size++] = {node.left, active};
+            stack[size++] = {node.right, active};
+        }
+    }
+}
+
+template <typename Scalar>
+void Mesh::intersect_packet_facets(RayPacketT<Scalar> &packet, uint64_t rays, const Object *instance) const {
+    // The facets of a leaf are tested against several rays at once if the rays share
+    // their axes, else each ray is tested against the blocks of the leaf as in
+    // intersect_impl()
+    const TriangleBlocksT<Scalar> &triangles = facet_triangles<Scalar>();
+    ShearedPacketT<Scalar> sheared(packet, rays);
+    traverse_packet(bvh_float, packet, rays, [&](const AABBTreeT<float>::Node &leaf, uint64_t active) {
+        if (sheared.shared && popcount64(active) > 1) {
+            for (int i = leaf.triangle; i < leaf.triangle + leaf.count; ++i) {
+                Scalar params[RayPacketT<Scalar>::max_size];
+                uint64_t hits = triangles.intersect_packet(sheared, active, i, packet.t, params);
+                for (; hits; hits &= hits - 1) {
+                    int k = count_trailing_zeros64(hits);
+                    packet.set_hit(k, params[k], instance, i);
+                }
+            }
+            return;
+        }
+        for (int k = 0; k < packet.size; ++k) {
+            if (!(active >> k & 1)) continue;
+            Scalar t = packet.t[k];
+            int facet;
+            if (triangles.intersect_leaf(sheared.ray[k], leaf.triangle, leaf.count, t, facet))
+                packet.set_hit(k, t, instance, facet);
+        }
+    });
+}
+
+template <typename Scalar>
+void MeshInstance::intersect_packet_impl(RayPacketT<Scalar> &packet, uint64_t rays) const {
+    // A few rays (left by the traversal of the tree over the objects) are traced
+    // one at a time
+    if (popcount64(rays) <= packet_min_rays) {
+        intersect_rays(*this, packet, rays);
+        return;
+    }
+    if (identity) {
+        mesh->intersect_packet_facets(packet, rays, this);
+        return;
+    }
+    // The rays are moved to the space of the mesh in a copy of the packet. They keep
+    // their ray parameters, and so their closest hits.
+    RayPacketT<Scalar> local = packet;
+    for (int k = 0; k < packet.size; ++k)
+        if (rays >> k & 1) local.set_ray(k, ray_to_mesh(packet.ray(k)));
+    local.prepare(rays);
+    mesh->intersect_packet_facets(local, rays, this);
+    for (int k = 0; k < packet.size; ++k)
+        if ((rays >> k & 1) && local.t[k] < packet.t[k]) packet.set_hit(k, local.t[k], this, local.facet[k]);
+}
+
+// Closest hits of the rays of a packet, the same as with find_nearest_object() for
+// each ray, traversing the tree over the objects and the trees of the meshes with
+// the whole packet
+template <typename Scalar>
+void find_nearest_objects(const Scene &scene, RayPacketT<Scalar> &packet) {
+    if (packet.size == 0) return;
+    uint64_t rays = packet.size == 64 ? ~uint64_t(0) : (uint64_t(1) << packet.size) - 1;
+    packet.prepare(rays);
+    traverse_packet(scene.object_bvh_float, packet, rays, [&](const AABBTreeT<float>::Node &leaf, uint64_t active) {
+        for (int i = leaf.triangle; i < leaf.triangle + leaf.count; ++i)
+            scene.objects[i]->intersect_packet(packet, active);
+    });
+    packet.finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Light sampling
+////////////////////////////////////////////////////////////////////////////////
+
+LightTree::LightTree(const std::vector<Light> &lights) {
+    if (lights.empty()) return;
+    std::vector<int> indices(lights.size());
+    for (int i = 0; i < int(lights.size()); ++i) indices[i] = i;
+    root = build(lights, indices, 0, lights.size());
+}
+
+// Top-down construction: split the lights at the median of the longest axis of
+// their bounding box
+int LightTree::build(const std::vector<Light> &lights, std::vector<int> &indices, int begin, int end) {
+    Node node;
+    node.bbox = AlignedBox3d();
+    node.power = 0;
+    for (int i = begin; i < end; ++i) {
+        node.bbox.extend(lights[indices[i]].position);
+        node.power += lights[indices[i]].intensity.sum() / 3;
+    }
+
+    if (end - begin == 1) {
+        node.left = node.right = -1;
+        node.light = indices[begin];
+    } else {
+        int dim;
+        node.bbox.sizes().maxCoeff(&dim);
+        int mid = (begin + end) / 2;
+        std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+                         [&](int a, int b) { return lights[a].position(dim) < lights[b].position(dim); });
+        node.left = build(lights, indices, begin, mid);
+        node.right = build(lights, indices, mid, end);
+        node.light = -1;
+    }
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+double LightTree::importance(const Node &node, const Vector3d &p, const Vector3d &n) const {
+    // Power over the squared distance to the center of the box, the distance is
+    // clamped to the size of the box so that a close cluster is not over-weighted
+    Vector3d D = node.bbox.center() - p;
+    double d2 = D.squaredNorm();
+    double r2 = node.bbox.sizes().squaredNorm() / 4;
+    double importance = node.power / std::max(std::max(d2, r2), 1e-8);
+
+    // Upper bound of the cosine between the normal and the directions to the box,
+    // using the cone of half-angle asin(r / d) around the center of the box. The
+    // bound is kept above a small floor: lights behind the surface still have a
+    // specular contribution, and must keep a non-zero probability.
+    if (r2 < d2) {
+        double cos_n = n.dot(D) / sqrt(d2);
+        double theta = acos(std::max(-1.0, std::min(1.0, cos_n))) - asin(sqrt(r2 / d2));
+        importance *= std::max(theta > 0 ? cos(std::min(theta, M_PI / 2)) : 1.0, 0.02);
+    }
+    return importance;
+}
+
+int LightTree::sample(const Vector3d &p, const Vector3d &n, double u, double &pdf) const {
+    int index = root;
+    pdf = 1;
+    while (nodes[index].light < 0) {
+        const Node &node = nodes[index];
+        double wl = importance(nodes[node.left], p, n);
+        double wr = importance(nodes[node.right], p, n);
+        double pl = wl + wr > 0 ? wl / (wl + wr) : 0.5;
+        // Go down one child, and rescale 'u' to reuse it at the next level
+        if (u < pl) {
+            u = u / pl;
+            pdf *= pl;
+            index = node.left;
+        } else {
+            u = (u - pl) / (1 - pl);
+            pdf *= 1 - pl;
+            index = node.right;
+        }
+        u = std::min(u, 1.0 - 1e-12);
+    }
+    return nodes[index].light;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -451,44 +2792,127 @@ bool Mesh::intersect(const Ray &ray, Intersection &closest_hit) {
 ////////////////////////////////////////////////////////////////////////////////
 
 // Function declaration here (could be put in a header file)
-Vector3d ray_color(const Scene &scene, const Ray &ray, const Object &object, const Intersection &hit, int max_bounce);
+// The rays are traced in 'Scalar' (float or double), the colors are computed in
+// double.
+template <typename Scalar>
+Vector3d ray_color(const Scene &scene, const RayT<Scalar> &ray, const Object &object, const IntersectionT<Scalar> &hit,
+                   int max_bounce, SampleStream &rng);
+
+template <typename Scalar>
+Object *find_nearest_object(const Scene &scene, const RayT<Scalar> &ray, IntersectionT<Scalar> &closest_hit);
 
-Object *find_nearest_object(const Scene &scene, const Ray &ray, Intersection &closest_hit);
+template <typename Scalar>
+bool is_light_visible(const Scene &scene, const RayT<Scalar> &ray, const Light &light);
 
-bool is_light_visible(const Scene &scene, const Ray &ray, const Light &light);
+// Object and distance of the first hit of a camera ray, used to find the edges of
+// the image (see refine_edges())
+struct PrimaryHit {
+    const Object *object = nullptr; // Null for the background
+    double depth = std::numeric_limits<double>::infinity();
+};
 
-Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce);
+template <typename Scalar>
+Vector3d shoot_ray(const Scene &scene, const RayT<Scalar> &ray, int max_bounce, SampleStream &rng,
+                   PrimaryHit *primary = nullptr);
 
 // -----------------------------------------------------------------------------
 
-Vector3d ray_color(const Scene &scene, const Ray &ray, const Object &obj, const Intersection &hit, int max_bounce) {
-    // Material for hit object
-    const Material &mat = obj.material;
+// Shadow ray from the intersection 'hit' towards 'light', of parameter 1 at the light
+template <typename Scalar>
+RayT<Scalar> shadow_ray(const IntersectionT<Scalar> &hit, const Light &light) {
+    return RayT<Scalar>(hit.position, (light.position - hit.position.template cast<double>()).template cast<Scalar>());
+}
 
-    // Ambient light contribution
-    Vector3d ambient_color = obj.material.ambient_color.array() * scene.ambient_light.array();
+// Mirror reflection of 'ray' at the intersection 'hit'
+template <typename Scalar>
+RayT<Scalar> reflected_ray(const RayT<Scalar> &ray, const IntersectionT<Scalar> &hit) {
+    Matrix<Scalar, 3, 1> D = hit.position - ray.origin;
+    Matrix<Scalar, 3, 1> N = hit.normal;
+    Matrix<Scalar, 3, 1> R = D - 2 * N.dot(D) * N;
+    return RayT<Scalar>(hit.position, R);
+}
 
-    // Punctual lights contribution (direct lighting)
-    Vector3d lights_color(0, 0, 0);
-    for (const Light &light: scene.lights) {
-        Vector3d Li = (light.position - hit.position).normalized();
-        Vector3d N = hit.normal;
+// Direct lighting of one punctual light at the intersection 'hit', as if nothing
+// was between them
+template <typename Scalar>
+Vector3d unshadowed_light_color(const RayT<Scalar> &ray, const Material &mat, const IntersectionT<Scalar> &hit,
+                                const Light &light) {
+    Vector3d position = hit.position.template cast<double>();
+    Vector3d Li = (light.position - position).normalized();
+    Vector3d N = hit.normal.template cast<double>();
+
+    // Diffuse contribution
+    Vector3d diffuse = mat.diffuse_color * std::max(Li.dot(N), 0.0);
+
+    // TODO (Assignment 2, specular contribution)
+    Vector3d H = ((ray.origin.template cast<double>() - position).normalized() + Li).normalized();
+    Vector3d specular = mat.specular_color * pow(std::max(H.dot(N), 0.0), mat.specular_exponent);
 
-        // TODO (Assignment 2, shadow rays)
+    // Attenuate lights according to the squared distance to the lights
+    Vector3d D = light.position - position;
+    return (diffuse + specular).cwiseProduct(light.intensity) / D.squaredNorm();
+}
 
-        // Diffuse contribution
-        Vector3d diffuse = mat.diffuse_color * std::max(Li.dot(N), 0.0);
+// Direct lighting of one punctual light at the intersection 'hit'
+template <typename Scalar>
+Vector3d light_color(const Scene &scene, const RayT<Scalar> &ray, const Material &mat, const IntersectionT<Scalar> &hit,
+                     const Light &light) {
+    // TODO (Assignment 2, shadow rays)
+    if (!is_light_visible(scene, shadow_ray(hit, light), light)) return Vector3d(0, 0, 0);
+    return unshadowed_light_color(ray, mat, hit, light);
+}
 
-        // TODO (Assignment 2, specular contribution)
-        Vector3d specular(0, 0, 0);
+// Number of lights whose direct lighting is computed at each intersection
+int lights_per_hit(const Scene &scene) {
+    int n = scene.light_samples;
+    return n <= 0 || n >= int(scene.lights.size()) ? int(scene.lights.size()) : n;
+}
 
-        // Attenuate lights according to the squared distance to the lights
-        Vector3d D = light.position - hit.position;
-        lights_color += (diffuse + specular).cwiseProduct(light.intensity) / D.squaredNorm();
+// Call f(light, weight) for the lights_per_hit() lights of the intersection 'hit',
+// whose direct lighting is divided by 'weight' in the sum of the punctual lights
+template <typename Scalar, typename F>
+void for_each_light_sample(const Scene &scene, const IntersectionT<Scalar> &hit, SampleStream &rng, const F &f) {
+    int n = scene.light_samples;
+    if (n <= 0 || n >= int(scene.lights.size())) {
+        // Reference mode, one shadow ray per light
+        for (const Light &light: scene.lights)
+            f(light, 1.0);
+    } else {
+        // Unbiased estimate of the same sum with 'n' lights picked from the light tree
+        for (int k = 0; k < n; k++) {
+            double pdf;
+            int l = scene.light_tree.sample(hit.position.template cast<double>(), hit.normal.template cast<double>(),
+                                            rng.next(), pdf);
+            f(scene.lights[l], pdf * n);
+        }
     }
+}
+
+template <typename Scalar>
+Vector3d ray_color(const Scene &scene, const RayT<Scalar> &ray, const Object &obj, const IntersectionT<Scalar> &hit,
+                   int max_bounce, SampleStream &rng) {
+    // Material for hit object
+    const Material &mat = obj.material;
+
+    // Ambient light contribution
+    Vector3d ambient_color = obj.material.ambient_color.array() * scene.ambient_light.array();
+
+    // Punctual lights contribution (direct lighting)
+    Vector3d lights_color(0, 0, 0);
+    for_each_light_sample(scene, hit, rng, [&](const Light &light, double weight) {
+        lights_color += light_color(scene, ray, mat, hit, light) / weight;
+    });
 
     // TODO (Assignment 2, reflected ray)
     Vector3d reflection_color(0, 0, 0);
+    if (max_bounce > 0 && mat.reflection_color.squaredNorm() > 0) {
+        RayT<Scalar> reflected = reflected_ray(ray, hit);
+        STATS_INC(REFLECTION_RAYS);
+        IntersectionT<Scalar> reflected_hit;
+        if (Object *reflected_obj = find_nearest_object(scene, reflected, reflected_hit))
+            reflection_color = mat.reflection_color.cwiseProduct(
+                    ray_color(scene, reflected, *reflected_obj, reflected_hit, max_bounce - 1, rng));
+    }
 
     // TODO (Assignment 2, refracted ray)
     Vector3d refraction_color(0, 0, 0);
@@ -501,63 +2925,147 @@ Vector3d ray_color(const Scene &scene, const Ray &ray, const Object &obj, const
 
 // -----------------------------------------------------------------------------
 
-Object *find_nearest_object(const Scene &scene, const Ray &ray, Intersection &closest_hit) {
-    int closest_index = -1;
+template <typename Scalar>
+Object *find_nearest_object(const Scene &scene, const RayT<Scalar> &ray, IntersectionT<Scalar> &closest_hit) {
+    Object *closest_object = nullptr;
     // TODO (Assignment 2, find nearest hit)
-    double ray_param = INFINITY;
-    for (int i = 0; i < scene.objects.size(); i++) {
-        Intersection hit;
-        if (scene.objects[i]->intersect(ray, hit)) {
-            if (hit.ray_param < ray_param) {
-                ray_param = hit.ray_param;
-                closest_hit = hit;
-                closest_index = i;
-            }
+    // The objects are found with the tree over their boxes, and the ones whose box
+    // is behind the closest hit so far are skipped
+    Scalar ray_param = INFINITY;
+    traverse_objects(scene, ray, ray_param, [&](Object *object) {
+        IntersectionT<Scalar> hit;
+        if (object->intersect(ray, hit) && hit.ray_param < ray_param) {
+            ray_param = hit.ray_param;
+            closest_hit = hit;
+            closest_object = object;
         }
+        return true;
+    });
+
+    // A null pointer for the background
+    return closest_object;
+}
+
+// Last object (and facet, for meshes) that blocked a shadow ray, for each light.
+// Neighbouring pixels are usually shadowed by the same triangle, so it is tested
+// before traversing the scene. There is one cache per worker of parallel_for(),
+// see worker_occluder_cache().
+struct OccluderCache {
+    struct Entry {
+        Object *object = nullptr;
+        int primitive = -1;
+    };
+    std::vector<Entry> last; // One entry per light
+
+    long shadow_rays = 0;  // Number of shadow rays traced
+    long hits = 0;         // Shadow rays blocked by the cached occluder
+    long object_tests = 0; // Ray/object intersection tests done for the shadow rays (a mesh counts once)
+};
+
+std::mutex occluder_caches_mutex;
+std::vector<std::shared_ptr<OccluderCache>> occluder_caches; // Cache of each worker index
+
+// Cache of the worker index of the calling thread. It is kept from one call of
+// parallel_for() to the next (adaptive passes, bands, frames), and there are only
+// as many caches as threads.
+OccluderCache &worker_occluder_cache() {
+    thread_local OccluderCache *cache = nullptr;
+    thread_local int cache_worker = -1;
+    if (cache_worker != parallel_worker) {
+        std::lock_guard<std::mutex> lock(occluder_caches_mutex);
+        if (int(occluder_caches.size()) <= parallel_worker) occluder_caches.resize(parallel_worker + 1);
+        if (!occluder_caches[parallel_worker]) occluder_caches[parallel_worker] = std::make_shared<OccluderCache>();
+        cache = occluder_caches[parallel_worker].get();
+        cache_worker = parallel_worker;
     }
+    return *cache;
+}
 
-    if (closest_index < 0) {
-        // Return a NULL pointer
-        return nullptr;
-    } else {
-        // Return a pointer to the hit object. Don't forget to set 'closest_hit' accordingly!
-        return scene.objects[closest_index].get();
+void print_occluder_cache_stats() {
+    OccluderCache total;
+    std::lock_guard<std::mutex> lock(occluder_caches_mutex);
+    for (const auto &cache: occluder_caches) {
+        total.shadow_rays += cache->shadow_rays;
+        total.hits += cache->hits;
+        total.object_tests += cache->object_tests;
     }
+    std::cout << "Shadow rays: " << total.shadow_rays << ", occluder cache hits: " << total.hits << " ("
+              << 100.0 * total.hits / std::max(total.shadow_rays, 1L) << "%), object tests per shadow ray: "
+              << double(total.object_tests) / std::max(total.shadow_rays, 1L) << std::endl;
 }
 
-bool is_light_visible(const Scene &scene, const Ray &ray, const Light &light) {
+template <typename Scalar>
+bool is_light_visible(const Scene &scene, const RayT<Scalar> &ray, const Light &light) {
     // TODO (Assignment 2, shadow ray)
-    for (auto &obj: scene.objects) {
-        Intersection hit;
-        if (obj->intersect(ray, hit) && ((hit.position - ray.origin).norm() < (light.position - ray.origin).norm()))
+    Scalar light_distance = (light.position.cast<Scalar>() - ray.origin).norm();
+    auto blocked_by = [&](const IntersectionT<Scalar> &hit) {
+        return (hit.position - ray.origin).norm() < light_distance;
+    };
+
+    OccluderCache &cache = worker_occluder_cache();
+    cache.last.resize(scene.lights.size());
+    OccluderCache::Entry &last = cache.last[&light - scene.lights.data()]; // 'light' is an element of scene.lights
+    cache.shadow_rays++;
+    STATS_INC(SHADOW_RAYS);
+
+    if (use_occluder_cache && last.object != nullptr) {
+        // Test the cached facet only, the whole mesh is traversed below if it misses
+        IntersectionT<Scalar> hit;
+        const MeshInstance *instance = dynamic_cast<const MeshInstance *>(last.object);
+        bool found = instance ? instance->intersect_facet(ray, last.primitive, hit) : last.object->intersect(ray, hit);
+        cache.object_tests++;
+        if (found && blocked_by(hit)) {
+            cache.hits++;
             return false;
+        }
     }
-    return true;
+    // Only the objects whose box starts before the light can block it
+    bool visible = true;
+    Scalar light_param = light_distance / ray.direction.norm();
+    traverse_objects(scene, ray, light_param, [&](Object *object) {
+        if (use_occluder_cache && object == last.object && last.primitive < 0) return true; // Already tested
+        IntersectionT<Scalar> hit;
+        cache.object_tests++;
+        if (object->intersect(ray, hit) && blocked_by(hit)) {
+            last.object = object;
+            last.primitive = hit.primitive;
+            visible = false;
+        }
+        return visible;
+    });
+    return visible;
 }
 
-Vector3d shoot_ray(const Scene &scene, const Ray &ray, int max_bounce) {
-    Intersection hit;
-    if (Object *obj = find_nearest_object(scene, ray, hit)) {
+// Color of a ray whose closest hit is 'hit' on 'obj' (null for the background)
+template <typename Scalar>
+Vector3d shade_hit(const Scene &scene, const RayT<Scalar> &ray, const Object *obj, const IntersectionT<Scalar> &hit,
+                   int max_bounce, SampleStream &rng, PrimaryHit *primary) {
+    if (primary) {
+        primary->object = obj;
+        if (obj) primary->depth = double((hit.position - ray.origin).norm());
+    }
+    if (obj) {
         // 'obj' is not null and points to the object of the scene hit by the ray
-        return ray_color(scene, ray, *obj, hit, max_bounce);
+        return ray_color(scene, ray, *obj, hit, max_bounce, rng);
     } else {
         // 'obj' is null, we must return the background color
         return scene.background_color;
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-void render_scene(const Scene &scene) {
-    std::cout << "Simple ray tracer." << std::endl;
+template <typename Scalar>
+Vector3d shoot_ray(const Scene &scene, const RayT<Scalar> &ray, int max_bounce, SampleStream &rng,
+                   PrimaryHit *primary) {
+    IntersectionT<Scalar> hit;
+    Object *obj = find_nearest_object(scene, ray, hit);
+    return shade_hit(scene, ray, obj, hit, max_bounce, rng, primary);
+}
 
-    int w = 640;
-    int h = 480;
-    MatrixXd R = MatrixXd::Zero(w, h);
-    MatrixXd G = MatrixXd::Zero(w, h);
-    MatrixXd B = MatrixXd::Zero(w, h);
-    MatrixXd A = MatrixXd::Zero(w, h); // Store the alpha mask
+////////////////////////////////////////////////////////////////////////////////
 
+// Primary ray through the point (x, y) of the image, in pixel units: the center of
+// pixel (i, j) is (i + 0.5, j + 0.5)
+Ray camera_ray(const Scene &scene, int w, int h, double x, double y) {
     // The camera always points in the direction -z
     // The sensor grid is at a distance 'focal_length' from the camera center,
     // and covers an viewing angle given by 'field_of_view'.
@@ -573,49 +3081,998 @@ void render_scene(const Scene &scene) {
     Vector3d x_displacement(2.0 / w * scale_x, 0, 0);
     Vector3d y_displacement(0, -2.0 / h * scale_y, 0);
 
-    for (unsigned i = 0; i < w; ++i) {
-        std::cout << std::fixed << std::setprecision(2);
-        std::cout << "Ray tracing: " << (100.0 * i) / w << "%\r" << std::flush;
-        for (unsigned j = 0; j < h; ++j) {
-            // TODO (Assignment 2, depth of field)
-            Vector3d shift = grid_origin + (i + 0.5) * x_displacement + (j + 0.5) * y_displacement;
-
-            // Prepare the ray
-            Ray ray;
-
-            if (scene.camera.is_perspective) {
-                // Perspective camera
-                // TODO (Assignment 2, perspective camera)
-                ray.origin = scene.camera.position;
-                ray.direction = Vector3d(shift[0], shift[1], 0) - ray.origin;
-            } else {
-                // Orthographic camera
-                ray.origin = scene.camera.position + Vector3d(shift[0], shift[1], 0);
-                ray.direction = Vector3d(0, 0, -1);
+    // TODO (Assignment 2, depth of field)
+    Vector3d shift = grid_origin + x * x_displacement + y * y_displacement;
+
+    // Prepare the ray
+    Ray ray;
+
+    if (scene.camera.is_perspective) {
+        // Perspective camera
+        // TODO (Assignment 2, perspective camera)
+        ray.origin = scene.camera.position;
+        ray.direction = Vector3d(shift[0], shift[1], 0) - ray.origin;
+    } else {
+        // Orthographic camera
+        ray.origin = scene.camera.position + Vector3d(shift[0], shift[1], 0);
+        ray.direction = Vector3d(0, 0, -1);
+    }
+    return ray;
+}
+
+// Camera ray of the sample 's' of pixel (i, j): a single sample goes through the
+// center of the pixel, several ones are jittered over it
+Ray sample_ray(const Scene &scene, const RenderConfig &config, int i, int j, int s) {
+    uint32_t pixel = uint32_t(j) * config.width + i;
+    Vector2d offset = config.samples == 1 && s == 0 ? Vector2d(0.5, 0.5) : sample_2d(pixel, s, 0, 0);
+    STATS_INC(CAMERA_RAYS);
+    return camera_ray(scene, config.width, config.height, i + offset(0), j + offset(1));
+}
+
+// Random numbers of the shading of the sample 's' of pixel (i, j)
+SampleStream sample_stream(const RenderConfig &config, int i, int j, int s) {
+    SampleStream rng(uint32_t(j) * config.width + i, s);
+    if (config.samples > 1 || s > 0) rng.dimension = 1; // Dimension 0 is the jitter of the pixel
+    return rng;
+}
+
+// Average of the samples [first, first + count) of pixel (i, j). The first hit of
+// sample 0 is stored in 'primary' if it is not null.
+Vector3d render_samples(const Scene &scene, const RenderConfig &config, int i, int j, int first, int count,
+                        PrimaryHit *primary = nullptr) {
+    Vector3d C(0, 0, 0);
+    for (int s = first; s < first + count; ++s) {
+        Ray ray = sample_ray(scene, config, i, j, s);
+        SampleStream rng = sample_stream(config, i, j, s);
+        PrimaryHit *hit = s == 0 ? primary : nullptr;
+        if (config.single_precision)
+            C += shoot_ray(scene, ray.cast<float>(), config.max_bounce, rng, hit);
+        else
+            C += shoot_ray(scene, ray, config.max_bounce, rng, hit);
+    }
+    return C / count;
+}
+
+Vector3d render_pixel(const Scene &scene, const RenderConfig &config, int i, int j, PrimaryHit *primary = nullptr) {
+    return render_samples(scene, config, i, j, 0, config.samples, primary);
+}
+
+// Sample 's' of the pixels of a block traced as one packet, see render_packet()
+template <typename Scalar>
+void shoot_packet(const Scene &scene, const RenderConfig &config, int i0, int j0, int bw, int bh, int s, Vector3d *C,
+                  PrimaryHit *primary) {
+    RayPacketT<Scalar> packet;
+    packet.size = bw * bh;
+    for (int k = 0; k < packet.size; ++k) {
+        packet.set_ray(k, sample_ray(scene, config, i0 + k % bw, j0 + k / bw, s).template cast<Scalar>());
+        packet.set_hit(k, std::numeric_limits<Scalar>::infinity(), nullptr, -1);
+    }
+    find_nearest_objects(scene, packet);
+    for (int k = 0; k < packet.size; ++k) {
+        SampleStream rng = sample_stream(config, i0 + k % bw, j0 + k / bw, s);
+        C[k] += shade_hit(scene, packet.ray(k), packet.object[k], packet.hit[k], config.max_bounce, rng,
+                          s == 0 ? &primary[k] : nullptr);
+    }
+}
+
+// Same as render_pixel() for the pixels [i0, i0 + bw) x [j0, j0 + bh), at most
+// packet_width x packet_width, whose camera rays are traced by packets (one per
+// sample). The colors and the first hits are stored row by row in 'C' and
+// 'primary'.
+void render_packet(const Scene &scene, const RenderConfig &config, int i0, int j0, int bw, int bh, Vector3d *C,
+                   PrimaryHit *primary) {
+    for (int k = 0; k < bw * bh; ++k) C[k] = Vector3d(0, 0, 0);
+    for (int s = 0; s < config.samples; ++s) {
+        if (config.single_precision)
+            shoot_packet<float>(scene, config, i0, j0, bw, bh, s, C, primary);
+        else
+            shoot_packet<double>(scene, config, i0, j0, bw, bh, s, C, primary);
+    }
+    for (int k = 0; k < bw * bh; ++k) C[k] = C[k] / config.samples;
+}
+
+// Number of threads used to render a scene
+int render_threads(const RenderConfig &config) {
+    return config.threads > 0 ? config.threads : default_thread_count();
+}
+
+// Key of a ray for the sorting of the wavefront queues: the octant of its
+// direction, then the Morton code of its origin in the box of the scene. Rays with
+// close keys start close to each other in the same general direction, and visit the
+// same nodes of the trees.
+template <typename Scalar>
+uint32_t ray_sort_key(const RayT<Scalar> &ray, const AlignedBox3d &box) {
+    uint32_t octant = (ray.direction(0) < 0) << 2 | (ray.direction(1) < 0) << 1 | (ray.direction(2) < 0);
+    Vector3d p = (ray.origin.template cast<double>() - box.min()).cwiseQuotient(box.sizes().cwiseMax(1e-12));
+    return octant << 27 | morton_code(p) >> 3;
+}
+
+// Store in 'order' the indices [0, n) of the rays returned by 'ray(i)', sorted by
+// ray_sort_key() if sort_wavefront_rays is set
+template <typename F>
+void sort_rays(const Scene &scene, int n, int threads, const F &ray, std::vector<int> &order) {
+    order.resize(n);
+    if (!sort_wavefront_rays) {
+        for (int i = 0; i < n; ++i) order[i] = i;
+        return;
+    }
+    STATS_TIMER("wavefront_sort");
+    const AlignedBox3d &box = scene.object_bvh.nodes[scene.object_bvh.root].bbox;
+    std::vector<uint64_t> keys(n);
+    parallel_for(n, threads, 1024, [&](int i) { keys[i] = uint64_t(ray_sort_key(ray(i), box)) << 32 | uint32_t(i); });
+    radix_sort(keys, 32, 62, threads);
+    for (int i = 0; i < n; ++i) order[i] = int(keys[i] & 0xFFFFFFFF);
+}
+
+// Wavefront version of render_samples() for the pixels [first, last) of the rows
+// [j0, j0 + rows), counted row by row. Instead of following each path depth-first
+// through ray_color(), the paths of all the pixels advance together, one stage at
+// a time:
+//  - extend: the closest hit of every active ray,
+//  - shade: the ambient term, the shadow rays and the mirror ray of each hit,
+//  - shadow: the visibility of the lights,
+// and each stage is one loop over a queue of rays, sorted by ray_sort_key() so
+// that consecutive rays walk the same nodes of the trees. The hits are kept as
+// vertices of the paths, whose colors are summed back from the last bounce once
+// all the paths have ended, in the same order as ray_color(): the image is the
+// same as with the depth-first renderer. 'store(i, k, color, primary)' gets the
+// pixels.
+template <typename Scalar, typename F>
+void render_wavefront(const Scene &scene, const RenderConfig &config, int threads, int j0, int first, int last,
+                      const F &store) {
+    struct Path {
+        RayT<Scalar> ray;
+        SampleStream rng;
+        int vertices; // Hits found so far, vertex d being the hit of the ray after d bounces
+    };
+    struct Vertex {
+        Vector3d ambient;
+        Vector3d lights;     // Sum of the visible lights, filled by the shadow stage
+        Vector3d reflection; // Reflection color of the material
+    };
+    struct ShadowRay {
+        RayT<Scalar> ray;
+        const Light *light;
+        Vector3d color; // Contribution of the light if it is visible
+    };
+
+    int w = config.width;
+    int samples = config.samples;
+    int max_vertices = config.max_bounce + 1;
+    int lights = lights_per_hit(scene);
+
+    // The buffers are kept from one batch to the next, to spare the page faults of
+    // their allocation
+    struct Buffers {
+        std::vector<Path> paths;       // Path p is the sample p % samples of the pixel first + p / samples
+        std::vector<Vertex> vertices;  // Vertices of path p from p * max_vertices
+        std::vector<PrimaryHit> primary;
+        std::vector<int> queue;        // Active paths
+        std::vector<int> order;        // Sorted queue of rays of a stage
+        std::vector<IntersectionT<Scalar>> hits;
+        std::vector<const Object *> objects;
+        std::vector<char> bounces;
+        std::vector<ShadowRay> shadow_rays; // lights_per_hit() per path of the queue
+        std::vector<int> shadow_queue;
+        std::vector<char> visible;
+    };
+    static thread_local Buffers buffers;
+    auto &paths = buffers.paths;
+    auto &vertices = buffers.vertices;
+    auto &primary = buffers.primary;
+    auto &queue = buffers.queue;
+    auto &order = buffers.order;
+    auto &hits = buffers.hits;
+    auto &objects = buffers.objects;
+    auto &bounces = buffers.bounces;
+    auto &shadow_rays = buffers.shadow_rays;
+    auto &shadow_queue = buffers.shadow_queue;
+    auto &visible = buffers.visible;
+
+    vertices.resize(size_t(last - first) * samples * max_vertices);
+    primary.assign(last - first, PrimaryHit());
+    {
+        STATS_TIMER("wavefront_generate");
+        paths.clear();
+        queue.clear();
+        for (int pixel = first; pixel < last; ++pixel) {
+            for (int s = 0; s < samples; ++s) {
+                int i = pixel % w, j = j0 + pixel / w;
+                queue.push_back(paths.size());
+                paths.push_back({sample_ray(scene, config, i, j, s).template cast<Scalar>(),
+                                 sample_stream(config, i, j, s), 0});
+            }
+        }
+    }
+
+    while (!queue.empty()) {
+        int n = queue.size();
+
+        // Extend: closest hit of the rays of the queue
+        hits.resize(n);
+        objects.resize(n);
+        {
+            sort_rays(scene, n, threads, [&](int q) { return paths[queue[q]].ray; }, order);
+            STATS_TIMER("wavefront_extend");
+            parallel_for(n, threads, 64, [&](int r) {
+                int q = order[r];
+                objects[q] = find_nearest_object(scene, paths[queue[q]].ray, hits[q]);
+            });
+        }
+
+        // Shade: new vertex, shadow rays and mirror ray of each hit, in the order of
+        // the paths for their random numbers
+        bounces.assign(n, false);
+        shadow_rays.resize(size_t(n) * lights);
+        {
+            STATS_TIMER("wavefront_shade");
+            parallel_for(n, threads, 64, [&](int q) {
+                int p = queue[q];
+                Path &path = paths[p];
+                const Object *obj = objects[q];
+                const IntersectionT<Scalar> &hit = hits[q];
+                if (path.vertices == 0 && p % samples == 0) {
+                    primary[p / samples].object = obj;
+                    if (obj) primary[p / samples].depth = double((hit.position - path.ray.origin).norm());
+                }
+                if (!obj) return;
+
+                const Material &mat = obj->material;
+                Vertex &vertex = vertices[size_t(p) * max_vertices + path.vertices++];
+                vertex.ambient = mat.ambient_color.array() * scene.ambient_light.array();
+                vertex.lights = Vector3d(0, 0, 0);
+                vertex.reflection = mat.reflection_color;
+                ShadowRay *shadow = &shadow_rays[size_t(q) * lights];
+                for_each_light_sample(scene, hit, path.rng, [&](const Light &light, double weight) {
+                    shadow->ray = shadow_ray(hit, light);
+                    shadow->light = &light;
+                    shadow->color = unshadowed_light_color(path.ray, mat, hit, light) / weight;
+                    ++shadow;
+                });
+
+                if (path.vertices < max_vertices && mat.reflection_color.squaredNorm() > 0) {
+                    path.ray = reflected_ray(path.ray, hit);
+                    STATS_INC(REFLECTION_RAYS);
+                    bounces[q] = true;
+                }
+            });
+        }
+
+        // Shadow: visibility of the lights from the hits
+        shadow_queue.clear();
+        for (int q = 0; q < n; ++q)
+            if (objects[q])
+                for (int l = 0; l < lights; ++l) shadow_queue.push_back(q * lights + l);
+        visible.resize(shadow_rays.size());
+        {
+            int m = shadow_queue.size();
+            sort_rays(scene, m, threads, [&](int r) { return shadow_rays[shadow_queue[r]].ray; }, order);
+            STATS_TIMER("wavefront_shadow");
+            parallel_for(m, threads, 64, [&](int r) {
+                const ShadowRay &shadow = shadow_rays[shadow_queue[order[r]]];
+                visible[shadow_queue[order[r]]] = is_light_visible(scene, shadow.ray, *shadow.light);
+            });
+        }
+        // The visible lights are summed in the order of the shading
+        parallel_for(n, threads, 64, [&](int q) {
+            if (!objects[q]) return;
+            const Path &path = paths[queue[q]];
+            Vertex &vertex = vertices[size_t(queue[q]) * max_vertices + path.vertices - 1];
+            for (int l = q * lights; l < (q + 1) * lights; ++l)
+                if (visible[l]) vertex.lights += shadow_rays[l].color;
+        });
+
+        // The paths that bounce go on with their mirror ray
+        int next = 0;
+        for (int q = 0; q < n; ++q)
+            if (bounces[q]) queue[next++] = queue[q];
+        queue.resize(next);
+    }
+
+    // Colors of the paths, from their last vertex up to the camera
+    parallel_for(last - first, threads, 64, [&](int pixel) {
+        Vector3d C(0, 0, 0);
+        for (int p = pixel * samples; p < (pixel + 1) * samples; ++p) {
+            int count = paths[p].vertices;
+            if (count == 0) {
+                C += scene.background_color;
+                continue;
+            }
+            Vector3d path_color(0, 0, 0);
+            for (int d = count - 1; d >= 0; --d) {
+                const Vertex &vertex = vertices[size_t(p) * max_vertices + d];
+                // The last vertex reflects nothing: its mirror ray missed the scene, or was not traced
+                Vector3d reflection_color =
+                        d + 1 < count ? Vector3d(vertex.reflection.cwiseProduct(path_color)) : Vector3d(0, 0, 0);
+                path_color = vertex.ambient + vertex.lights + reflection_color;
+            }
+            C += path_color;
+        }
+        store((first + pixel) % w, (first + pixel) / w, C / samples, primary[pixel]);
+    });
+}
+
+// Trace the rows [j0, j0 + rows) of the image, one tile per thread at a time, and
+// store the colors in 'band' (row-major RGB). Row j0 + k of the image goes to row
+// k of 'band', or to row rows - 1 - k if 'flip' is set. The first hits are stored
+// in the same order in 'primary' if it is not null.
+void render_band(const Scene &scene, const RenderConfig &config, int threads, int j0, int rows, bool flip,
+                 std::vector<double> &band, PrimaryHit *primary = nullptr) {
+    int w = config.width;
+    auto store = [&](int i, int k, const Vector3d &C, const PrimaryHit &hit) {
+        size_t index = size_t(flip ? rows - 1 - k : k) * w + i;
+        double *pixel = &band[index * 3];
+        pixel[0] = C(0);
+        pixel[1] = C(1);
+        pixel[2] = C(2);
+        if (primary) primary[index] = hit;
+    };
+    if (config.wavefront) {
+        // The band is traced by batches of at most wavefront_batch paths
+        int pixels = std::max(1, wavefront_batch / std::max(config.samples, 1));
+        for (int first = 0; first < w * rows; first += pixels) {
+            int last = std::min(first + pixels, w * rows);
+            if (config.single_precision)
+                render_wavefront<float>(scene, config, threads, j0, first, last, store);
+            else
+                render_wavefront<double>(scene, config, threads, j0, first, last, store);
+        }
+        return;
+    }
+    if (!use_ray_packets) {
+        parallel_for_tiles(w, rows, config.tile_size, threads, [&](int i, int k) {
+            PrimaryHit hit;
+            Vector3d C = render_pixel(scene, config, i, j0 + k, &hit);
+            store(i, k, C, hit);
+        });
+        return;
+    }
+    // The tiles are traced by packets of packet_width x packet_width pixels
+    parallel_for_blocks(w, rows, config.tile_size, threads, [&](int i0, int k0, int i1, int k1) {
+        for (int kb = k0; kb < k1; kb += packet_width) {
+            for (int ib = i0; ib < i1; ib += packet_width) {
+                int bw = std::min(packet_width, i1 - ib);
+                int bh = std::min(packet_width, k1 - kb);
+                Vector3d C[RayPacketT<double>::max_size];
+                PrimaryHit hits[RayPacketT<double>::max_size];
+                render_packet(scene, config, ib, j0 + kb, bw, bh, C, hits);
+                for (int k = 0; k < bw * bh; ++k) store(ib + k % bw, kb + k / bw, C[k], hits[k]);
             }
+        }
+    });
+}
+
+// A pixel is on an edge of the image if one of its 4 neighbors hits another
+// object, or if their depths or colors (clamped to [0, 1]) differ by more than:
+const double edge_depth_threshold = 0.05; // Relative difference of depth
+const double edge_color_threshold = 0.1;  // Difference of one channel
+
+bool is_edge(const PrimaryHit &a, const PrimaryHit &b, const Vector3d &color_a, const Vector3d &color_b) {
+    if (a.object != b.object) return true;
+    if (a.object && std::abs(a.depth - b.depth) > edge_depth_threshold * std::min(a.depth, b.depth)) return true;
+    Vector3d ca = color_a.cwiseMax(0).cwiseMin(1);
+    Vector3d cb = color_b.cwiseMax(0).cwiseMin(1);
+    return (ca - cb).cwiseAbs().maxCoeff() > edge_color_threshold;
+}
+
+// Post-pass of the image: the pixels on an edge are traced again with
+// config.edge_samples jittered rays, averaged with their first samples, instead
+// of supersampling the whole image. Returns the number of refined pixels.
+size_t refine_edges(const Scene &scene, const RenderConfig &config, int threads, const std::vector<PrimaryHit> &hits,
+                    MatrixXd &R, MatrixXd &G, MatrixXd &B) {
+    int w = config.width;
+    int h = config.height;
+    auto color = [&](int i, int j) { return Vector3d(R(i, j), G(i, j), B(i, j)); };
+
+    // Compare each pixel to its right and bottom neighbors, and mark both
+    std::vector<char> marked(size_t(w) * h, 0);
+    for (int j = 0; j < h; ++j) {
+        for (int i = 0; i < w; ++i) {
+            size_t p = size_t(j) * w + i;
+            if (i + 1 < w && is_edge(hits[p], hits[p + 1], color(i, j), color(i + 1, j)))
+                marked[p] = marked[p + 1] = 1;
+            if (j + 1 < h && is_edge(hits[p], hits[p + w], color(i, j), color(i, j + 1)))
+                marked[p] = marked[p + w] = 1;
+        }
+    }
+    std::vector<int> edges;
+    for (size_t p = 0; p < marked.size(); ++p)
+        if (marked[p]) edges.push_back(int(p));
+
+    int n = config.samples + config.edge_samples;
+    parallel_for(int(edges.size()), threads, 64, [&](int k) {
+        int i = edges[k] % w;
+        int j = edges[k] / w;
+        Vector3d C = render_samples(scene, config, i, j, config.samples, config.edge_samples);
+        Vector3d first = color(i, j);
+        C = (first * config.samples + C * config.edge_samples) / n;
+        R(i, j) = C(0);
+        G(i, j) = C(1);
+        B(i, j) = C(2);
+    });
+    return edges.size();
+}
+
+void render_scene(const Scene &scene, const RenderConfig &config) {
+    std::cout << "Simple ray tracer." << std::endl;
+
+    int w = config.width;
+    int h = config.height;
+    int threads = render_threads(config);
+    MatrixXd R = MatrixXd::Zero(w, h);
+    MatrixXd G = MatrixXd::Zero(w, h);
+    MatrixXd B = MatrixXd::Zero(w, h);
+    MatrixXd A = MatrixXd::Zero(w, h); // Store the alpha mask
+    std::vector<PrimaryHit> hits(size_t(w) * h);
 
-            int max_bounce = 5;
-            Vector3d C = shoot_ray(scene, ray, max_bounce);
-            R(i, j) = C(0);
-            G(i, j) = C(1);
-            B(i, j) = C(2);
-//            if (C(2) < 0.8) std::cout << "yes" << std::endl;
-//            else std::cout << "no" << std::endl;
-            A(i, j) = 1;
+    {
+        STATS_TIMER("render");
+        // The image is traced by bands of one row of tiles, to report the progress
+        int band_height = std::max(config.tile_size, 1);
+        std::vector<double> band(size_t(w) * band_height * 3);
+        for (int j0 = 0; j0 < h; j0 += band_height) {
+            std::cout << std::fixed << std::setprecision(2);
+            std::cout << "Ray tracing: " << (100.0 * j0) / h << "%\r" << std::flush;
+            int rows = std::min(band_height, h - j0);
+            render_band(scene, config, threads, j0, rows, false, band, &hits[size_t(j0) * w]);
+            for (int k = 0; k < rows; ++k) {
+                for (int i = 0; i < w; ++i) {
+                    const double *pixel = &band[(size_t(k) * w + i) * 3];
+                    R(i, j0 + k) = pixel[0];
+                    G(i, j0 + k) = pixel[1];
+                    B(i, j0 + k) = pixel[2];
+                    A(i, j0 + k) = 1;
+                }
+            }
         }
     }
 
     std::cout << "Ray tracing: 100%  " << std::endl;
 
+    if (config.edge_samples > 0) {
+        STATS_TIMER("refine");
+        size_t refined = refine_edges(scene, config, threads, hits, R, G, B);
+        std::cout << "Edge refinement: " << refined << " pixels (" << std::setprecision(2)
+                  << (100.0 * refined) / (size_t(w) * h) << "%) with " << config.edge_samples << " extra samples"
+                  << std::endl;
+    }
+
     // Save to png
-    const std::string filename("raytrace.png");
-    write_matrix_to_png(R, G, B, A, filename);
+    {
+        STATS_TIMER("encode");
+        write_matrix_to_png(R, G, B, A, config.output);
+    }
+    print_occluder_cache_stats();
+}
+
+// Render the image one band of rows (one row of tiles) at a time, and stream each
+// band to the output file (.ppm or .pfm, see ScanlineWriter) as soon as it is done.
+// Only two bands are held in memory, so the size of the image is not limited by the
+// RAM. The edges are refined as by render_scene(), band by band: a band is written
+// once the next one is traced, so that its last row is compared with the first row
+// of the next band, and its first row with the last row of the previous band, kept
+// as it was before the refinement. The image is the same as with render_scene().
+// Returns false if the output is not a .ppm or .pfm file, or could not be written.
+bool render_scene_banded(const Scene &scene, const RenderConfig &config) {
+    int w = config.width;
+    int h = config.height;
+    int threads = render_threads(config);
+    if (!ScanlineWriter::supports(config.output)) {
+        std::cerr << "The banded renderer writes .ppm or .pfm files, not " << config.output << std::endl;
+        return false;
+    }
+    std::cout << "Simple ray tracer, " << w << "x" << h << " image in bands." << std::endl;
+
+    ScanlineWriter out(config.output, w, h);
+    if (!out) {
+        std::cerr << "Could not write " << config.output << std::endl;
+        return false;
+    }
+    int band_height = std::max(config.tile_size, 1);
+    bool refine = config.edge_samples > 0;
+
+    // Rows of the bands in the order of the file, with their first hits. 'halo' is
+    // the last row of the previous band.
+    std::vector<double> band(size_t(w) * band_height * 3), next(band.size()), halo(size_t(w) * 3);
+    std::vector<PrimaryHit> hits(size_t(w) * band_height), next_hits(hits.size()), halo_hits(w);
+
+    // The k-th row written to the file is the row h - 1 - k of the image for a
+    // bottom-up file
+    auto image_row = [&](int k) { return out.bottom_up ? h - 1 - k : k; };
+    auto trace = [&](int k0, std::vector<double> &colors, std::vector<PrimaryHit> &primary) {
+        STATS_TIMER("render");
+        int rows = std::min(band_height, h - k0);
+        int j0 = out.bottom_up ? h - k0 - rows : k0;
+        render_band(scene, config, threads, j0, rows, out.bottom_up, colors, refine ? primary.data() : nullptr);
+        return rows;
+    };
+
+    // Refine the band of the file rows [k0, k0 + rows), whose next band has
+    // 'next_rows' rows. Returns the number of refined pixels.
+    auto refine_band = [&](int k0, int rows, int next_rows) {
+        STATS_TIMER("refine");
+        // Color and first hit of the row r of the band, from -1 (halo) to rows (first
+        // row of the next band)
+        auto pixel = [&](int i, int r) {
+            const double *c = r < 0 ? &halo[size_t(i) * 3]
+                                    : r < rows ? &band[(size_t(r) * w + i) * 3] : &next[size_t(i) * 3];
+            return Vector3d(c[0], c[1], c[2]);
+        };
+        auto hit = [&](int i, int r) -> const PrimaryHit & {
+            return r < 0 ? halo_hits[i] : r < rows ? hits[size_t(r) * w + i] : next_hits[i];
+        };
+        std::vector<int> edges;
+        for (int r = 0; r < rows; ++r) {
+            for (int i = 0; i < w; ++i) {
+                Vector3d color = pixel(i, r);
+                bool edge = (i > 0 && is_edge(hit(i, r), hit(i - 1, r), color, pixel(i - 1, r))) ||
+                            (i + 1 < w && is_edge(hit(i, r), hit(i + 1, r), color, pixel(i + 1, r))) ||
+                            ((k0 > 0 || r > 0) && is_edge(hit(i, r), hit(i, r - 1), color, pixel(i, r - 1))) ||
+                            ((next_rows > 0 || r + 1 < rows) && is_edge(hit(i, r), hit(i, r + 1), color, pixel(i, r + 1)));
+                if (edge) edges.push_back(r * w + i);
+            }
+        }
+        std::copy(band.begin() + size_t(rows - 1) * w * 3, band.begin() + size_t(rows) * w * 3, halo.begin());
+        std::copy(hits.begin() + size_t(rows - 1) * w, hits.begin() + size_t(rows) * w, halo_hits.begin());
+
+        int n = config.samples + config.edge_samples;
+        parallel_for(int(edges.size()), threads, 64, [&](int k) {
+            int i = edges[k] % w;
+            int r = edges[k] / w;
+            Vector3d C = render_samples(scene, config, i, image_row(k0 + r), config.samples, config.edge_samples);
+            C = (pixel(i, r) * config.samples + C * config.edge_samples) / n;
+            double *c = &band[(size_t(r) * w + i) * 3];
+            c[0] = C(0);
+            c[1] = C(1);
+            c[2] = C(2);
+        });
+        return edges.size();
+    };
+
+    size_t refined = 0;
+    int rows = trace(0, band, hits);
+    for (int k0 = 0; k0 < h; k0 += band_height) {
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "Ray tracing: " << (100.0 * k0) / h << "%\r" << std::flush;
+        int next_rows = 0;
+        if (refine && k0 + rows < h) next_rows = trace(k0 + rows, next, next_hits);
+        if (refine) refined += refine_band(k0, rows, next_rows);
+        out.write_rows(band.data(), rows);
+        if (!refine && k0 + rows < h) next_rows = trace(k0 + rows, next, next_hits);
+        band.swap(next);
+        hits.swap(next_hits);
+        rows = next_rows;
+    }
+
+    std::cout << "Ray tracing: 100%  " << std::endl;
+    if (refine)
+        std::cout << "Edge refinement: " << refined << " pixels (" << std::setprecision(2)
+                  << (100.0 * refined) / (size_t(w) * h) << "%) with " << config.edge_samples << " extra samples"
+                  << std::endl;
+    print_occluder_cache_stats();
+    out.out.flush();
+    if (!out) {
+        std::cerr << "Could not write " << config.output << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+
+// Number of rays that hit one of the triangles, testing every triangle
+template <typename Scalar>
+int brute_force_hits(const std::vector<RayT<Scalar>> &rays, const std::vector<PlanarPatchT<Scalar>> &planes) {
+    int hits = 0;
+    for (const RayT<Scalar> &ray: rays) {
+        Scalar ray_param = INFINITY;
+        for (const PlanarPatchT<Scalar> &plane: planes) {
+            IntersectionT<Scalar> hit;
+            if (intersect_triangle(ray, plane, hit) && hit.ray_param < ray_param) ray_param = hit.ray_param;
+        }
+        hits += ray_param < INFINITY;
+    }
+    return hits;
+}
+
+// Same with the watertight test of the blocks (the padding lanes are degenerate
+// triangles, which are never hit)
+template <typename Scalar>
+int brute_force_hits(const std::vector<RayT<Scalar>> &rays, const TriangleBlocksT<Scalar> &triangles) {
+    typedef TriangleBlocksT<Scalar> Blocks;
+    int hits = 0;
+    for (const RayT<Scalar> &ray: rays) {
+        ShearedRayT<Scalar> sheared(ray);
+        Scalar ray_param = INFINITY;
+        for (size_t b = 0; b < triangles.blocks.size(); ++b) {
+            Scalar t[Blocks::width];
+            int mask = triangles.intersect_block(sheared, b, (1 << Blocks::width) - 1, ray_param, t);
+            for (int l = 0; l < Blocks::width; ++l)
+                if (mask >> l & 1) ray_param = std::min(ray_param, t[l]);
+        }
+        hits += ray_param < INFINITY;
+    }
+    return hits;
+}
+
+// Planes of the facets of a mesh, for the reference triangle test
+std::vector<PlanarPatch> facet_planes(const Mesh &mesh) {
+    std::vector<PlanarPatch> planes(mesh.facets.rows());
+    for (int i = 0; i < mesh.facets.rows(); i++) {
+        Vector3d a = mesh.vertices.row(mesh.facets(i, 0));
+        Vector3d b = mesh.vertices.row(mesh.facets(i, 1));
+        Vector3d c = mesh.vertices.row(mesh.facets(i, 2));
+        planes[i] = PlanarPatch(a, b - a, c - a);
+    }
+    return planes;
+}
+
+template <typename Scalar>
+std::vector<PlanarPatchT<Scalar>> cast_planes(const std::vector<PlanarPatch> &planes) {
+    std::vector<PlanarPatchT<Scalar>> result;
+    for (const PlanarPatch &plane: planes) result.push_back(plane.cast<Scalar>());
+    return result;
+}
+
+// True if every edge of the facets 'F' is shared by exactly two facets
+bool is_closed(const MatrixXi &F) {
+    std::map<std::pair<int, int>, int> edges;
+    for (int i = 0; i < F.rows(); ++i)
+        for (int k = 0; k < 3; ++k)
+            edges[std::minmax(F(i, k), F(i, (k + 1) % 3))]++;
+    for (const auto &edge: edges)
+        if (edge.second != 2) return false;
+    return true;
+}
+
+// Number of rays that hit a mesh, traversing its BVH
+template <typename Scalar>
+int bvh_hits(const std::vector<RayT<Scalar>> &rays, Mesh &mesh) {
+    int hits = 0;
+    for (const RayT<Scalar> &ray: rays) {
+        IntersectionT<Scalar> hit;
+        hits += mesh.intersect(ray, hit);
+    }
+    return hits;
+}
+
+template <typename Scalar>
+std::vector<RayT<Scalar>> cast_rays(const std::vector<Ray> &rays) {
+    std::vector<RayT<Scalar>> result;
+    for (const Ray &ray: rays) result.push_back(ray.cast<Scalar>());
+    return result;
+}
+
+// Ray parameters of the closest hits of the camera rays through the centers of the
+// pixels (+infinity for the background), traced one at a time or by packets of
+// packet_width x packet_width pixels
+template <typename Scalar>
+std::vector<Scalar> primary_ray_params(const Scene &scene, const RenderConfig &config, bool packets) {
+    int w = config.width;
+    int h = config.height;
+    std::vector<Scalar> params(size_t(w) * h, std::numeric_limits<Scalar>::infinity());
+    for (int j0 = 0; j0 < h; j0 += packet_width) {
+        for (int i0 = 0; i0 < w; i0 += packet_width) {
+            int bw = std::min(packet_width, w - i0);
+            int bh = std::min(packet_width, h - j0);
+            RayPacketT<Scalar> packet;
+            packet.size = bw * bh;
+            for (int k = 0; k < packet.size; ++k) {
+                Ray ray = camera_ray(scene, w, h, i0 + k % bw + 0.5, j0 + k / bw + 0.5);
+                packet.set_ray(k, ray.template cast<Scalar>());
+                packet.set_hit(k, std::numeric_limits<Scalar>::infinity(), nullptr, -1);
+            }
+            if (packets) {
+                find_nearest_objects(scene, packet);
+            } else {
+                for (int k = 0; k < packet.size; ++k) {
+                    IntersectionT<Scalar> hit;
+                    if (find_nearest_object(scene, packet.ray(k), hit)) packet.t[k] = hit.ray_param;
+                }
+            }
+            for (int k = 0; k < packet.size; ++k) params[size_t(j0 + k / bw) * w + i0 + k % bw] = packet.t[k];
+        }
+    }
+    return params;
+}
+
+// Time the camera rays of the whole scene traced one at a time and by packets
+template <typename Scalar>
+void benchmark_packets(const Scene &scene, const RenderConfig &config, const std::string &precision) {
+    size_t n = size_t(config.width) * config.height;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Scalar> reference = primary_ray_params<Scalar>(scene, config, false);
+    double single = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Single rays (" << precision << "): " << n / single << " ray/s" << std::endl;
+
+    int min_rays = packet_min_rays;
+    for (int m: {0, 2, 4, 8, 16}) {
+        packet_min_rays = m;
+#ifdef ENABLE_STATS
+        uint64_t nodes = stats_total(BVH_NODES), boxes = stats_total(BOX_TESTS);
+#endif
+        start = std::chrono::steady_clock::now();
+        std::vector<Scalar> params = primary_ray_params<Scalar>(scene, config, true);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t same = 0;
+        for (size_t p = 0; p < n; ++p) same += params[p] == reference[p];
+        std::cout << "Packets (" << precision << "), single rays below " << m << " rays: " << n / seconds
+                  << " ray/s, speedup " << single / seconds << "x, " << same << "/" << n << " identical hits"
+                  << std::endl;
+#ifdef ENABLE_STATS
+        std::cout << "  " << double(stats_total(BVH_NODES) - nodes) / n << " nodes/ray, "
+                  << double(stats_total(BOX_TESTS) - boxes) / n << " box tests/ray" << std::endl;
+#endif
+    }
+    packet_min_rays = min_rays;
+}
+
+// Micro-benchmark of the ray/triangle test and of the BVH traversal. A subset of
+// the camera rays is tested against every facet of the meshes of the scene with
+// the 3x3 QR solve, with the precomputed planes and with the watertight test of
+// the blocks, in double and in float. Rays through the vertices and the edges of a
+// closed mesh count the cracks of the plane and watertight tests. Then
+// all the camera rays traverse the BVH, in double and in float, the trees of the
+// BVH builders are compared, and the file of the mesh is loaded again.
+// Returns false if the layouts or the builders of the tree do not find the same
+// number of hits.
+bool benchmark_intersection(const Scene &scene, const RenderConfig &config) {
+    bool consistent = true; // The layouts and the builders found as many hits
+    int w = config.width;
+    int h = config.height;
+    int stride = 8; // Use one pixel out of 8 in each direction
+    std::vector<Ray> rays, all_rays;
+    for (int i = 0; i < w; i++) {
+        for (int j = 0; j < h; j++) {
+            all_rays.push_back(camera_ray(scene, w, h, i + 0.5, j + 0.5));
+            if (i % stride == 0 && j % stride == 0) rays.push_back(all_rays.back());
+        }
+    }
+    std::vector<RayT<float>> rays_float = cast_rays<float>(rays), all_rays_float = cast_rays<float>(all_rays);
+
+    // Each mesh file once, without the transforms of its instances
+    for (const auto &shared_mesh: scene.meshes) {
+        Mesh *mesh = shared_mesh.get();
+
+        // Time f(), which returns the number of hits of 'n' rays doing 'tests' triangle
+        // tests. The hits are kept in 'hits' for check_hits().
+        int hits = 0;
+        auto run = [&](const std::string &name, size_t n, double tests, const std::function<int()> &f) {
+            auto start = std::chrono::steady_clock::now();
+            hits = f();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << name << ": " << n / seconds << " ray/s";
+            if (tests > 0) std::cout << ", " << tests / seconds << " triangle tests/s";
+            std::cout << " (" << hits << " hits)" << std::endl;
+            return seconds;
+        };
+        // The same rays must hit as often in every tree
+        auto check_hits = [&](const std::string &name, int expected) {
+            if (hits == expected) return;
+            std::cerr << name << ": " << hits << " hits instead of " << expected << std::endl;
+            consistent = false;
+        };
+        double tests = double(rays.size()) * mesh->facets.rows();
+
+        std::cout << "Mesh with " << mesh->facets.rows() << " facets, " << rays.size() << " rays" << std::endl;
+        size_t lanes = mesh->triangles.blocks.size() * TriangleBlocks::width;
+        std::cout << "Triangle blocks: " << mesh->triangles.blocks.size() << ", " << 100.0 * mesh->facets.rows() / lanes
+                  << "% of the lanes used, " << (sizeof(TriangleBlocks::Block) * mesh->triangles.blocks.size() >> 10)
+                  << " KB in double" << std::endl;
+        if (tests > 1e8) {
+            std::cout << "Too many facets for the brute-force tests, skipped" << std::endl;
+        } else {
+            double qr = run("QR solve", rays.size(), tests, [&]() {
+                int hits = 0;
+                for (const Ray &ray: rays) {
+                    double ray_param = INFINITY;
+                    for (int i = 0; i < mesh->facets.rows(); i++) {
+                        Intersection hit;
+                        if (intersect_triangle_qr(ray, mesh->vertices.row(mesh->facets(i, 0)),
+                                                  mesh->vertices.row(mesh->facets(i, 1)),
+                                                  mesh->vertices.row(mesh->facets(i, 2)), hit) &&
+                            hit.ray_param < ray_param)
+                            ray_param = hit.ray_param;
+                    }
+                    hits += ray_param < INFINITY;
+                }
+                return hits;
+            });
+            std::vector<PlanarPatch> planes = facet_planes(*mesh);
+            std::vector<PlanarPatchT<float>> planes_float = cast_planes<float>(planes);
+            double plane = run("Precomputed planes (double)", rays.size(), tests, [&]() {
+                return brute_force_hits(rays, planes);
+            });
+            double plane_float = run("Precomputed planes (float)", rays.size(), tests, [&]() {
+                return brute_force_hits(rays_float, planes_float);
+            });
+            double blocks = run("Watertight blocks (double)", rays.size(), tests, [&]() {
+                return brute_force_hits(rays, mesh->triangles);
+            });
+            double blocks_float = run("Watertight blocks (float)", rays.size(), tests, [&]() {
+                return brute_force_hits(rays_float, mesh->triangles_float);
+            });
+            std::cout << "Speedup of the planes: " << qr / plane << "x, float: " << plane / plane_float << "x"
+                      << std::endl;
+            std::cout << "Speedup of the blocks over the planes: " << plane / blocks
+                      << "x, float: " << plane_float / blocks_float << "x" << std::endl;
+        }
+
+        // Rays from the center of the box of a closed mesh through its vertices and
+        // the middles of its edges, which all hit the mesh unless they pass through
+        // a crack between two facets
+        if (is_closed(mesh->facets)) {
+            AlignedBox3d box = mesh->bvh.nodes[mesh->bvh.root].bbox;
+            int n = std::max<int>(1, std::min<double>(mesh->facets.rows(), 1e8 / mesh->facets.rows() / 2));
+            std::vector<Ray> edge_rays;
+            for (int i = 0; i < n; ++i) {
+                int f = int(int64_t(i) * mesh->facets.rows() / n);
+                Vector3d a = mesh->vertices.row(mesh->facets(f, 0));
+                Vector3d b = mesh->vertices.row(mesh->facets(f, 1));
+                edge_rays.push_back(Ray{box.center(), a - box.center()});
+                edge_rays.push_back(Ray{box.center(), (a + b) / 2 - box.center()});
+            }
+            std::vector<RayT<float>> edge_rays_float = cast_rays<float>(edge_rays);
+            std::vector<PlanarPatch> planes = facet_planes(*mesh);
+            std::vector<PlanarPatchT<float>> planes_float = cast_planes<float>(planes);
+            int m = edge_rays.size();
+            std::cout << "Rays through the vertices and edges missing the closed mesh, out of " << m
+                      << ": planes " << m - brute_force_hits(edge_rays, planes) << " (float "
+                      << m - brute_force_hits(edge_rays_float, planes_float) << "), watertight "
+                      << m - brute_force_hits(edge_rays, mesh->triangles) << " (float "
+                      << m - brute_force_hits(edge_rays_float, mesh->triangles_float) << ")" << std::endl;
+        }
+
+        // Incoherent rays, from random points around the mesh to random points of its
+        // box, which visit the nodes in no particular order
+        AlignedBox3d box = mesh->bvh.nodes[mesh->bvh.root].bbox;
+        double radius = box.diagonal().norm();
+        std::vector<RayT<float>> random_rays;
+        for (size_t i = 0; i < all_rays.size(); ++i) {
+            auto u = [&](int dimension) { return random_uniform(i, 0, 0, dimension); };
+            double z = 2 * u(0) - 1, phi = 2 * M_PI * u(1);
+            Vector3d origin = box.center() + radius * Vector3d(std::sqrt(1 - z * z) * std::cos(phi),
+                                                               std::sqrt(1 - z * z) * std::sin(phi), z);
+            Vector3d target = box.min() + box.sizes().cwiseProduct(Vector3d(u(2), u(3), u(4)));
+            random_rays.push_back(Ray{origin, (target - origin).normalized()}.cast<float>());
+        }
+
+        std::cout << "BVH traversal, " << all_rays.size() << " rays" << std::endl;
+        BvhLayout layout = bvh_layout;
+        const BvhLayout layouts[3] = {BvhLayout::BINARY, BvhLayout::WIDE, BvhLayout::COMPRESSED};
+        const char *tree_names[3] = {"Binary BVH", "4-wide BVH", "Compressed BVH"};
+        size_t tree_sizes[3] = {mesh->bvh_float.nodes.size() * sizeof(AABBTreeT<float>::Node),
+                                mesh->bvh_wide.nodes.size() * sizeof(WideBvh::Node),
+                                mesh->bvh_compressed.nodes.size() * sizeof(CompressedBvh::Node)};
+        double bvh[3], bvh_float[3], bvh_random[3];
+        int reference_hits = 0, reference_float = 0, reference_random = 0; // Hits of the binary tree
+        for (int k = 0; k < 3; ++k) {
+            bvh_layout = layouts[k];
+            std::string tree = tree_names[k];
+            std::cout << tree << ": " << tree_sizes[k] / 1048576.0 << " MB in float" << std::endl;
+#ifdef ENABLE_STATS
+            uint64_t nodes = stats_total(BVH_NODES), triangles = stats_total(TRIANGLE_TESTS);
+#endif
+            bvh[k] = run(tree + " (double)", all_rays.size(), 0, [&]() { return bvh_hits(all_rays, *mesh); });
+            if (k == 0) reference_hits = hits;
+            check_hits(tree + " (double)", reference_hits);
+#ifdef ENABLE_STATS
+            std::cout << "  " << double(stats_total(BVH_NODES) - nodes) / all_rays.size() << " nodes/ray, "
+                      << double(stats_total(TRIANGLE_TESTS) - triangles) / all_rays.size() << " triangle tests/ray"
+                      << std::endl;
+#endif
+            bvh_float[k] = run(tree + " (float)", all_rays.size(), 0, [&]() { return bvh_hits(all_rays_float, *mesh); });
+            if (k == 0) reference_float = hits;
+            check_hits(tree + " (float)", reference_float);
+            std::cout << "Speedup of float: " << bvh[k] / bvh_float[k] << "x" << std::endl;
+            bvh_random[k] = run(tree + " (float, incoherent rays)", random_rays.size(), 0,
+                                [&]() { return bvh_hits(random_rays, *mesh); });
+            if (k == 0) reference_random = hits;
+            check_hits(tree + " (float, incoherent rays)", reference_random);
+        }
+        std::cout << "Speedup of the 4-wide BVH: " << bvh[0] / bvh[1] << "x, float: " << bvh_float[0] / bvh_float[1]
+                  << "x" << std::endl;
+        std::cout << "Speedup of the compressed BVH: " << bvh[1] / bvh[2] << "x, float: "
+                  << bvh_float[1] / bvh_float[2] << "x, incoherent rays: " << bvh_random[1] / bvh_random[2] << "x"
+                  << std::endl;
+
+        // Trees of the median builder of the assignment, of the SAH builder and of the
+        // LBVH builder, for a few leaf sizes, traversed by all the camera rays in double
+        std::cout << "BVH builders" << std::endl;
+        std::vector<std::pair<BvhBuilder, int>> builders = {
+            {BvhBuilder::MEDIAN, 1}, {BvhBuilder::SAH, 1}, {BvhBuilder::SAH, 2}, {BvhBuilder::SAH, 4},
+            {BvhBuilder::SAH, 8},    {BvhBuilder::LBVH, 1}, {BvhBuilder::LBVH, 4}};
+        const char *builder_names[] = {"Median", "SAH", "LBVH"};
+        bvh_layout = BvhLayout::BINARY; // Compare the trees of the builders themselves
+        for (const auto &b: builders) {
+            Mesh copy = *mesh;
+            auto start = std::chrono::steady_clock::now();
+            copy.build_bvh(b.first, b.second);
+            double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << builder_names[int(b.first)] << ", leaves of " << b.second
+                      << " triangles: " << copy.bvh.nodes.size() << " nodes, SAH cost " << copy.bvh.sah_cost()
+                      << ", built in " << build * 1000 << "ms" << std::endl;
+#ifdef ENABLE_STATS
+            uint64_t nodes = stats_total(BVH_NODES), triangles = stats_total(TRIANGLE_TESTS);
+#endif
+            run("  Traversal", all_rays.size(), 0, [&]() { return bvh_hits(all_rays, copy); });
+            check_hits(std::string(builder_names[int(b.first)]) + " BVH", reference_hits);
+#ifdef ENABLE_STATS
+            std::cout << "  " << double(stats_total(BVH_NODES) - nodes) / all_rays.size() << " nodes/ray, "
+                      << double(stats_total(TRIANGLE_TESTS) - triangles) / all_rays.size() << " triangle tests/ray"
+                      << std::endl;
+#endif
+        }
+        bvh_layout = layout;
+
+        // Animation: the mesh is twisted a bit more at each frame, and its tree is
+        // refitted, or built again when needed (see Mesh::set_vertices()). The refit
+        // and the build of the tree alone are timed separately.
+        std::cout << "BVH refit" << std::endl;
+        Mesh animated = *mesh;
+        for (int frame = 1; frame <= 8; ++frame) {
+            double twist = 0.25 * frame; // Rotation of the top of the box around the y axis
+            MatrixXd V = mesh->vertices;
+            for (int v = 0; v < V.rows(); ++v) {
+                double a = twist * (V(v, 1) - box.min()(1)) / box.sizes()(1);
+                double x = V(v, 0) - box.center()(0), z = V(v, 2) - box.center()(2);
+                V(v, 0) = box.center()(0) + std::cos(a) * x - std::sin(a) * z;
+                V(v, 2) = box.center()(2) + std::sin(a) * x + std::cos(a) * z;
+            }
+            AABBTree tree = animated.bvh;
+            auto start = std::chrono::steady_clock::now();
+            tree.refit(V, animated.facets, default_thread_count());
+            double refit = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            MatrixXi F = animated.facets;
+            start = std::chrono::steady_clock::now();
+            AABBTree built = animated.bvh_builder == BvhBuilder::LBVH
+                                 ? build_lbvh(V, F, animated.bvh_leaf_size, default_thread_count())
+                                 : build_sah_bvh(V, F, animated.bvh_leaf_size, default_thread_count());
+            double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            bool rebuilt = animated.set_vertices(V);
+            std::cout << "Frame " << frame << ": refit in " << refit * 1000 << "ms, SAH cost " << tree.sah_cost()
+                      << ", built in " << build * 1000 << "ms, SAH cost " << built.sah_cost()
+                      << (rebuilt ? ", built again" : "") << std::endl;
+            run("  Traversal", all_rays.size(), 0, [&]() { return bvh_hits(all_rays, animated); });
+        }
+
+        // Load the file of the mesh again, on one thread and on all of them
+        if (mesh->path.empty()) continue;
+        double megabytes = MappedFile(mesh->path).size / 1048576.0;
+        std::cout << "Mesh loading, " << megabytes << " MB" << std::endl;
+        for (int threads: {1, default_thread_count()}) {
+            MatrixXd V;
+            MatrixXf V_float;
+            MatrixXi F;
+            auto start = std::chrono::steady_clock::now();
+            load_mesh(mesh->path, V, F, threads);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            load_mesh(mesh->path, V_float, F, threads);
+            double seconds_float =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - seconds;
+            std::cout << threads << " thread(s): " << megabytes / seconds << " MB/s, float: "
+                      << megabytes / seconds_float << " MB/s" << std::endl;
+        }
+    }
+
+    std::cout << "Primary rays of the scene, packets of " << packet_width << "x" << packet_width << " pixels"
+              << std::endl;
+    benchmark_packets<double>(scene, config, "double");
+    benchmark_packets<float>(scene, config, "float");
+    if (!consistent) std::cerr << "The trees do not agree on the hits" << std::endl;
+    return consistent;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-Scene load_scene(const std::string &filename) {
+// Settings of the "Render" block that belong to the other ray tracer
+const std::vector<std::string> unsupported_render_keys = {"Denoise", "Aov"};
+
+// Parse the json file of a scene, and append the files it reads to 'inputs'
+Scene parse_scene(const std::string &filename, std::vector<std::string> &inputs) {
     Scene scene;
+    inputs.push_back(filename);
 
     // Load json data from scene file
     json data;
@@ -638,6 +4095,14 @@ Scene load_scene(const std::string &filename) {
     scene.camera.focal_length = data["Camera"]["FocalLength"];
     scene.camera.lens_radius = data["Camera"]["LensRadius"];
 
+    // Read the render settings (optional), on top of the defaults of this assignment
+    scene.render.output = "raytrace.png";
+    scene.render.edge_samples = 8;
+    if (data.count("Render") && !read_render_config(data["Render"], scene.render, unsupported_render_keys))
+        std::cerr << "Invalid render settings in " << filename << " are ignored" << std::endl;
+    // "SceneCache": false also turns off the BVH files of the meshes loaded below
+    if (!scene.render.scene_cache) use_bvh_cache = false;
+
     // Read materials
     for (const auto &entry: data["Materials"]) {
         Material mat;
@@ -658,8 +4123,29 @@ Scene load_scene(const std::string &filename) {
         light.intensity = read_vec3(entry["Color"]);
         scene.lights.push_back(light);
     }
+    scene.light_tree = LightTree(scene.lights);
+    if (data["Scene"].count("LightSamples"))
+        scene.light_samples = data["Scene"]["LightSamples"];
+
+    // Placement of a mesh: "Scale" (a number, or one per axis), then "Rotation"
+    // (angles in degrees around x, then y, then z), then "Position"
+    auto read_transform = [&](const json &entry) {
+        Affine3d transform = Affine3d::Identity();
+        if (entry.count("Position")) transform.translate(read_vec3(entry["Position"]));
+        if (entry.count("Rotation")) {
+            Vector3d angles = read_vec3(entry["Rotation"]) * (M_PI / 180);
+            transform.rotate(AngleAxisd(angles(2), Vector3d::UnitZ()) * AngleAxisd(angles(1), Vector3d::UnitY()) *
+                             AngleAxisd(angles(0), Vector3d::UnitX()));
+        }
+        if (entry.count("Scale")) {
+            if (entry["Scale"].is_number()) transform.scale(double(entry["Scale"]));
+            else transform.scale(read_vec3(entry["Scale"]));
+        }
+        return transform;
+    };
 
     // Read objects
+    std::map<std::string, std::shared_ptr<Mesh>> meshes; // Meshes loaded so far, by file
     for (const auto &entry: data["Objects"]) {
         ObjectPtr object;
         if (entry["Type"] == "Sphere") {
@@ -673,11 +4159,18 @@ Scene load_scene(const std::string &filename) {
             parallelogram->origin = read_vec3(entry["Origin"]);
             parallelogram->u = read_vec3(entry["U"]);
             parallelogram->v = read_vec3(entry["V"]);
+            parallelogram->plane = PlanarPatch(parallelogram->origin, parallelogram->u, parallelogram->v);
             object = parallelogram;
         } else if (entry["Type"] == "Mesh") {
-            // Load mesh from a file
+            // Load mesh from a file, once for all its instances
             std::string filename = std::string(DATA_DIR) + entry["Path"].get<std::string>();
-            object = std::make_shared<Mesh>(filename);
+            std::shared_ptr<Mesh> &mesh = meshes[filename];
+            if (!mesh) {
+                mesh = std::make_shared<Mesh>(filename);
+                scene.meshes.push_back(mesh);
+                inputs.push_back(filename);
+            }
+            object = std::make_shared<MeshInstance>(mesh, read_transform(entry));
         }
         object->material = scene.materials[entry["Material"]];
         scene.objects.push_back(object);
@@ -686,14 +4179,255 @@ Scene load_scene(const std::string &filename) {
     return scene;
 }
 
+// -----------------------------------------------------------------------------
+
+// The scene cache holds the parsed scene (materials, lights, light tree, the meshes
+// with their BVH, and the objects, which refer to the meshes by
+// index) and the hash of the files it was built from. Increment the version
+// whenever the layout of the file or of one of the structs written as raw bytes
+// changes.
+const uint32_t scene_cache_magic = 0x34435452; // "RTC4"
+const uint32_t scene_cache_version = 10;
+
+enum ObjectTag : uint32_t { SPHERE, PARALLELOGRAM, MESH_INSTANCE };
+
+// The BVH file of a mesh holds the hash of the mesh file, the builder settings, the
+// nodes of the tree and the facets in the order of its leaves, which are mapped and
+// copied as they are. Same versioning as the scene cache.
+const uint32_t bvh_cache_magic = 0x34425452; // "RTB4"
+const uint32_t bvh_cache_version = 1;
+
+bool Mesh::save_bvh_cache() const {
+    CacheWriter out;
+    out.write(bvh_cache_magic);
+    out.write(bvh_cache_version);
+    out.write(hash_file(path));
+    out.write(bvh_builder);
+    out.write(bvh_leaf_size);
+    out.write(uint64_t(vertices.rows()));
+    out.write_array(facets.data(), facets.size());
+    out.write_array(bvh.nodes.data(), bvh.nodes.size());
+    out.write(bvh.root);
+    return out.save(bvh_cache_path(path));
+}
+
+// Returns false if there is no BVH file, or if it is outdated
+bool Mesh::load_bvh_cache() {
+    STATS_TIMER("bvh_cache");
+    MappedFile file(bvh_cache_path(path));
+    if (!file.data) return false;
+    CacheReader in(file);
+
+    uint32_t magic, version;
+    uint64_t hash, rows;
+    BvhBuilder builder;
+    int leaf_size;
+    if (!in.read(magic) || magic != bvh_cache_magic) return false;
+    if (!in.read(version) || version != bvh_cache_version) return false;
+    if (!in.read(hash) || hash != hash_file(path)) return false;
+    if (!in.read(builder) || builder != BvhBuilder::SAH || !in.read(leaf_size) || leaf_size != bvh_max_leaf_size)
+        return false;
+    if (!in.read(rows) || rows != uint64_t(vertices.rows())) return false;
+    MatrixXi F(facets.rows(), 3);
+    if (!in.read_array(F.data(), F.size())) return false;
+    AABBTree tree;
+    if (!in.read_vector(tree.nodes) || !in.read(tree.root)) return false;
+    if (F.size() && (F.minCoeff() < 0 || F.maxCoeff() >= vertices.rows())) return false;
+    if (!tree.valid(int(F.rows()))) return false;
+
+    facets.swap(F);
+    bvh = std::move(tree);
+    bvh_builder = builder;
+    bvh_leaf_size = leaf_size;
+    bvh_built_cost = bvh.sah_cost();
+    init_triangles();
+    init_float();
+    return true;
+}
+
+// The cache is written in the working directory, next to the output image
+std::string scene_cache_path(const std::string &filename) {
+    std::string name = filename.substr(filename.find_last_of('/') + 1);
+    return name.substr(0, name.find_last_of('.')) + ".cache";
+}
+
+bool save_scene_cache(const std::string &cache_file, const std::vector<std::string> &inputs, const Scene &scene) {
+    CacheWriter out;
+    out.write(scene_cache_magic);
+    out.write(scene_cache_version);
+    out.write(uint64_t(inputs.size()));
+    for (const auto &input: inputs) {
+        out.write_string(input);
+        out.write(hash_file(input));
+    }
+
+    out.write(scene.background_color);
+    out.write(scene.ambient_light);
+    out.write(scene.camera);
+    save_render_config(out, scene.render);
+    out.write_array(scene.materials.data(), scene.materials.size());
+    out.write_array(scene.lights.data(), scene.lights.size());
+    out.write(scene.light_samples);
+    out.write_array(scene.light_tree.nodes.data(), scene.light_tree.nodes.size());
+    out.write(scene.light_tree.root);
+
+    std::map<const Mesh *, uint64_t> mesh_index;
+    out.write(uint64_t(scene.meshes.size()));
+    for (const auto &mesh: scene.meshes) {
+        uint64_t index = mesh_index.size();
+        mesh_index[mesh.get()] = index;
+        out.write(uint64_t(mesh->vertices.rows()));
+        out.write_array(mesh->vertices.data(), mesh->vertices.size());
+        out.write(uint64_t(mesh->facets.rows()));
+        out.write_array(mesh->facets.data(), mesh->facets.size());
+        out.write_array(mesh->bvh.nodes.data(), mesh->bvh.nodes.size());
+        out.write(mesh->bvh.root);
+        out.write_string(mesh->path);
+    }
+
+    out.write(uint64_t(scene.objects.size()));
+    for (const auto &obj: scene.objects) {
+        if (auto sphere = std::dynamic_pointer_cast<Sphere>(obj)) {
+            out.write(SPHERE);
+            out.write(sphere->position);
+            out.write(sphere->radius);
+        } else if (auto parallelogram = std::dynamic_pointer_cast<Parallelogram>(obj)) {
+            out.write(PARALLELOGRAM);
+            out.write(parallelogram->origin);
+            out.write(parallelogram->u);
+            out.write(parallelogram->v);
+            out.write(parallelogram->plane);
+        } else if (auto instance = std::dynamic_pointer_cast<MeshInstance>(obj)) {
+            out.write(MESH_INSTANCE);
+            out.write(mesh_index.at(instance->mesh.get()));
+            out.write(instance->transform);
+        } else {
+            return false;
+        }
+        out.write(obj->material);
+    }
+    return out.save(cache_file);
+}
+
+// Returns false if there is no cache, or if it is outdated
+bool load_scene_cache(const std::string &cache_file, Scene &scene) {
+    MappedFile file(cache_file);
+    if (!file.data) return false;
+    CacheReader in(file);
+
+    uint32_t magic, version;
+    if (!in.read(magic) || magic != scene_cache_magic) return false;
+    if (!in.read(version) || version != scene_cache_version) return false;
+    uint64_t n;
+    if (!in.read(n)) return false;
+    for (uint64_t i = 0; i < n; ++i) {
+        std::string input;
+        uint64_t hash;
+        if (!in.read_string(input) || !in.read(hash) || hash != hash_file(input)) return false;
+    }
+
+    bool ok = in.read(scene.background_color) && in.read(scene.ambient_light) && in.read(scene.camera) &&
+              load_render_config(in, scene.render) && in.read_vector(scene.materials) && in.read_vector(scene.lights) && in.read(scene.light_samples) &&
+              in.read_vector(scene.light_tree.nodes) && in.read(scene.light_tree.root) && in.read(n);
+    for (uint64_t i = 0; ok && i < n; ++i) {
+        auto mesh = std::make_shared<Mesh>();
+        uint64_t rows = 0; // Bounded by the size of the file, before the matrices are allocated
+        ok = in.read(rows) && rows <= file.size;
+        mesh->vertices.resize(ok ? rows : 0, 3);
+        ok = ok && in.read_array(mesh->vertices.data(), mesh->vertices.size()) && in.read(rows) && rows <= file.size;
+        mesh->facets.resize(ok ? rows : 0, 3);
+        ok = ok && in.read_array(mesh->facets.data(), mesh->facets.size()) && in.read_vector(mesh->bvh.nodes) &&
+             in.read(mesh->bvh.root) && in.read_string(mesh->path);
+        ok = ok && (!mesh->facets.size() || (mesh->facets.minCoeff() >= 0 && mesh->facets.maxCoeff() < mesh->vertices.rows())) &&
+             mesh->bvh.valid(int(mesh->facets.rows()));
+        if (!ok) break;
+        mesh->bvh_built_cost = mesh->bvh.sah_cost();
+        mesh->init_triangles();
+        mesh->init_float();
+        scene.meshes.push_back(mesh);
+    }
+
+    ok = ok && in.read(n);
+    for (uint64_t i = 0; ok && i < n; ++i) {
+        ObjectTag tag;
+        ObjectPtr object;
+        if (!in.read(tag)) return false;
+        if (tag == SPHERE) {
+            auto sphere = std::make_shared<Sphere>();
+            ok = in.read(sphere->position) && in.read(sphere->radius);
+            object = sphere;
+        } else if (tag == PARALLELOGRAM) {
+            auto parallelogram = std::make_shared<Parallelogram>();
+            ok = in.read(parallelogram->origin) && in.read(parallelogram->u) && in.read(parallelogram->v) &&
+                 in.read(parallelogram->plane);
+            object = parallelogram;
+        } else if (tag == MESH_INSTANCE) {
+            uint64_t mesh;
+            Affine3d transform;
+            ok = in.read(mesh) && mesh < scene.meshes.size() && in.read(transform);
+            if (!ok) return false;
+            object = std::make_shared<MeshInstance>(scene.meshes[mesh], transform);
+        } else {
+            return false;
+        }
+        ok = ok && in.read(object->material);
+        scene.objects.push_back(object);
+    }
+    return ok;
+}
+
+Scene load_scene(const std::string &filename) {
+    STATS_TIMER("scene_load");
+    std::string cache_file = scene_cache_path(filename);
+    auto start = std::chrono::steady_clock::now();
+    if (use_scene_cache) {
+        Scene scene;
+        if (load_scene_cache(cache_file, scene)) {
+            build_object_bvh(scene);
+            std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+            std::cout << "Scene loaded from " << cache_file << " in " << time.count() << "ms" << std::endl;
+            return scene;
+        }
+    }
+
+    std::vector<std::string> inputs;
+    Scene scene = parse_scene(filename, inputs);
+    build_object_bvh(scene);
+    std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+    std::cout << "Scene loaded from " << filename << " in " << time.count() << "ms" << std::endl;
+    if (use_scene_cache && scene.render.scene_cache && !save_scene_cache(cache_file, inputs, scene))
+        std::cerr << "Could not write the scene cache " << cache_file << std::endl;
+    return scene;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " scene.json" << std::endl;
+    json args;
+    if (argc < 2 || !parse_render_args(argc, argv, 2, args) || !check_render_keys(args, unsupported_render_keys)) {
+        std::cerr << "Usage: " << argv[0] << " scene.json " << render_flags_usage(unsupported_render_keys)
+                  << std::endl;
+        std::cerr << "  --float: trace the rays in float instead of double" << std::endl;
+        std::cerr << "  --bench: benchmark the ray/triangle tests instead of rendering" << std::endl;
+        std::cerr << "  --banded: stream the image to the output file (.ppm or .pfm) band by band" << std::endl;
+        std::cerr << "  --wavefront: trace the rays stage by stage from sorted queues instead of depth-first" << std::endl;
         return 1;
     }
+    if (args.count("SceneCache"))
+        use_scene_cache = use_bvh_cache = args["SceneCache"];
     Scene scene = load_scene(argv[1]);
-    render_scene(scene);
+
+    // The command line flags override the settings of the scene file
+    RenderConfig config = scene.render;
+    if (!read_render_config(args, config, unsupported_render_keys)) return 1;
+    if (config.bench) {
+        return benchmark_intersection(scene, config) ? 0 : 1;
+    }
+    if (config.banded) {
+        if (!render_scene_banded(scene, config)) return 1;
+    } else {
+        render_scene(scene, config);
+    }
+    STATS_REPORT("stats.json", render_threads(config));
     return 0;
 }
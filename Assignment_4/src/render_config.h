@@ -0,0 +1,205 @@
+#ifndef RENDER_CONFIG_H
+#define RENDER_CONFIG_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+// Render settings. They are read, in this order of priority, from the command line
+// flags, from the optional "Render" block of the scene file, and from the defaults
+// of the assignment (set by load_scene()).
+struct RenderConfig {
+	int width = 640;
+	int height = 480;
+	int samples = 1;     // Samples per pixel (average number for adaptive sampling)
+	int max_bounce = 5;  // Number of reflections
+	int tile_size = 16;  // Pixels are distributed to the threads in tiles of tile_size x tile_size
+	int threads = 0;     // 0 for one thread per core
+	std::string output;  // Image file
+	bool single_precision = false; // Trace the rays in float (preview) instead of double
+	int edge_samples = 0; // Extra samples of the pixels on the edges of the image, 0 to disable
+	int denoise = 0;      // Passes of the a-trous denoiser, 0 to disable
+	bool aov = false;     // Save the auxiliary buffers (normal, albedo, depth, object) of the first frame
+
+	bool scene_cache = true; // See load_scene_cache()
+	bool bench = false;      // Run the intersection benchmark instead of rendering
+	bool banded = false;     // Stream the image to the output file band by band
+	bool wavefront = false;  // Trace the rays of each band stage by stage from queues instead of depth-first
+};
+
+// Keys of the "Render" block, with their command line flags
+const char *render_flags[][2] = {
+	{"Width", "--width N"},     {"Height", "--height N"},   {"Samples", "--spp N"},
+	{"Bounces", "--bounces N"}, {"TileSize", "--tile N"},   {"Threads", "--threads N"},
+	{"Output", "--output file"}, {"SceneCache", "--no-cache"}, {"Float", "--float"},
+	{"EdgeSamples", "--edge-samples N"}, {"Denoise", "--denoise N"}, {"Aov", "--aov"},
+	{"Bench", "--bench"},       {"Banded", "--banded"},     {"Wavefront", "--wavefront"}};
+
+bool is_render_key(const std::vector<std::string> &keys, const std::string &key) {
+	return std::find(keys.begin(), keys.end(), key) != keys.end();
+}
+
+// Flags of the settings that the ray tracer supports, all but the keys 'unsupported'
+std::string render_flags_usage(const std::vector<std::string> &unsupported) {
+	std::string usage;
+	for (const auto &flag: render_flags)
+		if (!is_render_key(unsupported, flag[0])) usage += std::string(usage.empty() ? "" : " ") + "[" + flag[1] + "]";
+	return usage;
+}
+
+// Print a warning for each key of 'block' that is unknown or listed in 'unsupported'
+// (the settings of the other ray tracer). Returns false if there is one.
+bool check_render_keys(const nlohmann::json &block, const std::vector<std::string> &unsupported) {
+	bool supported = true;
+	for (auto it = block.begin(); it != block.end(); ++it) {
+		bool known = false;
+		for (const auto &flag: render_flags)
+			known = known || it.key() == flag[0];
+		if (known && !is_render_key(unsupported, it.key())) continue;
+		std::cerr << "Render setting \"" << it.key() << "\" is " << (known ? "not supported by this ray tracer" : "unknown")
+		          << std::endl;
+		supported = false;
+	}
+	return supported;
+}
+
+// Read the integer 'key' of 'block' into 'value', if it is at least 'min'
+bool read_render_int(const nlohmann::json &block, const char *key, int min, int &value) {
+	const nlohmann::json &x = block[key];
+	if (!x.is_number_integer() || x < min || x > std::numeric_limits<int>::max()) {
+		std::cerr << key << " must be an integer of at least " << min << std::endl;
+		return false;
+	}
+	value = x;
+	return true;
+}
+
+bool read_render_bool(const nlohmann::json &block, const char *key, bool &value) {
+	if (!block[key].is_boolean()) {
+		std::cerr << key << " must be true or false" << std::endl;
+		return false;
+	}
+	value = block[key];
+	return true;
+}
+
+// Override the settings present in a json object with the keys of the "Render" block:
+// { "Width": 640, "Height": 480, "Samples": 1, "Bounces": 5, "TileSize": 16,
+//   "Threads": 0, "Output": "out.png", "Float": false, "EdgeSamples": 0, "Denoise": 0,
+//   "Aov": false }
+// The keys 'unsupported' and the unknown keys are ignored with a warning. Returns
+// false, keeping the previous value, if a setting has the wrong type or is out of range.
+bool read_render_config(const nlohmann::json &block, RenderConfig &config, const std::vector<std::string> &unsupported) {
+	check_render_keys(block, unsupported);
+	auto has = [&](const char *key) { return block.count(key) && !is_render_key(unsupported, key); };
+	bool valid = true;
+	if (has("Width")) valid = read_render_int(block, "Width", 1, config.width) && valid;
+	if (has("Height")) valid = read_render_int(block, "Height", 1, config.height) && valid;
+	if (has("Samples")) valid = read_render_int(block, "Samples", 1, config.samples) && valid;
+	if (has("Bounces")) valid = read_render_int(block, "Bounces", 0, config.max_bounce) && valid;
+	if (has("TileSize")) valid = read_render_int(block, "TileSize", 1, config.tile_size) && valid;
+	if (has("Threads")) valid = read_render_int(block, "Threads", 0, config.threads) && valid;
+	if (has("Output")) {
+		if (block["Output"].is_string() && !block["Output"].get<std::string>().empty()) {
+			config.output = block["Output"].get<std::string>();
+		} else {
+			std::cerr << "Output must be a file name" << std::endl;
+			valid = false;
+		}
+	}
+	if (has("Float")) valid = read_render_bool(block, "Float", config.single_precision) && valid;
+	if (has("EdgeSamples")) valid = read_render_int(block, "EdgeSamples", 0, config.edge_samples) && valid;
+	if (has("Denoise")) valid = read_render_int(block, "Denoise", 0, config.denoise) && valid;
+	if (has("Aov")) valid = read_render_bool(block, "Aov", config.aov) && valid;
+	if (has("SceneCache")) valid = read_render_bool(block, "SceneCache", config.scene_cache) && valid;
+	if (has("Bench")) valid = read_render_bool(block, "Bench", config.bench) && valid;
+	if (has("Banded")) valid = read_render_bool(block, "Banded", config.banded) && valid;
+	if (has("Wavefront")) valid = read_render_bool(block, "Wavefront", config.wavefront) && valid;
+	return valid;
+}
+
+// Write all the settings to the scene cache 'out' (a CacheWriter), in the order
+// read back by load_render_config(). A new setting must be added to both, and the
+// versions of the scene caches incremented.
+template <typename Writer>
+void save_render_config(Writer &out, const RenderConfig &config) {
+	out.write(config.width);
+	out.write(config.height);
+	out.write(config.samples);
+	out.write(config.max_bounce);
+	out.write(config.tile_size);
+	out.write(config.threads);
+	out.write_string(config.output);
+	out.write(config.single_precision);
+	out.write(config.edge_samples);
+	out.write(config.denoise);
+	out.write(config.aov);
+	out.write(config.scene_cache);
+	out.write(config.bench);
+	out.write(config.banded);
+	out.write(config.wavefront);
+}
+
+// Read the settings written by save_render_config() from 'in' (a CacheReader)
+template <typename Reader>
+bool load_render_config(Reader &in, RenderConfig &config) {
+	return in.read(config.width) && in.read(config.height) && in.read(config.samples) && in.read(config.max_bounce) &&
+	       in.read(config.tile_size) && in.read(config.threads) && in.read_string(config.output) &&
+	       in.read(config.single_precision) && in.read(config.edge_samples) && in.read(config.denoise) &&
+	       in.read(config.aov) && in.read(config.scene_cache) && in.read(config.bench) && in.read(config.banded) &&
+	       in.read(config.wavefront);
+}
+
+// Convert the command line flags argv[first..argc-1] to a json object with the keys
+// of the "Render" block, to be applied with read_render_config(). Returns false if
+// a flag is unknown, or misses its value, or if the value of a flag is not an integer.
+bool parse_render_args(int argc, char *argv[], int first, nlohmann::json &args) {
+	const char *int_flags[][2] = {{"--width", "Width"}, {"--height", "Height"}, {"--spp", "Samples"},
+	                              {"--bounces", "Bounces"}, {"--tile", "TileSize"}, {"--threads", "Threads"},
+	                              {"--edge-samples", "EdgeSamples"}, {"--denoise", "Denoise"}};
+	args = nlohmann::json::object();
+	for (int i = first; i < argc; ++i) {
+		std::string flag = argv[i];
+		bool known = false;
+		for (const auto &f: int_flags) {
+			if (flag != f[0]) continue;
+			if (i + 1 >= argc) return false;
+			char *end;
+			long value = std::strtol(argv[++i], &end, 10);
+			if (end == argv[i] || *end || value < std::numeric_limits<int>::min() ||
+			    value > std::numeric_limits<int>::max()) {
+				std::cerr << "Invalid value " << argv[i] << " for " << flag << std::endl;
+				return false;
+			}
+			args[f[1]] = int(value);
+			known = true;
+		}
+		if (flag == "--output") {
+			if (i + 1 >= argc) return false;
+			args["Output"] = argv[++i];
+		} else if (flag == "--float") {
+			args["Float"] = true;
+		} else if (flag == "--aov") {
+			args["Aov"] = true;
+		} else if (flag == "--no-cache") {
+			args["SceneCache"] = false;
+		} else if (flag == "--bench") {
+			args["Bench"] = true;
+		} else if (flag == "--banded") {
+			args["Banded"] = true;
+		} else if (flag == "--wavefront") {
+			args["Wavefront"] = true;
+		} else if (!known) {
+			std::cerr << "Unknown flag " << flag << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
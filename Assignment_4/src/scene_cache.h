@@ -0,0 +1,128 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Building blocks of the binary scene cache. A cache file is a sequence of raw
+// values and arrays (each array is its size followed by its elements, aligned on 8
+// bytes), written and read back in the same order by save_scene_cache() and
+// load_scene_cache(). The file is memory-mapped when it is read.
+
+// 64 bit hash of a buffer, 8 bytes at a time (FNV-1a style with a murmur3 mix)
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ull) {
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+	for (; size >= 8; size -= 8, p += 8) {
+		uint64_t x;
+		memcpy(&x, p, 8);
+		h = (h ^ x) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for (; size > 0; --size, ++p)
+		h = (h ^ *p) * 0x100000001b3ull;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+// Hash of the content of a file (0 if the file cannot be read)
+uint64_t hash_file(const std::string &filename) {
+	MappedFile file(filename);
+	return file.data ? hash_bytes(file.data, file.size) : 0;
+}
+
+struct CacheWriter {
+	std::vector<char> buffer;
+
+	template <typename T>
+	void write(const T &x) {
+		const char *p = reinterpret_cast<const char *>(&x);
+		buffer.insert(buffer.end(), p, p + sizeof(T));
+	}
+
+	template <typename T>
+	void write_array(const T *x, uint64_t n) {
+		write(n);
+		const char *p = reinterpret_cast<const char *>(x);
+		buffer.insert(buffer.end(), p, p + n * sizeof(T));
+		buffer.resize((buffer.size() + 7) / 8 * 8, 0);
+	}
+
+	void write_string(const std::string &s) {
+		write_array(s.data(), s.size());
+	}
+
+	// Write to a temporary file first, so that a reader never sees a partial file
+	bool save(const std::string &filename) const {
+		std::string tmp = filename + ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::binary);
+			out.write(buffer.data(), buffer.size());
+			if (!out) return false;
+		}
+		return std::rename(tmp.c_str(), filename.c_str()) == 0;
+	}
+};
+
+struct CacheReader {
+	const char *begin;
+	const char *cursor;
+	const char *end;
+
+	CacheReader(const MappedFile &file) : begin(file.data), cursor(file.data), end(file.data + file.size) {}
+
+	template <typename T>
+	bool read(T &x) {
+		if (size_t(end - cursor) < sizeof(T)) return false;
+		memcpy(reinterpret_cast<char *>(&x), cursor, sizeof(T));
+		cursor += sizeof(T);
+		return true;
+	}
+
+	// Pointer to the 'n' elements of an array, in place in the mapped file
+	template <typename T>
+	const T *view_array(uint64_t &n) {
+		if (!read(n) || n > size_t(end - cursor) / sizeof(T)) return nullptr;
+		const T *p = reinterpret_cast<const T *>(cursor);
+		size_t offset = (cursor - begin + n * sizeof(T) + 7) / 8 * 8;
+		cursor = begin + std::min(offset, size_t(end - begin));
+		return p;
+	}
+
+	template <typename T>
+	bool read_array(T *x, uint64_t n) {
+		uint64_t m;
+		const T *p = view_array<T>(m);
+		if (!p || m != n) return false;
+		memcpy(reinterpret_cast<char *>(x), p, n * sizeof(T));
+		return true;
+	}
+
+	template <typename T>
+	bool read_vector(std::vector<T> &x) {
+		uint64_t n;
+		const T *p = view_array<T>(n);
+		if (!p) return false;
+		x.resize(n);
+		memcpy(reinterpret_cast<char *>(x.data()), p, n * sizeof(T));
+		return true;
+	}
+
+	bool read_string(std::string &s) {
+		uint64_t n;
+		const char *p = view_array<char>(n);
+		if (!p) return false;
+		s.assign(p, n);
+		return true;
+	}
+};
+
+#endif
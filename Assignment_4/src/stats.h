@@ -0,0 +1,135 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Instrumentation of the ray tracer: per-thread event counters and timers of the
+// main stages, written to a json report by write_stats_report(). Configure with
+// -DENABLE_STATS=OFF to compile all of it out (the macros expand to nothing).
+
+#ifdef ENABLE_STATS
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+enum StatsCounter {
+	CAMERA_RAYS,     // Primary rays
+	SHADOW_RAYS,     // Rays traced towards a light
+	REFLECTION_RAYS, // Mirror rays
+	BOX_TESTS,       // Ray/box tests in the BVH
+	TRIANGLE_TESTS,  // Ray/triangle tests
+	BVH_NODES,       // BVH nodes visited
+	STATS_COUNTERS
+};
+
+const char *stats_counter_names[STATS_COUNTERS] = {
+	"camera_rays", "shadow_rays", "reflection_rays", "box_tests", "triangle_tests", "bvh_nodes"};
+
+// Counters of one thread, aligned so that the threads never write to the same cache
+// line. parallel_for() starts new threads at every call, so the counters of a thread
+// are added to 'retired_stats' when it exits, and only the running threads keep one.
+struct alignas(64) ThreadStats {
+	uint64_t counters[STATS_COUNTERS] = {};
+
+	ThreadStats();
+	~ThreadStats();
+};
+
+std::mutex stats_mutex;
+std::vector<ThreadStats *> thread_stats_list;    // Counters of the running threads
+uint64_t retired_stats[STATS_COUNTERS] = {};     // Total of the threads that have exited
+std::map<std::string, double> stats_timers;      // Seconds spent in each stage
+
+ThreadStats::ThreadStats() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	thread_stats_list.push_back(this);
+}
+
+ThreadStats::~ThreadStats() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	for (int c = 0; c < STATS_COUNTERS; ++c)
+		retired_stats[c] += counters[c];
+	thread_stats_list.erase(std::find(thread_stats_list.begin(), thread_stats_list.end(), this));
+}
+
+// A plain pointer needs no thread_local guard, and keeps the counters cheap
+thread_local ThreadStats *local_thread_stats = nullptr;
+
+inline ThreadStats &thread_stats() {
+	if (!local_thread_stats) {
+		thread_local ThreadStats stats;
+		local_thread_stats = &stats;
+	}
+	return *local_thread_stats;
+}
+
+// Add the time between its construction and its destruction to the timer 'name'
+struct ScopedTimer {
+	std::string name;
+	std::chrono::steady_clock::time_point start;
+
+	ScopedTimer(const std::string &n) : name(n), start(std::chrono::steady_clock::now()) {}
+
+	~ScopedTimer() {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		stats_timers[name] += seconds;
+	}
+};
+
+// Total of a counter over all the threads
+uint64_t stats_total(StatsCounter counter) {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	uint64_t total = retired_stats[counter];
+	for (const ThreadStats *stats: thread_stats_list)
+		total += stats->counters[counter];
+	return total;
+}
+
+// 'threads' is the number of render threads (the workers of each parallel loop
+// are new threads)
+void write_stats_report(const std::string &filename, int threads) {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	uint64_t total[STATS_COUNTERS];
+	std::copy(retired_stats, retired_stats + STATS_COUNTERS, total);
+	for (const ThreadStats *stats: thread_stats_list)
+		for (int c = 0; c < STATS_COUNTERS; ++c)
+			total[c] += stats->counters[c];
+
+	nlohmann::json report;
+	for (int c = 0; c < STATS_COUNTERS; ++c)
+		report["counters"][stats_counter_names[c]] = total[c];
+	uint64_t rays = total[CAMERA_RAYS] + total[SHADOW_RAYS] + total[REFLECTION_RAYS];
+	report["bvh_nodes_per_ray"] = double(total[BVH_NODES]) / std::max<uint64_t>(rays, 1);
+	report["triangle_tests_per_ray"] = double(total[TRIANGLE_TESTS]) / std::max<uint64_t>(rays, 1);
+	report["threads"] = threads;
+	for (const auto &timer: stats_timers)
+		report["timers"][timer.first] = timer.second;
+
+	std::ofstream out(filename);
+	out << report.dump(4) << std::endl;
+}
+
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define STATS_INC(counter) (thread_stats().counters[counter]++)
+#define STATS_ADD(counter, n) (thread_stats().counters[counter] += (n))
+#define STATS_TIMER(name) ScopedTimer STATS_CONCAT(stats_timer_, __LINE__)(name)
+#define STATS_REPORT(filename, threads) write_stats_report(filename, threads)
+
+#else
+
+#define STATS_INC(counter) ((void) 0)
+#define STATS_ADD(counter, n) ((void) 0)
+#define STATS_TIMER(name) ((void) 0)
+#define STATS_REPORT(filename, threads) ((void) 0)
+
+#endif
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <Eigen/Dense>
 #include <algorithm>
+#include <fstream>
+#include <string>
 #include <vector>
 
 unsigned char double_to_unsignedchar(const double d) {
@@ -49,4 +51,48 @@ void write_matrix_to_png(
 
 }
 
+// Write an image row by row to a binary PPM (8 bits per channel, clamped like the
+// png output) or PFM (32 bit floats) file, so that it never has to be held in
+// memory as a whole. PFM files store their rows from the bottom to the top.
+struct ScanlineWriter {
+	std::ofstream out;
+	int width;
+	bool pfm;       // PFM if the filename ends with .pfm, PPM if it ends with .ppm
+	bool bottom_up; // Rows must be written from the last one to the first one
+
+	static bool has_extension(const std::string &filename, const char *extension) {
+		return filename.size() >= 4 && filename.compare(filename.size() - 4, 4, extension) == 0;
+	}
+
+	// Whether 'filename' is a .ppm or a .pfm file, the only formats written row by row
+	static bool supports(const std::string &filename) {
+		return has_extension(filename, ".ppm") || has_extension(filename, ".pfm");
+	}
+
+	ScanlineWriter(const std::string &filename, int w, int h) : out(filename, std::ios::binary), width(w) {
+		pfm = has_extension(filename, ".pfm");
+		bottom_up = pfm;
+		if (pfm)
+			out << "PF\n" << w << " " << h << "\n-1.0\n"; // Negative scale: little endian
+		else
+			out << "P6\n" << w << " " << h << "\n255\n";
+	}
+
+	// Append 'rows' rows of 'width' RGB values
+	void write_rows(const double *rgb, int rows) {
+		size_t n = size_t(width) * rows * 3;
+		if (pfm) {
+			std::vector<float> floats(rgb, rgb + n);
+			out.write(reinterpret_cast<const char *>(floats.data()), n * sizeof(float));
+		} else {
+			std::vector<uint8_t> bytes(n);
+			for (size_t i = 0; i < n; ++i)
+				bytes[i] = double_to_unsignedchar(rgb[i]);
+			out.write(reinterpret_cast<const char *>(bytes.data()), n);
+		}
+	}
+
+	explicit operator bool() const { return bool(out); }
+};
+
 #endif
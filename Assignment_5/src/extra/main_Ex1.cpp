@@ -8,6 +8,7 @@
 
 // Utilities for the Assignment
 #include "raster.h"
+#include "mesh_io.h"
 
 // Image writing library
 #define STB_IMAGE_WRITE_IMPLEMENTATION // Do not include this line twice in your project!
@@ -16,25 +17,6 @@
 
 using namespace std;
 
-// Read a triangle mesh from an off file
-void load_off(const std::string &filename, Eigen::MatrixXd &V, Eigen::MatrixXi &F) {
-    std::ifstream in(filename);
-    std::string token;
-    in >> token;
-    int nv, nf, ne;
-    in >> nv >> nf >> ne;
-    V.resize(nv, 3);
-    F.resize(nf, 3);
-    for (int i = 0; i < nv; ++i) {
-        in >> V(i, 0) >> V(i, 1) >> V(i, 2);
-    }
-    for (int i = 0; i < nf; ++i) {
-        int s;
-        in >> s >> F(i, 0) >> F(i, 1) >> F(i, 2);
-        assert(s == 3);
-    }
-}
-
 int main() {
 
     // The Framebuffer storing the image rendered by the rasterizer
@@ -67,7 +49,7 @@ int main() {
     vector<VertexAttributes> vertices;
     Eigen::MatrixXd V;
     Eigen::MatrixXi F;
-    load_off("../data/bunny.off", V, F);
+    if (!load_mesh("../data/bunny.off", V, F)) return 1;
 
     for (int i = 0; i < F.rows(); ++i) {
         vertices.push_back(VertexAttributes(V(F(i, 0), 0), V(F(i, 0), 1), V(F(i, 0), 2)));
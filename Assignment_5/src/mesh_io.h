@@ -0,0 +1,714 @@
+#ifndef MESH_IO_H
+#define MESH_IO_H
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "parallel.h"
+
+// Readers of triangle meshes in the OFF, OBJ and binary PLY formats, loaded into
+// a #vertices x 3 matrix of positions (MatrixXd or MatrixXf) and a #triangles x 3
+// matrix of vertex indices. Polygons are split into fans of triangles.
+//
+// The file is memory-mapped. The text formats are cut into chunks of whole lines,
+// and each pass over the chunks runs on several threads: the first one counts the
+// lines (vertices, faces) of every chunk, which gives each chunk the rows it writes,
+// and the next ones parse the chunks in place. The readers print the reason of a
+// failure to std::cerr and return false.
+
+// --- Numbers
+
+inline bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline void skip_blanks(const char *&p, const char *end) {
+	while (p < end && is_blank(*p)) ++p;
+}
+
+// Powers of ten that are exact in the floating point type: a mantissa that is also
+// exact, multiplied or divided by one of them, is correctly rounded (Clinger 1990)
+template <typename Scalar>
+struct ExactPowers;
+
+template <>
+struct ExactPowers<double> {
+	static constexpr uint64_t max_mantissa = uint64_t(1) << 53;
+	static constexpr int max_exponent = 22;
+	static double pow10(int e) {
+		static const double p[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		                           1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+		return p[e];
+	}
+	static double parse(const char *s, char **end) { return std::strtod(s, end); }
+};
+
+template <>
+struct ExactPowers<float> {
+	static constexpr uint64_t max_mantissa = uint64_t(1) << 24;
+	static constexpr int max_exponent = 10;
+	static float pow10(int e) {
+		static const float p[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+		return p[e];
+	}
+	static float parse(const char *s, char **end) { return std::strtof(s, end); }
+};
+
+// Parse a real number at p, after blanks, and move p past it. The short decimals
+// of mesh files take the exact path, the other ones (long mantissas, large
+// exponents, inf, nan) go through strtod or strtof: both give the same value.
+template <typename Scalar>
+bool parse_real(const char *&p, const char *end, Scalar &x) {
+	typedef ExactPowers<Scalar> Powers;
+	skip_blanks(p, end);
+	const char *start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0;
+	bool exact = true;
+	for (; p < end && unsigned(*p - '0') < 10; ++p, ++digits) {
+		if (mantissa < Powers::max_mantissa) mantissa = mantissa * 10 + (*p - '0');
+		else exact = false;
+	}
+	if (p < end && *p == '.') {
+		for (++p; p < end && unsigned(*p - '0') < 10; ++p, ++digits) {
+			if (mantissa < Powers::max_mantissa) {
+				mantissa = mantissa * 10 + (*p - '0');
+				--exponent;
+			} else if (*p != '0') {
+				exact = false;
+			}
+		}
+	}
+	if (digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negative_exponent = false;
+		if (q < end && (*q == '-' || *q == '+')) negative_exponent = *q++ == '-';
+		if (q < end && unsigned(*q - '0') < 10) {
+			int e = 0;
+			for (; q < end && unsigned(*q - '0') < 10; ++q)
+				e = std::min(e * 10 + (*q - '0'), 100000);
+			exponent += negative_exponent ? -e : e;
+			p = q;
+		}
+	}
+
+	if (digits > 0 && exact && mantissa <= Powers::max_mantissa && std::abs(exponent) <= Powers::max_exponent) {
+		Scalar value = Scalar(mantissa);
+		if (mantissa != 0) value = exponent < 0 ? value / Powers::pow10(-exponent) : value * Powers::pow10(exponent);
+		x = negative ? -value : value;
+		return true;
+	}
+
+	// Slow path, on a null-terminated copy of the token
+	const char *token_end = start;
+	while (token_end < end && !is_blank(*token_end) && *token_end != '\n') ++token_end;
+	char buffer[128];
+	size_t length = token_end - start;
+	if (length == 0 || length >= sizeof(buffer)) return false;
+	memcpy(buffer, start, length);
+	buffer[length] = 0;
+	char *parsed;
+	x = Powers::parse(buffer, &parsed);
+	if (parsed == buffer) return false;
+	p = start + (parsed - buffer);
+	return true;
+}
+
+// Parse a decimal integer at p, after blanks, and move p past it
+bool parse_integer(const char *&p, const char *end, long long &x) {
+	skip_blanks(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	if (p == end || unsigned(*p - '0') >= 10) return false;
+	long long value = 0;
+	for (; p < end && unsigned(*p - '0') < 10; ++p)
+		value = std::min(value * 10 + (*p - '0'), 1ll << 40);
+	x = negative ? -value : value;
+	return true;
+}
+
+// --- Chunks of lines
+
+// A piece of the file made of whole lines, with its counts and the counts of the
+// chunks before it (the rows of the matrices it writes)
+struct TextChunk {
+	const char *begin = nullptr;
+	const char *end = nullptr;
+	size_t lines = 0;
+	size_t items = 0;     // Vertices, or data lines of an OFF file
+	size_t triangles = 0;
+	size_t first_line = 0;
+	size_t first_item = 0;
+	size_t first_triangle = 0;
+	size_t error_line = 0; // Line of the error in the chunk
+	std::string error;
+};
+
+// Split [begin, end) into chunks of about 1MB, at least a few per thread
+std::vector<TextChunk> split_lines(const char *begin, const char *end, int threads) {
+	size_t size = end - begin;
+	size_t n = std::max<size_t>(1, std::min<size_t>(size >> 20, size_t(threads) * 8));
+	std::vector<TextChunk> chunks;
+	const char *p = begin;
+	for (size_t i = 1; i <= n && p < end; ++i) {
+		const char *q = i == n ? end : std::max(p, begin + size * i / n);
+		const char *newline = q < end ? static_cast<const char *>(memchr(q, '\n', end - q)) : nullptr;
+		q = newline ? newline + 1 : end;
+		TextChunk chunk;
+		chunk.begin = p;
+		chunk.end = q;
+		chunks.push_back(chunk);
+		p = q;
+	}
+	if (chunks.empty()) {
+		chunks.emplace_back();
+		chunks.back().begin = chunks.back().end = end;
+	}
+	return chunks;
+}
+
+void accumulate_chunks(std::vector<TextChunk> &chunks) {
+	for (size_t i = 1; i < chunks.size(); ++i) {
+		chunks[i].first_line = chunks[i - 1].first_line + chunks[i - 1].lines;
+		chunks[i].first_item = chunks[i - 1].first_item + chunks[i - 1].items;
+		chunks[i].first_triangle = chunks[i - 1].first_triangle + chunks[i - 1].triangles;
+	}
+}
+
+// Print the first error of the chunks, if any. 'line' is the number of lines
+// before the first chunk.
+bool chunk_error(const std::vector<TextChunk> &chunks, const std::string &filename, size_t line = 0) {
+	for (const TextChunk &chunk: chunks) {
+		if (chunk.error.empty()) continue;
+		std::cerr << filename << ":" << line + chunk.first_line + chunk.error_line + 1 << ": " << chunk.error
+		          << std::endl;
+		return true;
+	}
+	return false;
+}
+
+// Call f(p, eol, line) for every line of the chunk, until f returns false
+template <typename F>
+void for_each_line(const TextChunk &chunk, const F &f) {
+	size_t line = 0;
+	for (const char *p = chunk.begin; p < chunk.end; ++line) {
+		const char *eol = static_cast<const char *>(memchr(p, '\n', chunk.end - p));
+		if (!eol) eol = chunk.end;
+		if (!f(p, eol, line)) return;
+		p = eol < chunk.end ? eol + 1 : chunk.end;
+	}
+}
+
+// A line that is neither blank nor a comment (p is moved to its first character)
+inline bool is_data_line(const char *&p, const char *eol) {
+	skip_blanks(p, eol);
+	return p < eol && *p != '#';
+}
+
+// --- OFF
+
+// Skip blanks, line breaks and comments
+void skip_off_space(const char *&p, const char *end) {
+	while (p < end) {
+		if (is_blank(*p) || *p == '\n') ++p;
+		else if (*p == '#') while (p < end && *p != '\n') ++p;
+		else break;
+	}
+}
+
+template <typename MatrixV>
+bool load_off(const std::string &filename, MatrixV &V, Eigen::MatrixXi &F, int threads = default_thread_count()) {
+	typedef typename MatrixV::Scalar Scalar;
+	MappedFile file(filename);
+	if (!file.data) {
+		std::cerr << "Could not read " << filename << std::endl;
+		return false;
+	}
+	const char *p = file.data, *end = file.data + file.size;
+
+	// Header: OFF (or a variant such as COFF), then the numbers of vertices, faces and edges
+	skip_off_space(p, end);
+	const char *keyword = p;
+	while (p < end && std::isalpha(static_cast<unsigned char>(*p))) ++p;
+	long long counts[3];
+	bool valid = p - keyword >= 3 && std::string(p - 3, p) == "OFF";
+	for (int k = 0; k < 3 && valid; ++k) {
+		skip_off_space(p, end);
+		valid = parse_integer(p, end, counts[k]) && counts[k] >= 0 && counts[k] < (1ll << 31);
+	}
+	if (!valid) {
+		std::cerr << filename << ": not an OFF file" << std::endl;
+		return false;
+	}
+	size_t nv = counts[0], nf = counts[1];
+	const char *body = static_cast<const char *>(memchr(p, '\n', end - p));
+	body = body ? body + 1 : end;
+	size_t header_lines = std::count(file.data, body, '\n');
+
+	// Pass 1: count the data lines of each chunk, a vertex or a face per line
+	std::vector<TextChunk> chunks = split_lines(body, end, threads);
+	parallel_for(chunks.size(), threads, 1, [&](int c) {
+		TextChunk &chunk = chunks[c];
+		for_each_line(chunk, [&](const char *q, const char *eol, size_t) {
+			++chunk.lines;
+			if (is_data_line(q, eol)) ++chunk.items;
+			return true;
+		});
+	});
+	accumulate_chunks(chunks);
+	if (chunks.back().first_item + chunks.back().items < nv + nf) {
+		std::cerr << filename << ": expected " << nv << " vertices and " << nf << " faces" << std::endl;
+		return false;
+	}
+
+	// Pass 2: read the vertices, count the triangles of the faces
+	V.resize(nv, 3);
+	parallel_for(chunks.size(), threads, 1, [&](int c) {
+		TextChunk &chunk = chunks[c];
+		size_t item = chunk.first_item;
+		for_each_line(chunk, [&](const char *q, const char *eol, size_t line) {
+			if (!is_data_line(q, eol)) return true;
+			if (item < nv) {
+				for (int k = 0; k < 3; ++k) {
+					Scalar x;
+					if (!parse_real(q, eol, x)) {
+						chunk.error = "expected 3 vertex coordinates";
+						chunk.error_line = line;
+						return false;
+					}
+					V(item, k) = x;
+				}
+			} else if (item < nv + nf) {
+				long long n;
+				if (!parse_integer(q, eol, n) || n < 3) {
+					chunk.error = "expected a face of at least 3 vertices";
+					chunk.error_line = line;
+					return false;
+				}
+				chunk.triangles += n - 2;
+			} else {
+				return false;
+			}
+			++item;
+			return true;
+		});
+	});
+	if (chunk_error(chunks, filename, header_lines)) return false;
+	accumulate_chunks(chunks);
+
+	// Pass 3: read the faces, split into fans of triangles
+	F.resize(chunks.back().first_triangle + chunks.back().triangles, 3);
+	parallel_for(chunks.size(), threads, 1, [&](int c) {
+		TextChunk &chunk = chunks[c];
+		if (chunk.first_item + chunk.items <= nv) return;
+		size_t item = chunk.first_item;
+		size_t triangle = chunk.first_triangle;
+		for_each_line(chunk, [&](const char *q, const char *eol, size_t line) {
+			if (!is_data_line(q, eol)) return true;
+			if (item >= nv + nf) return false;
+			if (item++ < nv) return true;
+			long long n, index[3];
+			parse_integer(q, eol, n);
+			for (long long k = 0; k < n; ++k) {
+				long long &i = index[std::min<long long>(k, 2)];
+				if (!parse_integer(q, eol, i) || i < 0 || i >= (long long) nv) {
+					chunk.error = "invalid vertex index";
+					chunk.error_line = line;
+					return false;
+				}
+				if (k >= 2) {
+					F.row(triangle++) << int(index[0]), int(index[1]), int(index[2]);
+					index[1] = index[2];
+				}
+			}
+			return true;
+		});
+	});
+	return !chunk_error(chunks, filename, header_lines);
+}
+
+// --- OBJ
+
+// Keyword of an OBJ line ("v", "f", ...) at p, followed by a blank
+inline bool obj_keyword(const char *p, const char *eol, char c) {
+	return p + 1 < eol && p[0] == c && is_blank(p[1]);
+}
+
+// Only the positions ("v x y z") and the faces ("f a b c ...") are read. A corner
+// of a face is v, v/vt, v//vn or v/vt/vn, and a negative v counts back from the
+// last vertex read so far.
+template <typename MatrixV>
+bool load_obj(const std::string &filename, MatrixV &V, Eigen::MatrixXi &F, int threads = default_thread_count()) {
+	typedef typename MatrixV::Scalar Scalar;
+	MappedFile file(filename);
+	if (!file.data) {
+		std::cerr << "Could not read " << filename << std::endl;
+		return false;
+	}
+
+	// Pass 1: count the vertices and the triangles of each chunk
+	std::vector<TextChunk> chunks = split_lines(file.data, file.data + file.size, threads);
+	parallel_for(chunks.size(), threads, 1, [&](int c) {
+		TextChunk &chunk = chunks[c];
+		for_each_line(chunk, [&](const char *q, const char *eol, size_t) {
+			++chunk.lines;
+			skip_blanks(q, eol);
+			if (obj_keyword(q, eol, 'v')) {
+				++chunk.items;
+			} else if (obj_keyword(q, eol, 'f')) {
+				size_t corners = 0;
+				for (++q, skip_blanks(q, eol); q < eol && *q != '#'; skip_blanks(q, eol)) {
+					++corners;
+					while (q < eol && !is_blank(*q)) ++q;
+				}
+				chunk.triangles += std::max<size_t>(corners, 2) - 2;
+			}
+			return true;
+		});
+	});
+	accumulate_chunks(chunks);
+	size_t nv = chunks.back().first_item + chunks.back().items;
+	size_t nt = chunks.back().first_triangle + chunks.back().triangles;
+	if (nv >= (size_t(1) << 31) || nt >= (size_t(1) << 31)) {
+		std::cerr << filename << ": too many vertices or faces" << std::endl;
+		return false;
+	}
+
+	// Pass 2: read them
+	V.resize(nv, 3);
+	F.resize(nt, 3);
+	parallel_for(chunks.size(), threads, 1, [&](int c) {
+		TextChunk &chunk = chunks[c];
+		size_t vertex = chunk.first_item;
+		size_t triangle = chunk.first_triangle;
+		for_each_line(chunk, [&](const char *q, const char *eol, size_t line) {
+			skip_blanks(q, eol);
+			if (obj_keyword(q, eol, 'v')) {
+				++q;
+				for (int k = 0; k < 3; ++k) {
+					Scalar x;
+					if (!parse_real(q, eol, x)) {
+						chunk.error = "expected 3 vertex coordinates";
+						chunk.error_line = line;
+						return false;
+					}
+					V(vertex, k) = x;
+				}
+				++vertex;
+			} else if (obj_keyword(q, eol, 'f')) {
+				long long index[3];
+				int corners = 0;
+				for (++q, skip_blanks(q, eol); q < eol && *q != '#'; skip_blanks(q, eol), ++corners) {
+					long long &i = index[std::min(corners, 2)];
+					if (!parse_integer(q, eol, i) || i == 0 || (q < eol && !is_blank(*q) && *q != '/')) {
+						chunk.error = "invalid face corner";
+						chunk.error_line = line;
+						return false;
+					}
+					i = i > 0 ? i - 1 : (long long) vertex + i;
+					if (i < 0 || i >= (long long) nv) {
+						chunk.error = "vertex index out of range";
+						chunk.error_line = line;
+						return false;
+					}
+					while (q < eol && !is_blank(*q)) ++q; // Texture and normal indices
+					if (corners >= 2) {
+						F.row(triangle++) << int(index[0]), int(index[1]), int(index[2]);
+						index[1] = index[2];
+					}
+				}
+				if (corners < 3) {
+					chunk.error = "expected a face of at least 3 vertices";
+					chunk.error_line = line;
+					return false;
+				}
+			}
+			return true;
+		});
+	});
+	return !chunk_error(chunks, filename);
+}
+
+// --- PLY
+
+struct PlyProperty {
+	std::string name;
+	int type = -1;       // Index in ply_types
+	int count_type = -1; // Type of the size of a list, -1 for a scalar
+};
+
+struct PlyElement {
+	std::string name;
+	size_t count = 0;
+	std::vector<PlyProperty> properties;
+};
+
+struct PlyType {
+	const char *names[2];
+	int size;
+};
+
+const PlyType ply_types[] = {{{"char", "int8"}, 1},    {{"uchar", "uint8"}, 1},     {{"short", "int16"}, 2},
+                             {{"ushort", "uint16"}, 2}, {{"int", "int32"}, 4},      {{"uint", "uint32"}, 4},
+                             {{"float", "float32"}, 4}, {{"double", "float64"}, 8}};
+
+int ply_type(const std::string &name) {
+	for (int t = 0; t < 8; ++t)
+		if (name == ply_types[t].names[0] || name == ply_types[t].names[1]) return t;
+	return -1;
+}
+
+// Value of a little-endian scalar of type t
+double ply_value(const char *p, int t) {
+	switch (t) {
+	case 0: return double(int8_t(*p));
+	case 1: return double(uint8_t(*p));
+	case 2: { int16_t x; memcpy(&x, p, 2); return x; }
+	case 3: { uint16_t x; memcpy(&x, p, 2); return x; }
+	case 4: { int32_t x; memcpy(&x, p, 4); return x; }
+	case 5: { uint32_t x; memcpy(&x, p, 4); return x; }
+	case 6: { float x; memcpy(&x, p, 4); return x; }
+	default: { double x; memcpy(&x, p, 8); return x; }
+	}
+}
+
+// Read the header up to end_header, and move p to the data. Returns an empty
+// string, or the error.
+std::string read_ply_header(const char *&p, const char *end, std::vector<PlyElement> &elements) {
+	const char *header_end = nullptr;
+	for (const char *q = p; q < end && !header_end;) {
+		const char *eol = static_cast<const char *>(memchr(q, '\n', end - q));
+		if (!eol) break;
+		if (std::string(q, eol).compare(0, 10, "end_header") == 0) header_end = eol + 1;
+		q = eol + 1;
+	}
+	if (end - p < 4 || (std::string(p, p + 4) != "ply\n" && std::string(p, p + 4) != "ply\r") || !header_end)
+		return "not a PLY file";
+
+	std::istringstream header(std::string(p, header_end));
+	std::string line;
+	std::getline(header, line);
+	while (std::getline(header, line)) {
+		std::istringstream in(line);
+		std::string keyword;
+		in >> keyword;
+		if (keyword == "format") {
+			std::string format;
+			in >> format;
+			if (format != "binary_little_endian") return "unsupported PLY format " + format;
+		} else if (keyword == "element") {
+			PlyElement element;
+			long long count = -1;
+			in >> element.name >> count;
+			if (count < 0) return "invalid element " + element.name;
+			element.count = count;
+			elements.push_back(element);
+		} else if (keyword == "property") {
+			if (elements.empty()) return "property before any element";
+			PlyProperty property;
+			std::string type;
+			in >> type;
+			if (type == "list") {
+				std::string count_type;
+				in >> count_type >> type;
+				property.count_type = ply_type(count_type);
+				if (property.count_type < 0 || property.count_type >= 6) return "invalid list size type " + count_type;
+			}
+			in >> property.name;
+			property.type = ply_type(type);
+			if (property.type < 0) return "invalid property type " + type;
+			elements.back().properties.push_back(property);
+		}
+	}
+	p = header_end;
+	return "";
+}
+
+// Size of the data of an element, walking through its records when it has lists
+// (0 if it runs past 'end')
+size_t ply_element_size(const PlyElement &element, const char *p, const char *end) {
+	size_t stride = 0;
+	bool lists = false;
+	for (const PlyProperty &property: element.properties) {
+		if (property.count_type < 0) stride += ply_types[property.type].size;
+		else lists = true;
+	}
+	if (!lists) return size_t(end - p) / std::max<size_t>(stride, 1) >= element.count ? element.count * stride : 0;
+
+	const char *q = p;
+	for (size_t i = 0; i < element.count; ++i) {
+		for (const PlyProperty &property: element.properties) {
+			size_t size = ply_types[property.count_type < 0 ? property.type : property.count_type].size;
+			if (size_t(end - q) < size) return 0;
+			if (property.count_type >= 0) {
+				double n = ply_value(q, property.count_type);
+				q += size;
+				size = size_t(std::max(n, 0.0)) * ply_types[property.type].size;
+				if (size_t(end - q) < size) return 0;
+			}
+			q += size;
+		}
+	}
+	return q - p;
+}
+
+// Binary little-endian PLY, with the positions in the x, y and z properties of
+// the "vertex" element and the faces in the vertex_indices (or vertex_index) list
+// of the "face" element. When all the faces are triangles, which is checked first,
+// the face records have a fixed size and are read on several threads.
+template <typename MatrixV>
+bool load_ply(const std::string &filename, MatrixV &V, Eigen::MatrixXi &F, int threads = default_thread_count()) {
+	typedef typename MatrixV::Scalar Scalar;
+	MappedFile file(filename);
+	if (!file.data) {
+		std::cerr << "Could not read " << filename << std::endl;
+		return false;
+	}
+	const char *p = file.data, *end = file.data + file.size;
+	std::vector<PlyElement> elements;
+	std::string error = read_ply_header(p, end, elements);
+	auto fail = [&](const std::string &message) {
+		std::cerr << filename << ": " << message << std::endl;
+		return false;
+	};
+	if (!error.empty()) return fail(error);
+
+	size_t nv = 0;
+	for (const PlyElement &element: elements)
+		if (element.name == "vertex") nv = element.count;
+	if (nv >= (size_t(1) << 31)) return fail("too many vertices");
+	V.resize(nv, 3);
+	F.resize(0, 3);
+
+	for (const PlyElement &element: elements) {
+		size_t size = ply_element_size(element, p, end);
+		if (size == 0 && element.count > 0) return fail("truncated element " + element.name);
+
+		if (element.name == "vertex") {
+			size_t offset[3] = {0, 0, 0}, stride = 0;
+			int type[3] = {-1, -1, -1};
+			for (const PlyProperty &property: element.properties) {
+				if (property.count_type >= 0) return fail("list in the vertex element");
+				for (int k = 0; k < 3; ++k) {
+					if (property.name != std::string(1, char('x' + k))) continue;
+					offset[k] = stride;
+					type[k] = property.type;
+				}
+				stride += ply_types[property.type].size;
+			}
+			if (type[0] < 0 || type[1] < 0 || type[2] < 0) return fail("missing vertex coordinates");
+			parallel_for(int(nv), threads, 4096, [&](int i) {
+				for (int k = 0; k < 3; ++k)
+					V(i, k) = Scalar(ply_value(p + i * stride + offset[k], type[k]));
+			});
+		} else if (element.name == "face") {
+			// Offsets in a record of triangles
+			int list = -1;
+			size_t list_offset = 0, stride = 0;
+			bool scalars = true; // The other properties are scalars
+			for (size_t j = 0; j < element.properties.size(); ++j) {
+				const PlyProperty &property = element.properties[j];
+				if (property.count_type >= 0 && list < 0 &&
+				    (property.name == "vertex_indices" || property.name == "vertex_index")) {
+					list = j;
+					list_offset = stride;
+					stride += ply_types[property.count_type].size + 3 * ply_types[property.type].size;
+				} else {
+					scalars = scalars && property.count_type < 0;
+					stride += ply_types[property.type].size;
+				}
+			}
+			if (list < 0) return fail("missing vertex_indices in the face element");
+			if (element.count >= (size_t(1) << 31)) return fail("too many faces");
+			const PlyProperty &indices = element.properties[list];
+			if (indices.type >= 6) return fail("vertex_indices of a floating point type");
+			size_t index_size = ply_types[indices.type].size;
+			size_t count_size = ply_types[indices.count_type].size;
+
+			std::atomic<bool> triangles(scalars && size == element.count * stride);
+			if (triangles) {
+				parallel_for(int(element.count), threads, 4096, [&](int i) {
+					if (ply_value(p + i * stride + list_offset, indices.count_type) != 3) triangles = false;
+				});
+			}
+
+			std::atomic<bool> valid(true);
+			if (triangles) {
+				F.resize(element.count, 3);
+				parallel_for(int(element.count), threads, 4096, [&](int i) {
+					const char *q = p + i * stride + list_offset + count_size;
+					for (int k = 0; k < 3; ++k) {
+						double v = ply_value(q + k * index_size, indices.type);
+						if (v < 0 || v >= nv) valid = false;
+						F(i, k) = int(v);
+					}
+				});
+			} else {
+				// Polygons: count the triangles, then read the fans
+				std::vector<int> corners;
+				for (int pass = 0; pass < 2; ++pass) {
+					const char *q = p;
+					size_t triangle = 0;
+					for (size_t i = 0; i < element.count; ++i) {
+						for (int j = 0; j < int(element.properties.size()); ++j) {
+							const PlyProperty &property = element.properties[j];
+							if (property.count_type < 0) {
+								q += ply_types[property.type].size;
+								continue;
+							}
+							size_t n = size_t(std::max(ply_value(q, property.count_type), 0.0));
+							q += ply_types[property.count_type].size;
+							if (j == list) {
+								if (n < 3) return fail("face of less than 3 vertices");
+								for (size_t k = 0; pass == 1 && k < n; ++k) {
+									double v = ply_value(q + k * index_size, indices.type);
+									if (v < 0 || v >= nv) valid = false;
+									corners.push_back(int(v));
+								}
+								for (size_t k = 2; pass == 1 && k < n; ++k)
+									F.row(triangle + k - 2) << corners[0], corners[k - 1], corners[k];
+								corners.clear();
+								triangle += n - 2;
+							}
+							q += n * ply_types[property.type].size;
+						}
+					}
+					if (pass == 0) F.resize(triangle, 3);
+				}
+			}
+			if (!valid) return fail("vertex index out of range");
+		}
+		p += size;
+	}
+	return true;
+}
+
+// --- Any format
+
+// Load a mesh, in the format given by the extension of the file (.off, .obj or .ply)
+template <typename MatrixV>
+bool load_mesh(const std::string &filename, MatrixV &V, Eigen::MatrixXi &F, int threads = default_thread_count()) {
+	size_t dot = filename.find_last_of('.');
+	std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	if (extension == "off") return load_off(filename, V, F, threads);
+	if (extension == "obj") return load_obj(filename, V, F, threads);
+	if (extension == "ply") return load_ply(filename, V, F, threads);
+	std::cerr << filename << ": unknown mesh format" << std::endl;
+	return false;
+}
+
+#endif